@@ -0,0 +1,458 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <sys/wait.h>
+
+#include "common_utils.h"
+#include "rbpi.h"
+#include "swd.h"
+#include "dap.h"
+#include "transport.h"
+#include "flash_stub.h"
+
+// Benchmarks, so there's a number to compare against when something gets faster (or slower).
+//
+// encode: how long it takes to turn a transaction into SPI words. Host only, no SPI needed.
+//   per-call (loop parity)  what perform_swd_io used to do, bit counting loops for the parity
+//   per-call (tables)       what perform_swd_io does now, header/parity lookup tables
+//   compile                 swd_compile_program, paid once per program
+//   compiled replay         sending an already compiled program, just copying its words out
+//
+// The rest talk to a target, so RBPI_TRANSPORT picks real hardware (needs sudo) or the sim.
+// The core gets halted for them and a few KB of RAM get overwritten.
+//   spi     spi_io round trip for a single SPI word
+//   swd     perform_swd_io reads (DPIDR) and writes (SELECT)
+//   mem     mem_ap_read/mem_ap_write of single words and 1KB block reads/writes to RAM
+//   target  spi, swd and mem (the default)
+//   flash   runs the flash program next to this one on a synthetic image, start to finish.
+//           This ERASES the watch's firmware, so it only runs when asked for by name.
+//
+// Every measurement gets a mean and p50/p90/p99/max per operation. --json writes the
+// same thing out for keeping track of it per commit (--label ends up in there too).
+
+#define N_OPS 32
+#define N_ROUNDS 20000
+#define N_SAMPLES 2000
+#define BENCH_RAM_ADDR 0x20004000
+#define MAX_RESULTS 32
+
+typedef struct BenchResult {
+    const char* name;
+    unsigned long n;        // Number of operations
+    double mean_ns;
+    uint64_t p50_ns, p90_ns, p99_ns, max_ns; // Only if there were per-operation samples
+    int have_percentiles;
+    unsigned int bytes;     // Payload per operation, 0 if it doesn't make sense
+} BenchResult;
+
+static BenchResult results[MAX_RESULTS];
+static unsigned int n_results = 0;
+static uint64_t samples[N_SAMPLES];
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static uint8_t loop_header_word(SWD_Header header_values) {
+    // create_header_word the way it was before the lookup table
+    uint8_t word = 0x81;
+    word |= header_values.APnDP ? (1<<1) : 0;
+    word |= header_values.RnW ? (1<<2) : 0;
+    word |= ((header_values.addr>>2) & 0x3) << 3;
+    word |= has_even_parity(word & 0x1E, 8) ? 0 : 1<<5;
+    return word;
+}
+
+static void encode_loop_parity(const SWD_Packet* packet, SWD_Bitstream* stream) {
+    swd_stream_append(stream, loop_header_word(packet->header), 8);
+    swd_stream_append(stream, 0x1, 1);
+    swd_stream_append(stream, 0x7, 3);
+    swd_stream_append(stream, 0x1, 1);
+    swd_stream_append(stream, packet->data, 32);
+    swd_stream_append(stream, has_even_parity(packet->data, 32) ? 0 : 1, 1);
+    swd_stream_append(stream, 0x0, SWD_IDLE_BITS);
+}
+
+static void report(const char* name, uint64_t elapsed_ns, unsigned long transactions) {
+    printf("%-26s %8.1f ns/transaction\n", name, (double) elapsed_ns / transactions);
+    if(n_results < MAX_RESULTS) {
+        BenchResult* result = &results[n_results++];
+        memset(result, 0, sizeof(*result));
+        result->name = name;
+        result->n = transactions;
+        result->mean_ns = (double) elapsed_ns / transactions;
+    }
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void report_samples(const char* name, uint64_t* times, unsigned long n, unsigned int bytes) {
+    // 'times' gets sorted
+    uint64_t total = 0;
+    unsigned long i;
+    if(n == 0 || n_results == MAX_RESULTS) {
+        return;
+    }
+    for(i = 0; i < n; i++) {
+        total += times[i];
+    }
+    qsort(times, n, sizeof(times[0]), compare_u64);
+    BenchResult* result = &results[n_results++];
+    result->name = name;
+    result->n = n;
+    result->mean_ns = (double) total / n;
+    result->p50_ns = times[(n - 1) / 2];
+    result->p90_ns = times[(n - 1) * 90 / 100];
+    result->p99_ns = times[(n - 1) * 99 / 100];
+    result->max_ns = times[n - 1];
+    result->have_percentiles = 1;
+    result->bytes = bytes;
+
+    printf("%-20s mean %10.0f ns  p50 %9" PRIu64 "  p90 %9" PRIu64 "  p99 %9" PRIu64 "  max %9" PRIu64 "  %8.0f ops/s",
+           name, result->mean_ns, result->p50_ns, result->p90_ns, result->p99_ns, result->max_ns, 1e9 / result->mean_ns);
+    if(bytes) {
+        printf("  %8.1f KB/s", bytes * 1e9 / result->mean_ns / 1024);
+    }
+    printf("\n");
+}
+
+static void bench_encode() {
+    SWD_Op ops[N_OPS];
+    SWD_Packet packets[N_OPS];
+    static SWD_Program program;
+    uint32_t mosi[SWD_STREAM_MAX_WORDS];
+    unsigned int lengths[SWD_STREAM_MAX_WORDS];
+    volatile uint32_t sink = 0; // Stops the compiler throwing the work away
+    unsigned int i, round;
+    uint64_t start;
+
+    for(i = 0; i < N_OPS; i++) {
+        uint32_t data = 0x9E3779B9u * (i + 1);
+        ops[i] = swd_op_transfer(1, 0, DRW_OFFSET, data);
+        packets[i] = swd_write_ap_addr(DRW_OFFSET, data);
+    }
+
+    start = now_ns();
+    for(round = 0; round < N_ROUNDS; round++) {
+        for(i = 0; i < N_OPS; i++) {
+            SWD_Bitstream stream;
+            swd_stream_init(&stream);
+            encode_loop_parity(&packets[i], &stream);
+            sink += swd_stream_slice(&stream, mosi, lengths) + mosi[0];
+        }
+    }
+    report("per-call (loop parity)", now_ns() - start, (unsigned long) N_ROUNDS*N_OPS);
+
+    start = now_ns();
+    for(round = 0; round < N_ROUNDS; round++) {
+        for(i = 0; i < N_OPS; i++) {
+            SWD_Bitstream stream;
+            SWD_FrameOffsets frame;
+            swd_stream_init(&stream);
+            swd_stream_append_packet(&stream, &packets[i], &frame);
+            swd_stream_append(&stream, 0x0, SWD_IDLE_BITS);
+            sink += swd_stream_slice(&stream, mosi, lengths) + mosi[0];
+        }
+    }
+    report("per-call (tables)", now_ns() - start, (unsigned long) N_ROUNDS*N_OPS);
+
+    start = now_ns();
+    for(round = 0; round < N_ROUNDS; round++) {
+        swd_compile_program(ops, N_OPS, &program);
+        sink += program.n_words;
+    }
+    report("compile", now_ns() - start, (unsigned long) N_ROUNDS*N_OPS);
+
+    start = now_ns();
+    for(round = 0; round < N_ROUNDS; round++) {
+        memcpy(mosi, program.mosi, program.n_words*sizeof(mosi[0]));
+        memcpy(lengths, program.lengths, program.n_words*sizeof(lengths[0]));
+        sink += mosi[round % program.n_words];
+    }
+    report("compiled replay", now_ns() - start, (unsigned long) N_ROUNDS*N_OPS);
+    (void) sink;
+}
+
+static int connect_target(SPIRegisters spi_registers) {
+    /* The same start as flash: line reset, DPIDR, debug power, then the MEM-AP
+     * with the core halted so it leaves the RAM being used alone.
+     */
+    SWD_SELECT_Reg select_reg = { .APSEL = 0x0, .APBANKSEL = 0x0, .DPBANKSEL = 0x0 };
+    SWD_Packet packet;
+    int err;
+
+    if((err = swd_connect(spi_registers, NULL))) {
+        printf("Could not connect\n");
+        return err;
+    }
+
+    packet = swd_write_select_reg(select_reg);
+    if((err = perform_swd_io(spi_registers, &packet)) ||
+       (err = write_csw(spi_registers, 0)) ||
+       (err = mem_ap_write(spi_registers, DHCSR_ADDR, DHCSR_KEY | DHCSR_C_HALT | DHCSR_C_DEBUGEN))) {
+        printf("Error(%i) getting to the MEM-AP\n", err);
+        return err;
+    }
+    return 0;
+}
+
+static void bench_spi(SPIRegisters spi_registers) {
+    // 12 low bits is just idle on the SWD line, so this can go out as often as it likes
+    unsigned int i;
+    for(i = 0; i < N_SAMPLES; i++) {
+        SPI_Data data;
+        data.n_writes = 1;
+        data.mosi[0] = 0x0;
+        data.lengths[0] = 12;
+        uint64_t start = now_ns();
+        spi_io(spi_registers, &data);
+        samples[i] = now_ns() - start;
+    }
+    report_samples("spi_io", samples, N_SAMPLES, 0);
+}
+
+static void bench_swd(SPIRegisters spi_registers) {
+    SWD_SELECT_Reg select_reg = { .APSEL = 0x0, .APBANKSEL = 0x0, .DPBANKSEL = 0x0 };
+    unsigned int i, n = 0;
+    for(i = 0; i < N_SAMPLES; i++) {
+        SWD_Packet packet = swd_read_dpidr_reg();
+        uint64_t start = now_ns();
+        if(perform_swd_io(spi_registers, &packet) == SWD_OK) {
+            samples[n++] = now_ns() - start;
+        }
+    }
+    report_samples("swd_read", samples, n, 4);
+
+    for(i = 0, n = 0; i < N_SAMPLES; i++) {
+        SWD_Packet packet = swd_write_select_reg(select_reg);
+        // Otherwise writing the same SELECT again never leaves dap.c
+        dap_cache_invalidate();
+        uint64_t start = now_ns();
+        if(perform_swd_io(spi_registers, &packet) == SWD_OK) {
+            samples[n++] = now_ns() - start;
+        }
+    }
+    report_samples("swd_write", samples, n, 4);
+}
+
+static void bench_mem(SPIRegisters spi_registers) {
+    uint32_t block[TAR_WRAP_SIZE/4];
+    uint32_t readback[TAR_WRAP_SIZE/4];
+    volatile uint32_t sink = 0;
+    unsigned int i, n = 0, n_blocks = N_SAMPLES/8;
+    for(i = 0; i < TAR_WRAP_SIZE/4; i++) {
+        block[i] = 0x9E3779B9u * (i + 1);
+    }
+
+    for(i = 0; i < N_SAMPLES; i++) {
+        uint64_t start = now_ns();
+        if(mem_ap_write(spi_registers, BENCH_RAM_ADDR + (i % 256)*4, i) == SWD_OK) {
+            samples[n++] = now_ns() - start;
+        }
+    }
+    report_samples("mem_ap_write", samples, n, 4);
+
+    for(i = 0, n = 0; i < N_SAMPLES; i++) {
+        uint64_t start = now_ns();
+        uint32_t value;
+        if(mem_ap_read(spi_registers, BENCH_RAM_ADDR + (i % 256)*4, &value) == SWD_OK) {
+            samples[n++] = now_ns() - start;
+            sink += value;
+        }
+    }
+    report_samples("mem_ap_read", samples, n, 4);
+
+    for(i = 0, n = 0; i < n_blocks; i++) {
+        uint64_t start = now_ns();
+        if(mem_ap_write_block(spi_registers, BENCH_RAM_ADDR, block, TAR_WRAP_SIZE/4) == SWD_OK) {
+            samples[n++] = now_ns() - start;
+        }
+    }
+    report_samples("mem_ap_write_block", samples, n, TAR_WRAP_SIZE);
+
+    for(i = 0, n = 0; i < n_blocks; i++) {
+        uint64_t start = now_ns();
+        if(mem_ap_read_block(spi_registers, BENCH_RAM_ADDR, readback, TAR_WRAP_SIZE/4) == SWD_OK) {
+            samples[n++] = now_ns() - start;
+        }
+    }
+    report_samples("mem_ap_read_block", samples, n, TAR_WRAP_SIZE);
+    if(memcmp(block, readback, sizeof(block)) != 0) {
+        printf("mem_ap_read_block didn't read back what mem_ap_write_block wrote!\n");
+    }
+    (void) sink;
+}
+
+static int run_flash(const char* flash_path, const char* image_path) {
+    // Output goes to /dev/null, only how long it took and whether it worked matter here
+    pid_t pid = fork();
+    int status;
+    if(pid < 0) {
+        return 1;
+    }
+    if(pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+        if(fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        execl(flash_path, flash_path, image_path, (char*) NULL);
+        _exit(127);
+    }
+    if(waitpid(pid, &status, 0) < 0) {
+        return 1;
+    }
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+static void bench_flash(const char* argv0, unsigned int image_size, unsigned int runs) {
+    /* Full erase, write and readback check of a random image, by running the real
+     * flash program (from the same directory as this one) so nothing is left out.
+     */
+    char flash_path[1024];
+    char image_path[] = "/tmp/rbpi_bench_XXXXXX";
+    const char* slash = strrchr(argv0, '/');
+    uint32_t x = 0x12345678;
+    unsigned int i, n = 0;
+
+    snprintf(flash_path, sizeof(flash_path), "%.*sflash", slash ? (int) (slash - argv0 + 1) : 0, argv0);
+    int fd = mkstemp(image_path);
+    if(fd < 0) {
+        printf("Could not create synthetic image\n");
+        return;
+    }
+    for(i = 0; i < image_size/4; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        if(write(fd, &x, 4) != 4) {
+            printf("Could not write synthetic image\n");
+            close(fd);
+            unlink(image_path);
+            return;
+        }
+    }
+    close(fd);
+
+    for(i = 0; i < runs && i < N_SAMPLES; i++) {
+        uint64_t start = now_ns();
+        if(run_flash(flash_path, image_path)) {
+            printf("'%s %s' failed\n", flash_path, image_path);
+            continue;
+        }
+        samples[n++] = now_ns() - start;
+    }
+    unlink(image_path);
+    report_samples("flash", samples, n, image_size);
+}
+
+static int write_json(const char* path, const char* label, const char* transport) {
+    FILE* fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    unsigned int i;
+    if(!fp) {
+        printf("Could not open '%s'\n", path);
+        return 1;
+    }
+    fprintf(fp, "{\n  \"label\": \"%s\",\n  \"transport\": \"%s\",\n  \"results\": [\n", label, transport);
+    for(i = 0; i < n_results; i++) {
+        const BenchResult* r = &results[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"n\": %lu, \"mean_ns\": %.1f", r->name, r->n, r->mean_ns);
+        if(r->have_percentiles) {
+            fprintf(fp, ", \"p50_ns\": %" PRIu64 ", \"p90_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64,
+                    r->p50_ns, r->p90_ns, r->p99_ns, r->max_ns);
+        }
+        fprintf(fp, ", \"ops_per_sec\": %.1f", 1e9 / r->mean_ns);
+        if(r->bytes) {
+            fprintf(fp, ", \"bytes_per_sec\": %.1f", r->bytes * 1e9 / r->mean_ns);
+        }
+        fprintf(fp, "}%s\n", i + 1 < n_results ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    if(fp != stdout) {
+        fclose(fp);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    static struct option long_options[] = {
+        {"json", required_argument, NULL, 'j'},
+        {"label", required_argument, NULL, 'L'},
+        {"image-size", required_argument, NULL, 'i'},
+        {"runs", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* json_path = NULL;
+    const char* label = "";
+    unsigned int image_size = 0x20000;
+    unsigned int runs = 3;
+    int opt;
+    while((opt = getopt_long(argc, argv, "j:L:i:r:", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 'j':
+                json_path = optarg;
+                break;
+            case 'L':
+                label = optarg;
+                break;
+            case 'i':
+                image_size = strtoul(optarg, NULL, 0) & ~0x3u;
+                break;
+            case 'r':
+                runs = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                printf("Usage: %s [--json file|-] [--label text] [--image-size bytes] [--runs n] [encode|spi|swd|mem|flash|target]\n", argv[0]);
+                return 1;
+        }
+    }
+    const char* which = optind < argc ? argv[optind] : "target";
+    const char* transport = getenv("RBPI_TRANSPORT") ? getenv("RBPI_TRANSPORT") : "aux";
+    int all = strcmp(which, "target") == 0;
+
+    if(strcmp(which, "encode") == 0) {
+        bench_encode();
+        transport = "none";
+    } else if(all || strcmp(which, "spi") == 0 || strcmp(which, "swd") == 0 || strcmp(which, "mem") == 0) {
+        SPIRegisters spi_registers = init_spi_or_die();
+        if(connect_target(spi_registers)) {
+            clean_up_spi();
+            return 1;
+        }
+        if(all || strcmp(which, "spi") == 0) {
+            bench_spi(spi_registers);
+        }
+        if(all || strcmp(which, "swd") == 0) {
+            bench_swd(spi_registers);
+        }
+        if(all || strcmp(which, "mem") == 0) {
+            bench_mem(spi_registers);
+        }
+        // Let the core go again
+        mem_ap_write(spi_registers, DHCSR_ADDR, DHCSR_KEY);
+        clean_up_spi();
+    } else if(strcmp(which, "flash") != 0) {
+        printf("Unknown benchmark '%s'\n", which);
+        return 1;
+    }
+    // After clean_up_spi, flash needs the SPI to itself
+    if(strcmp(which, "flash") == 0) {
+        bench_flash(argv[0], image_size, runs);
+    }
+
+    if(json_path) {
+        return write_json(json_path, label, transport);
+    }
+    return 0;
+}
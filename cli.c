@@ -5,9 +5,10 @@
 #include "linenoise/linenoise.h"
 #include "rbpi.h"
 #include "swd.h"
-#define CSW_OFFSET 0x0
-#define TAR_OFFSET 0x4
-#define DRW_OFFSET 0xC
+#include "transport.h"
+#include "dap.h"
+#include "metrics.h"
+#include "trace.h"
 typedef int (*SWDFunc)(uint32_t* args);
 
 typedef struct Command {
@@ -18,105 +19,29 @@ typedef struct Command {
 
 SPIRegisters spi_registers; // Global store for various RBPI SPI regs
 
-int perform_swd_io(SPIRegisters spi_registers, SWD_Packet* packet_data) {
-    /* This function uses the data in 'packet_data' to create an SPI_Data packet which
-     * is then sent out to the SPI interface where the actual "on the wire" stuff happens.
-     *
-     * If the "packet_data" is a read operation, then the response is packed into the "data"
-     * field of the packet_data. For both a read and a write operation the "ack" field
-     * of packet_data is filled in.
-     */
-
-    //First thing is to send out the header and read back the response (which should include the ACK)
-    uint32_t header_word = create_header_word(packet_data->header);
-    int parity_bit;
-
-
-    printf("Debug: %s", packet_data->debug_string);
-    SPI_Data spi_data;
-    spi_data.n_writes = 1;
-    spi_data.mosi[0] = header_word;
-
-    // Need to pad the header word with some extra bits so that the ACK gets sent back.
-    // If this is a read operation the padding is 4 bits (1 turnaround + 3 ACK bits).
-    // If this is a write operation the padding is 5 bits (1 turnaround + 3 ACK bits + 1 turnaround)
-    // TODO, logically this should be done in SWD.c but that's a pain so we'll just do it here
-    spi_data.mosi[0] |= 0b1111 << 8;
-    spi_data.lengths[0] = 12;
-    if(!packet_data->header.RnW) {
-        spi_data.mosi[0] |= 1<<12;
-        spi_data.lengths[0] += 1;
-    }
-    spi_io(spi_registers, &spi_data);
-    packet_data->ack = (spi_data.miso[0] >> 9) & 0b111;
-
-
-    // TODO, implement something here.
-    switch(packet_data->ack) {
-        case ACK_OK:
-            break;
-        case ACK_WAIT:
-            printf("ACK_WAIT recieved\n");
-            return SWD_ACK_WAIT;
-        case ACK_FAULT:
-            printf("ACK_FAULT recieved\n");
-            return SWD_ACK_FAULT;
-        default:
-            printf("Invalid ACK from slave device ACK = 0x%x\n", packet_data->ack);
-            //return SWD_ACK_UNKNOWN;
-    }
-
-    // If here we can continue with the transfer
-    if(packet_data->header.RnW) {
-        // Read data is all 1s to provide a pull-up.
-        // The slave device will do the actual work
-        spi_data.mosi[0] = 0xFFFF;
-        spi_data.lengths[0] = 16;
-        spi_data.mosi[1] = 0x1FFFF;
-        spi_data.lengths[1] = 17;
-
-    } else {
-        // I could rely on the user to send in the correct parity bit...
-        // but why not just do it here.
-        parity_bit = has_even_parity(packet_data->data, 32) ? 0 : 1;
-        spi_data.mosi[0] = packet_data->data & 0xFFFF;
-        spi_data.lengths[0] = 16;
-        spi_data.mosi[1] = ((packet_data->data >> 16) & 0xFFFF);
-        spi_data.mosi[1] |= parity_bit ? 1 << 16 : 0; // Add the parity bit
-        spi_data.lengths[1] = 17;
-    }
-
-    // Need to "close" the transaction with at least 8 "idles".
-    spi_data.mosi[2] = 0x0;
-    spi_data.lengths[2] = 16;
-    spi_data.n_writes = 3;
-
-
-    spi_io(spi_registers, &spi_data); // Send it
-
-    // If this was a read-op then get the data back and stuff in "packet_data"
-    if(packet_data->header.RnW) {
-        packet_data->data = spi_data.miso[0] | (spi_data.miso[1] << 16);
-        packet_data->parity = (spi_data.miso[1] >> 16) & 0x1;
-
-        int expected_parity = !has_even_parity(packet_data->data, 32);
-
-        if(!packet_data->parity != !expected_parity) {
-            printf("Parity mismatch 0x%x %i\n", packet_data->data, packet_data->parity);
-            printf("MISO = 0x%x\n", spi_data.miso[1]);
-            return SWD_PARITY_MISMATCH;
-        }
+static int queued_read(SWD_Packet* packet) {
+    // One read through the queue, which sorts out AP reads being posted
+    SWD_QueueResult result = { .err = SWD_NOT_RUN, .ack = 0, .data = 0 };
+    int err = swd_queue_packet(spi_registers, packet, &result);
+    if(!err) {
+        err = swd_flush(spi_registers);
     }
-    return SWD_OK; 
+    packet->ack = result.ack;
+    packet->data = result.data;
+    return err;
 }
 
 int jtag_to_swd(uint32_t* args) {
     SPI_Data swd_to_jtag_data = swd_jtag_to_swd();
+    dap_cache_invalidate();
+    swd_trace_event(SWD_TRACE_JTAG_TO_SWD);
     spi_io(spi_registers, &swd_to_jtag_data);
     return 0;
 }
 int swd_reset(uint32_t* args) {
     SPI_Data reset_data = swd_protocol_reset();
+    dap_cache_invalidate();
+    swd_trace_event(SWD_TRACE_LINE_RESET);
     spi_io(spi_registers, &reset_data);
     return 0;
 }
@@ -134,7 +59,7 @@ int write_select_reg(uint32_t* args) {
 
 int read_protect_status(uint32_t* args) {
     SWD_Packet read_prot_status = swd_read_protect_status_reg();
-    perform_swd_io(spi_registers, &read_prot_status);
+    queued_read(&read_prot_status);
     printf("PROT Status = 0x%x\n", read_prot_status.data);
     return 0;
 }
@@ -149,7 +74,7 @@ int read_dpid(uint32_t* args) {
 int read_idrcode(uint32_t* args) {
 
     SWD_Packet read_ap_id_packet = swd_read_ap_idcode();
-    perform_swd_io(spi_registers, &read_ap_id_packet);
+    queued_read(&read_ap_id_packet);
     printf("IDR = 0x%x\n", read_ap_id_packet.data);
     struct SWD_APIDRCode idr_reg = interpret_ap_idr_code(read_ap_id_packet.data);
 
@@ -164,8 +89,7 @@ int read_idrcode(uint32_t* args) {
 int read_ap_addr(uint32_t* args) {
     uint8_t addr = args[0];
     SWD_Packet packet = swd_read_ap_addr(addr);
-    perform_swd_io(spi_registers, &packet);
-    perform_swd_io(spi_registers, &packet);
+    queued_read(&packet);
 
     printf("Value at addr=0x%x = 0x%x\n", addr, packet.data);
     return 0;
@@ -182,8 +106,20 @@ int write_ap_addr(uint32_t* args) {
 }
 
 int write_abort(uint32_t* args) {
-    printf("NOT IMPLEMENTED!!!\n");
-    return 0;
+    // The raw ABORT value: DAPABORT=0x1 STKCMPCLR=0x2 STKERRCLR=0x4 WDERRCLR=0x8 ORUNERRCLR=0x10
+    if(args == NULL) {
+        printf("No arguments given to 'write_abort'\n");
+        return -1;
+    }
+    SWD_ABORT_Reg reg = {
+     .ORUNERRCLR = (args[0] >> 4) & 0x1,
+     .WDERRCLR = (args[0] >> 3) & 0x1,
+     .SKERRCLR = (args[0] >> 2) & 0x1,
+     .STKCMPCLR = (args[0] >> 1) & 0x1,
+     .DAPABORT = args[0] & 0x1 };
+
+    SWD_Packet write_abort_reg = swd_write_abort_reg(reg);
+    return perform_swd_io(spi_registers, &write_abort_reg);
 }
 
 int read_ctrlstat(uint32_t* args) {
@@ -229,15 +165,14 @@ int do_erase_all(uint32_t* args) {
 
 int read_erase_status(uint32_t* args) {
     SWD_Packet erase_status = swd_read_erase_status();
-    perform_swd_io(spi_registers, &erase_status);
+    queued_read(&erase_status);
     printf("Erase Status = 0x%x\n", erase_status.data);
     return 0;
 }
 
 int read_csw(uint32_t* args) {
     SWD_Packet read_csw = swd_read_ap_addr(CSW_OFFSET);
-    perform_swd_io(spi_registers, &read_csw);
-    perform_swd_io(spi_registers, &read_csw);
+    queued_read(&read_csw);
 
     MEM_AP_CSW_Reg csw = interpret_ap_csw_reg(read_csw.data);
     printf("MEM-AP CSW  = 0x%x\n", read_csw.data);
@@ -253,15 +188,14 @@ int read_csw(uint32_t* args) {
     return 0;
 }
 
-int read_tar(uint32_t* args) {
+int cmd_read_tar(uint32_t* args) {
     SWD_Packet read_tar_reg = swd_read_ap_addr(TAR_OFFSET);
-    perform_swd_io(spi_registers, &read_tar_reg);
-    perform_swd_io(spi_registers, &read_tar_reg);
+    queued_read(&read_tar_reg);
     printf("TAR = 0x%x\n", read_tar_reg.data);
     return read_tar_reg.data;
 }
 
-int write_tar(uint32_t* args) {
+int cmd_write_tar(uint32_t* args) {
     if(args == NULL) {
         printf("No arguments given to 'write_tar'\n");
         return -1;
@@ -271,15 +205,14 @@ int write_tar(uint32_t* args) {
     return 0;
 }
 
-int read_drw(uint32_t* args) {
+int cmd_read_drw(uint32_t* args) {
     SWD_Packet read_drw_reg = swd_read_ap_addr(DRW_OFFSET);
-    perform_swd_io(spi_registers, &read_drw_reg);
-    perform_swd_io(spi_registers, &read_drw_reg);
+    queued_read(&read_drw_reg);
     printf("DRW = 0x%x\n", read_drw_reg.data);
     return 0;
 }
 
-int write_drw(uint32_t* args) {
+int cmd_write_drw(uint32_t* args) {
     if(args == NULL) {
         printf("No arguments given to 'write_drw'\n");
         return -1;
@@ -306,48 +239,13 @@ Command commandTable[] = {
     {"read_ap_addr", 1, read_ap_addr},
     {"write_ap_addr", 2, write_ap_addr},
     {"read_ap_csw", 0, read_csw},
-    {"read_tar", 0, read_tar},
-    {"read_drw", 0, read_drw},
-    {"write_tar", 1, write_tar},
-    {"write_drw", 1, write_drw},
+    {"read_tar", 0, cmd_read_tar},
+    {"read_drw", 0, cmd_read_drw},
+    {"write_tar", 1, cmd_write_tar},
+    {"write_drw", 1, cmd_write_drw},
     {NULL, 0, NULL} // Must be last
 };
 
-SPIRegisters init_spi_or_die() {
-    uint32_t* mem = create_gpio_mmap();
-    if(!mem) {
-        printf("Could not create RBPI GPIO memory map\n");
-       exit(0);
-    }
-    SPIRegisters _spi_registers = init_aux_spi(mem);
-    const uint32_t ENABLE_AUX_SPI1 = 0x2; // Bit 1
-    *(_spi_registers.enable) = ENABLE_AUX_SPI1;
-
-    // Now  adjust the control reg
-    ControlReg control_reg = {
-        .speed = 0x28,
-        .chip_select_pattern = 0,
-        .post_input_mode = 0,
-        .variable_cs = 0,
-        .variable_width = 1,
-        .dout_hold_time = 4,
-        .enable = 1,
-        .in_rising = 1,
-        .clear_fifos = 0,
-        .out_rising = 1,
-        .invert_clk =0,
-        .msb_out_first = 0,
-        .shift_length = 0,
-        .cs_high_time = 0,
-        .tx_empty_irq = 0,
-        .done_irq = 0,
-        .msb_in_first = 0,
-        .keep_input = 0
-        };
-    write_control_reg(_spi_registers, control_reg);
-    return _spi_registers;
-}
-
 void handle_line(char* line) {
     int i;
     const int MAX_ARGS=16;
@@ -491,6 +389,6 @@ int main(int argc, char **argv) {
         }
         free(line);
     }
-    clean_up_mmap();
+    clean_up_spi();
     return 0;
 }
@@ -26,3 +26,27 @@ uint32_t reverse_bits(const uint32_t word, const unsigned int n) {
     }
     return ret;
 }
+
+uint32_t crc32_words(const uint32_t* words, unsigned int n) {
+    // Plain CRC32 (same as zlib) over little endian words, matches the CRC stub in flash_stub.c
+    static uint32_t table[256];
+    static int have_table = 0;
+    uint32_t crc = 0xFFFFFFFF;
+    unsigned int i, j;
+    if(!have_table) {
+        for(i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for(j = 0; j < 8; j++) {
+                c = (c >> 1) ^ ((c & 1) ? 0xEDB88320 : 0);
+            }
+            table[i] = c;
+        }
+        have_table = 1;
+    }
+    for(i = 0; i < n; i++) {
+        for(j = 0; j < 32; j += 8) {
+            crc = (crc >> 8) ^ table[(crc ^ (words[i] >> j)) & 0xFF];
+        }
+    }
+    return ~crc;
+}
@@ -4,8 +4,8 @@
 //
 // Struct for passing generic data read/writes to the SPI interface
 // I choose no more than 4 data words here b/c the SPI interface FIFO depth
-// is 4, but in principle this could be extended to greater depth by having the
-// write function spool the data out 4 at a time....but whatevs
+// is 4. For anything longer use spi_io_stream (or spi_io_chain to run several
+// of these back to back), which spools the data through the FIFO.
 typedef struct SPI_Data {
     uint32_t mosi[4];
     uint32_t miso[4];
@@ -15,4 +15,5 @@ typedef struct SPI_Data {
 
 int has_even_parity(uint32_t x, unsigned int n);
 uint32_t reverse_bits(const uint32_t word, const unsigned int n);
+uint32_t crc32_words(const uint32_t* words, unsigned int n);
 #endif
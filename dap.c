@@ -0,0 +1,1109 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include "common_utils.h"
+#include "rbpi.h"
+#include "swd.h"
+#include "dap.h"
+#include "metrics.h"
+#include "trace.h"
+
+// Optimistic mode, see perform_swd_io
+int swd_speculative = 0;
+// Mirrors CTRL/STAT.ORUNDETECT. With it set the target expects a data phase
+// even after a WAIT or FAULT, which keeps it in step with a speculative burst.
+static int overrun_detect = 0;
+
+// What SELECT, and the MEM-AP's CSW and TAR, were last left at. Writes that wouldn't
+// change anything get skipped. Anything that makes them uncertain (line reset, FAULT,
+// DAPABORT, writes to some other AP) just forgets them so the next write goes out.
+typedef struct DAPCache {
+    int select_valid;
+    uint32_t select;
+    int csw_valid;
+    uint32_t csw;
+    int tar_valid;
+    uint32_t tar;
+} DAPCache;
+static DAPCache dap_cache;
+
+void dap_cache_invalidate() {
+    memset(&dap_cache, 0, sizeof(dap_cache));
+}
+
+static int mem_ap_selected() {
+    // APSEL=0 and APBANKSEL=0, i.e. AP addresses 0x0/0x4/0xC are CSW/TAR/DRW
+    return dap_cache.select_valid && (dap_cache.select & 0xFF0000F0) == 0;
+}
+
+static int dap_cache_hit(int APnDP, int RnW, uint8_t addr, uint32_t data) {
+    if(RnW) {
+        return 0;
+    }
+    if(!APnDP) {
+        return addr == SWD_SELECT_ADDR && dap_cache.select_valid && dap_cache.select == data;
+    }
+    if(!mem_ap_selected()) {
+        return 0;
+    }
+    switch(addr) {
+        case CSW_OFFSET:
+            return dap_cache.csw_valid && dap_cache.csw == data;
+        case TAR_OFFSET:
+            return dap_cache.tar_valid && dap_cache.tar == data;
+        default:
+            return 0;
+    }
+}
+
+static void dap_cache_note(int APnDP, int RnW, uint8_t addr, uint32_t data, uint8_t ack) {
+    /* Keeps the cache in step with a transfer that just went out. A WAIT means the
+     * access didn't happen so nothing changed. A FAULT or garbage ACK means who knows.
+     * A DRW access moves the TAR along if CSW has single auto-increment on, but only
+     * inside a 1KB block so past one of those the TAR is forgotten.
+     */
+    if(ack == ACK_WAIT) {
+        return;
+    }
+    if(ack != ACK_OK) {
+        dap_cache_invalidate();
+        return;
+    }
+    if(!APnDP) {
+        if(RnW) {
+            return;
+        }
+        if(addr == SWD_SELECT_ADDR) {
+            dap_cache.select = data;
+            dap_cache.select_valid = 1;
+        } else if((addr == SWD_ABORT_ADDR && (data & 0x1)) ||
+                  (addr == SWD_CTRLSTAT_ADDR && !(data & 0x10000000))) {
+            // DAPABORT, or the debug domain being powered down
+            dap_cache.csw_valid = 0;
+            dap_cache.tar_valid = 0;
+        }
+        return;
+    }
+    if(!mem_ap_selected()) {
+        // Some other AP (on the nRF the CTRL-AP, whose RESET/ERASEALL could do anything)
+        if(!RnW) {
+            dap_cache.csw_valid = 0;
+            dap_cache.tar_valid = 0;
+        }
+        return;
+    }
+    if(addr == CSW_OFFSET && !RnW) {
+        dap_cache.csw = data;
+        dap_cache.csw_valid = 1;
+    } else if(addr == TAR_OFFSET && !RnW) {
+        dap_cache.tar = data;
+        dap_cache.tar_valid = 1;
+    } else if(addr == DRW_OFFSET && dap_cache.tar_valid) {
+        if(!dap_cache.csw_valid) {
+            dap_cache.tar_valid = 0;
+        } else if(((dap_cache.csw >> 4) & 0x3) == 1) {
+            dap_cache.tar += 4;
+            dap_cache.tar_valid = (dap_cache.tar % TAR_WRAP_SIZE) != 0;
+        }
+    }
+}
+
+static void send_stream(SPIRegisters spi_registers, const SWD_Bitstream* tx, SWD_Bitstream* rx) {
+    // Packs the bitstream into as few SPI words as possible and sends it in one go
+    uint32_t mosi[SWD_STREAM_MAX_WORDS];
+    uint32_t miso[SWD_STREAM_MAX_WORDS];
+    unsigned int lengths[SWD_STREAM_MAX_WORDS];
+    unsigned int n = swd_stream_slice(tx, mosi, lengths);
+    spi_io_stream(spi_registers, mosi, miso, lengths, n);
+    swd_stream_gather(rx, miso, lengths, n);
+}
+
+static void resync_line(SPIRegisters spi_registers) {
+    // Line reset followed by the DPIDR read the DP insists on after one
+    int speculative = swd_speculative;
+    metric_inc(METRIC_SWD_RESYNC);
+    dap_cache_invalidate();
+    SPI_Data reset_data = swd_protocol_reset();
+    SWD_Packet read_idr_packet = swd_read_dpidr_reg();
+    swd_trace_event(SWD_TRACE_LINE_RESET);
+    spi_io(spi_registers, &reset_data);
+    swd_speculative = 0;
+    perform_swd_io(spi_registers, &read_idr_packet);
+    swd_speculative = speculative;
+}
+
+static void clear_overrun(SPIRegisters spi_registers) {
+    int speculative = swd_speculative;
+    SWD_ABORT_Reg abort_reg = { .ORUNERRCLR = 1, .WDERRCLR = 0, .SKERRCLR = 0, .STKCMPCLR = 0, .DAPABORT = 0 };
+    SWD_Packet write_abort_packet = swd_write_abort_reg(abort_reg);
+    metric_inc(METRIC_SWD_OVERRUN_CLEAR);
+    swd_speculative = 0;
+    perform_swd_io(spi_registers, &write_abort_packet);
+    swd_speculative = speculative;
+}
+
+static int recover_from_ack(SPIRegisters spi_registers, SWD_Packet* packet_data, int data_phase_sent) {
+    /* Gets the line back into a sane state after anything but ACK_OK.
+     * If the data phase wasn't sent yet the target might still want it (ORUNDETECT)
+     * or at least the turnaround after a read. If it was sent (speculative mode) and
+     * overrun detection is off the target will have been trying to decode the data
+     * as a new header, so it needs a line reset.
+     */
+    SWD_Bitstream tx, rx;
+    SWD_FrameOffsets frame;
+    swd_stream_init(&tx);
+    if(!data_phase_sent) {
+        if(overrun_detect) {
+            swd_stream_append_data(&tx, packet_data, &frame);
+            swd_stream_append(&tx, 0x0, SWD_IDLE_BITS);
+        } else if(packet_data->header.RnW && (packet_data->ack == ACK_WAIT || packet_data->ack == ACK_FAULT)) {
+            swd_stream_append(&tx, 0x0, 1);
+        }
+        if(tx.nbits) {
+            send_stream(spi_registers, &tx, &rx);
+        }
+    } else if(!overrun_detect || (packet_data->ack != ACK_WAIT && packet_data->ack != ACK_FAULT)) {
+        resync_line(spi_registers);
+    }
+
+    // With overrun detection on a WAIT sets STICKYORUN, which FAULTs everything after it
+    if(overrun_detect && packet_data->ack == ACK_WAIT) {
+        clear_overrun(spi_registers);
+    }
+
+    switch(packet_data->ack) {
+        case ACK_WAIT:
+            return SWD_ACK_WAIT;
+        case ACK_FAULT:
+            return SWD_ACK_FAULT;
+        default:
+            printf("Invalid ACK from slave device ACK = 0x%x\n", packet_data->ack);
+            return SWD_ACK_UNKNOWN;
+    }
+}
+
+static int swd_transfer(SPIRegisters spi_registers, SWD_Packet* packet_data) {
+    /* This function uses the data in 'packet_data' to build the SWD frame, which gets
+     * packed into as few SPI words as possible and sent out the SPI interface where
+     * the actual "on the wire" stuff happens.
+     *
+     * If the "packet_data" is a read operation, then the response is packed into the "data"
+     * field of the packet_data. For both a read and a write operation the "ack" field
+     * of packet_data is filled in.
+     *
+     * Normally the header goes out on its own and the data phase is only sent once the ACK
+     * has come back OK, which means waiting on the FIFO twice. With swd_speculative set the
+     * whole thing goes out as one burst on the assumption the ACK will be OK, and
+     * recover_from_ack cleans up if it wasn't.
+     */
+    SWD_Bitstream tx, rx;
+    SWD_FrameOffsets frame;
+
+    //printf("%s", packet_data->debug_string);
+    swd_stream_init(&tx);
+    if(swd_speculative) {
+        // Header, turnaround, ACK, data and idles all in one go (53/54 bits = 3 SPI words)
+        swd_stream_append_packet(&tx, packet_data, &frame);
+        swd_stream_append(&tx, 0x0, SWD_IDLE_BITS);
+        send_stream(spi_registers, &tx, &rx);
+        packet_data->ack = swd_stream_extract(&rx, frame.ack, 3);
+        if(packet_data->ack != ACK_OK) {
+            return recover_from_ack(spi_registers, packet_data, 1);
+        }
+    } else {
+        //First thing is to send out the header and read back the response (which should include the ACK)
+        swd_stream_append_request(&tx, packet_data->header, &frame);
+        send_stream(spi_registers, &tx, &rx);
+        packet_data->ack = swd_stream_extract(&rx, frame.ack, 3);
+        if(packet_data->ack != ACK_OK) {
+            return recover_from_ack(spi_registers, packet_data, 0);
+        }
+
+        // If here we can continue with the transfer, data + parity
+        // then "close" the transaction with at least 8 "idles".
+        swd_stream_init(&tx);
+        swd_stream_append_data(&tx, packet_data, &frame);
+        swd_stream_append(&tx, 0x0, SWD_IDLE_BITS);
+        send_stream(spi_registers, &tx, &rx); // Send it
+    }
+
+    // If this was a read-op then get the data back and stuff in "packet_data"
+    if(packet_data->header.RnW) {
+        packet_data->data = swd_stream_extract(&rx, frame.data, 32);
+        packet_data->parity = swd_stream_extract(&rx, frame.data + 32, 1);
+
+        int expected_parity = !has_even_parity(packet_data->data, 32);
+
+        if(!packet_data->parity != !expected_parity) {
+            printf("Parity mismatch 0x%x %i\n", packet_data->data, packet_data->parity);
+            return SWD_PARITY_MISMATCH;
+        }
+    } else if(!packet_data->header.APnDP && packet_data->header.addr == SWD_CTRLSTAT_ADDR) {
+        overrun_detect = packet_data->data & 0x1;
+    }
+    return SWD_OK; 
+}
+
+int perform_swd_io(SPIRegisters spi_registers, SWD_Packet* packet_data) {
+    // A write that would leave SELECT/CSW/TAR exactly as they are doesn't go on the wire
+    if(dap_cache_hit(packet_data->header.APnDP, packet_data->header.RnW, packet_data->header.addr, packet_data->data)) {
+        packet_data->ack = ACK_OK;
+        metric_inc(METRIC_SWD_ELIDED);
+        return SWD_OK;
+    }
+    uint64_t start = metric_start();
+    uint64_t trace_start = swd_trace_start();
+    int err = swd_transfer(spi_registers, packet_data);
+    dap_cache_note(packet_data->header.APnDP, packet_data->header.RnW, packet_data->header.addr,
+                   packet_data->data, packet_data->ack);
+    swd_trace_packet(SWD_TRACE_TRANSFER, packet_data, err, trace_start);
+    metric_inc(METRIC_SWD_TRANSFERS);
+    metric_count_ack(packet_data->ack);
+    if(err == SWD_PARITY_MISMATCH) {
+        metric_inc(METRIC_SWD_PARITY_MISMATCH);
+    }
+    metric_observe(METRIC_HIST_SWD_TRANSFER, start);
+    return err;
+}
+
+int swd_clear_sticky(SPIRegisters spi_registers) {
+    // STICKYERR, STICKYCMP, STICKYORUN and WDATAERR, all through ABORT
+    int err;
+    int speculative = swd_speculative;
+    SWD_ABORT_Reg abort_reg = { .ORUNERRCLR = 1, .WDERRCLR = 1, .SKERRCLR = 1, .STKCMPCLR = 1, .DAPABORT = 0 };
+    SWD_Packet write_abort_packet = swd_write_abort_reg(abort_reg);
+    swd_speculative = 0;
+    err = perform_swd_io(spi_registers, &write_abort_packet);
+    swd_speculative = speculative;
+    return err;
+}
+
+static int reconnect(SPIRegisters spi_registers) {
+    // For when the line's out of step, or the target reset or browned out
+    int err;
+    int detect = overrun_detect;
+    metric_inc(METRIC_SWD_RECONNECTS);
+    if((err = swd_connect(spi_registers, NULL))) {
+        return err;
+    }
+    return detect ? set_overrun_detect(spi_registers, 1) : SWD_OK;
+}
+
+static void restore_dap_state(SPIRegisters spi_registers, const DAPCache* state) {
+    // Puts SELECT, and the MEM-AP's CSW and TAR, back to what 'state' says they were
+    // after a FAULT or reconnect made dap_cache forget them
+    SWD_Packet packet = { .header = { .APnDP = 0, .RnW = 0, .addr = SWD_SELECT_ADDR }, .data = state->select };
+    if(!state->select_valid || perform_swd_io(spi_registers, &packet)) {
+        return;
+    }
+    if((state->select & 0xFF0000F0) != 0) {
+        return;
+    }
+    packet = swd_write_ap_addr(CSW_OFFSET, state->csw);
+    if(state->csw_valid && perform_swd_io(spi_registers, &packet)) {
+        return;
+    }
+    packet = swd_write_ap_addr(TAR_OFFSET, state->tar);
+    if(state->tar_valid) {
+        perform_swd_io(spi_registers, &packet);
+    }
+}
+
+// Time perform_swd_io_retry spends on one transfer before giving up, RBPI_SWD_BUDGET_MS
+#define SWD_DEFAULT_BUDGET_MS 1000
+// WAITs retried straight away before it starts sleeping, and the longest sleep
+#define SWD_WAIT_SPINS 4
+#define SWD_WAIT_MAX_SLEEP_US 128
+// Goes after clearing a FAULT / after reconnecting, past that it's not the line's fault
+#define SWD_FAULT_RETRIES 2
+#define SWD_RECONNECT_RETRIES 3
+
+static uint64_t retry_budget_us = 0;
+// What the last transfer that got past a WAIT had to sleep, the next one starts from half of it
+static unsigned int wait_sleep_us = 0;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+int perform_swd_io_retry(SPIRegisters spi_registers, SWD_Packet* packet_data) {
+    /* perform_swd_io with all the recovery in one place, under a time budget for the
+     * whole transfer (RBPI_SWD_BUDGET_MS, default 1s):
+     *  - WAIT: retried straight away a few times, then with a sleep that doubles every
+     *    time. It starts from half of what the last WAIT needed, so a target that's
+     *    busy for a while (the NVMC) isn't polled flat out every time.
+     *  - FAULT: CTRL/STAT says why and the sticky flags get cleared. An overrun or bad
+     *    write data means the access didn't happen, so SELECT/CSW/TAR are put back to
+     *    how they were and it goes again (safe even for DRW). STICKYERR is a real bus
+     *    error and goes back to the caller, with the flags already clear so the next
+     *    transfer isn't FAULTed too.
+     *  - Garbage ACK: reconnect, SELECT/CSW/TAR put back, and go again. Except for AP
+     *    reads: the read might have happened and the reconnect lost whatever was posted,
+     *    so going again would hand back a stale value. Those return SWD_ACK_UNKNOWN
+     *    after the reconnect and the caller starts its reads again from what it trusts.
+     * Parity errors are left to the caller, for an AP read only it knows if reading
+     * again is okay. Returns the last error once it runs out of budget or goes.
+     */
+    SWD_Packet request = *packet_data;
+    DAPCache before = dap_cache;
+    uint64_t deadline = 0;
+    unsigned int waits = 0, faults = 0, reconnects = 0, sleep_us = 0;
+    int err;
+
+    if(!retry_budget_us) {
+        const char* value = getenv("RBPI_SWD_BUDGET_MS");
+        retry_budget_us = (value && strtoul(value, NULL, 0) ? strtoul(value, NULL, 0) : SWD_DEFAULT_BUDGET_MS) * 1000ull;
+    }
+    for(;;) {
+        err = perform_swd_io(spi_registers, packet_data);
+        if(err == SWD_OK || err == SWD_PARITY_MISMATCH) {
+            break;
+        }
+        if(!deadline) {
+            deadline = now_us() + retry_budget_us;
+        }
+        if(err == SWD_ACK_FAULT) {
+            SWD_Packet read_ctrlstat_reg = swd_read_cntrl_stat_reg();
+            int bus_error = perform_swd_io(spi_registers, &read_ctrlstat_reg) ||
+                            interpret_ctrlstat_reg(read_ctrlstat_reg.data).STICKYERR;
+            metric_inc(METRIC_SWD_FAULT_CLEARS);
+            if(swd_clear_sticky(spi_registers) || bus_error || faults++ == SWD_FAULT_RETRIES) {
+                break;
+            }
+            restore_dap_state(spi_registers, &before);
+        } else if(err != SWD_ACK_WAIT) {
+            if(reconnects++ == SWD_RECONNECT_RETRIES || reconnect(spi_registers)) {
+                break;
+            }
+            restore_dap_state(spi_registers, &before);
+            if(request.header.APnDP && request.header.RnW) {
+                break;
+            }
+        }
+        if(now_us() >= deadline) {
+            metric_inc(METRIC_SWD_BUDGET_EXHAUSTED);
+            printf("Giving up on SWD transfer after %" PRIu64 "ms\n", retry_budget_us / 1000);
+            break;
+        }
+        if(err == SWD_ACK_WAIT && waits++ >= SWD_WAIT_SPINS) {
+            sleep_us = sleep_us ? sleep_us*2 : wait_sleep_us > 1 ? wait_sleep_us/2 : 1;
+            if(sleep_us > SWD_WAIT_MAX_SLEEP_US) {
+                sleep_us = SWD_WAIT_MAX_SLEEP_US;
+            }
+            metrics_sleep_us(sleep_us);
+        }
+        *packet_data = request;
+    }
+    if(err == SWD_OK) {
+        wait_sleep_us = sleep_us;
+    }
+    return err;
+}
+
+static int ack_error(uint8_t ack) {
+    return ack == ACK_WAIT ? SWD_ACK_WAIT : ack == ACK_FAULT ? SWD_ACK_FAULT : SWD_ACK_UNKNOWN;
+}
+
+static int check_program_op(const SWD_Program* program, const SWD_Bitstream* rx, unsigned int i, uint8_t* ack, uint32_t* data) {
+    // Pulls op i's ACK (and read data) out of a burst's response, and does the same
+    // bookkeeping perform_swd_io would have done for it
+    const SWD_Op* op = &program->ops[i];
+    int err = SWD_OK;
+    *ack = swd_stream_extract(rx, program->offsets[i].ack, 3);
+    *data = op->data;
+    dap_cache_note(op->APnDP, op->RnW, op->addr, op->data, *ack);
+    metric_inc(METRIC_SWD_TRANSFERS);
+    metric_count_ack(*ack);
+    if(*ack != ACK_OK) {
+        err = ack_error(*ack);
+    } else if(op->RnW) {
+        *data = swd_stream_extract(rx, program->offsets[i].data, 32);
+        if(swd_stream_extract(rx, program->offsets[i].data + 32, 1) != (uint32_t) swd_parity32(*data)) {
+            metric_inc(METRIC_SWD_PARITY_MISMATCH);
+            printf("Parity mismatch 0x%x in compiled program\n", *data);
+            err = SWD_PARITY_MISMATCH;
+        }
+    } else if(!op->APnDP && op->addr == SWD_CTRLSTAT_ADDR) {
+        overrun_detect = op->data & 0x1;
+    }
+    if(swd_trace_enabled) {
+        SWD_Packet traced = { .header = { .APnDP = op->APnDP, .RnW = op->RnW, .addr = op->addr }, .ack = *ack, .data = *data };
+        traced.parity = swd_parity32(*data) ^ (err == SWD_PARITY_MISMATCH);
+        swd_trace_packet(SWD_TRACE_PROGRAM_OP, &traced, err, 0);
+    }
+    return err;
+}
+
+static void recover_from_burst(SPIRegisters spi_registers, uint8_t ack) {
+    // Everything after a WAIT/FAULT got a FAULT too (or was garbage without overrun detection)
+    if(!overrun_detect || (ack != ACK_WAIT && ack != ACK_FAULT)) {
+        resync_line(spi_registers);
+    } else if(ack == ACK_WAIT) {
+        clear_overrun(spi_registers);
+    }
+}
+
+int run_swd_program(SPIRegisters spi_registers, const SWD_Program* program, uint32_t* read_data) {
+    /* Sends a compiled program out in one burst and then goes through the response
+     * checking every ACK (and read parity). 'read_data' can be NULL, otherwise it gets
+     * one entry per op and the reads get filled in.
+     *
+     * If something in the middle wasn't OK the line gets put right the same way as
+     * for a single speculative transaction and everything from that op on is redone
+     * one at a time, so programs should only contain ops that are fine to repeat.
+     */
+    uint32_t miso[SWD_STREAM_MAX_WORDS];
+    SWD_Bitstream rx;
+    unsigned int i;
+    int err = SWD_OK;
+    uint8_t ack = ACK_OK;
+
+    metric_inc(METRIC_SWD_PROGRAMS);
+    spi_io_stream(spi_registers, program->mosi, miso, program->lengths, program->n_words);
+    swd_stream_gather(&rx, miso, program->lengths, program->n_words);
+    for(i = 0; i < program->n_ops; i++) {
+        uint32_t data;
+        if(program->ops[i].kind != SWD_OP_TRANSFER) {
+            dap_cache_invalidate();
+            continue;
+        }
+        if(check_program_op(program, &rx, i, &ack, &data)) {
+            break;
+        }
+        if(program->ops[i].RnW && read_data) {
+            read_data[i] = data;
+        }
+    }
+    if(i == program->n_ops) {
+        return SWD_OK;
+    }
+    metric_inc(METRIC_SWD_PROGRAM_REPLAYS);
+    if(ack != ACK_OK) {
+        recover_from_burst(spi_registers, ack);
+    }
+
+    for(; i < program->n_ops && !err; i++) {
+        const SWD_Op* op = &program->ops[i];
+        if(op->kind == SWD_OP_TRANSFER) {
+            SWD_Packet packet = { .header = { .APnDP = op->APnDP, .RnW = op->RnW, .addr = op->addr }, .data = op->data };
+            err = perform_swd_io_retry(spi_registers, &packet);
+            if(!err && op->RnW && read_data) {
+                read_data[i] = packet.data;
+            }
+        } else {
+            SPI_Data seq = op->kind == SWD_OP_LINE_RESET ? swd_protocol_reset() : swd_jtag_to_swd();
+            dap_cache_invalidate();
+            swd_trace_event(op->kind == SWD_OP_LINE_RESET ? SWD_TRACE_LINE_RESET : SWD_TRACE_JTAG_TO_SWD);
+            spi_io(spi_registers, &seq);
+        }
+    }
+    return err;
+}
+
+// The transaction queue, see swd_queue_read in dap.h
+typedef struct SWD_QueueEntry {
+    SWD_Op op;
+    SWD_QueueResult* result;
+} SWD_QueueEntry;
+static SWD_QueueEntry swd_queue[SWD_QUEUE_MAX];
+static unsigned int swd_queue_len = 0;
+
+static int queue_op(SPIRegisters spi_registers, int APnDP, int RnW, uint8_t addr, uint32_t data, SWD_QueueResult* result) {
+    int err;
+    if(swd_queue_len == SWD_QUEUE_MAX && (err = swd_flush(spi_registers))) {
+        return err;
+    }
+    swd_queue[swd_queue_len].op = swd_op_transfer(APnDP, RnW, addr, data);
+    swd_queue[swd_queue_len].result = result;
+    swd_queue_len++;
+    return SWD_OK;
+}
+
+int swd_queue_read(SPIRegisters spi_registers, int APnDP, uint8_t addr, SWD_QueueResult* result) {
+    return queue_op(spi_registers, APnDP, 1, addr, 0, result);
+}
+
+int swd_queue_write(SPIRegisters spi_registers, int APnDP, uint8_t addr, uint32_t data, SWD_QueueResult* result) {
+    return queue_op(spi_registers, APnDP, 0, addr, data, result);
+}
+
+int swd_queue_packet(SPIRegisters spi_registers, const SWD_Packet* packet, SWD_QueueResult* result) {
+    return queue_op(spi_registers, packet->header.APnDP, packet->header.RnW, packet->header.addr, packet->data, result);
+}
+
+static int run_queue_ops(SPIRegisters spi_registers, const SWD_Op* ops, unsigned int n_ops, SWD_QueueResult* results) {
+    /* Sends the ops SWD_PROGRAM_MAX_OPS at a time as compiled programs. Like
+     * run_swd_program, after a non-OK ACK the line gets put right and the rest of
+     * that program is done one op at a time, but a parity error only spoils that one
+     * read (the line's still in step) and nothing gets repeated after a read went
+     * through, so DRW reads are safe in here. Stops at the first WAIT that wouldn't go
+     * away, FAULT or garbage ACK, the ops after that are left as SWD_NOT_RUN. So are
+     * the ops of a program that can't be compiled, nothing from it goes out.
+     */
+    static SWD_Program program;
+    uint32_t miso[SWD_STREAM_MAX_WORDS];
+    SWD_Bitstream rx;
+    unsigned int base, i;
+
+    for(i = 0; i < n_ops; i++) {
+        results[i].err = SWD_NOT_RUN;
+        results[i].ack = 0;
+        results[i].data = 0;
+    }
+    for(base = 0; base < n_ops; base += program.n_ops) {
+        unsigned int n = n_ops - base;
+        uint8_t ack = ACK_OK;
+        if(n > SWD_PROGRAM_MAX_OPS) {
+            n = SWD_PROGRAM_MAX_OPS;
+        }
+        if(swd_compile_program(ops + base, n, &program)) {
+            printf("Could not compile %u queued ops\n", n);
+            return SWD_NOT_RUN;
+        }
+
+        metric_inc(METRIC_SWD_PROGRAMS);
+        spi_io_stream(spi_registers, program.mosi, miso, program.lengths, program.n_words);
+        swd_stream_gather(&rx, miso, program.lengths, program.n_words);
+        for(i = 0; i < n; i++) {
+            SWD_QueueResult* result = &results[base + i];
+            result->err = check_program_op(&program, &rx, i, &ack, &result->data);
+            result->ack = ack;
+            if(ack != ACK_OK) {
+                break;
+            }
+        }
+        if(i == n) {
+            continue;
+        }
+
+        metric_inc(METRIC_SWD_PROGRAM_REPLAYS);
+        recover_from_burst(spi_registers, ack);
+        for(; i < n; i++) {
+            const SWD_Op* op = &ops[base + i];
+            SWD_QueueResult* result = &results[base + i];
+            SWD_Packet packet = { .header = { .APnDP = op->APnDP, .RnW = op->RnW, .addr = op->addr }, .data = op->data };
+            result->err = perform_swd_io_retry(spi_registers, &packet);
+            result->ack = packet.ack;
+            result->data = packet.data;
+            if(result->err && result->err != SWD_PARITY_MISMATCH) {
+                return result->err;
+            }
+        }
+    }
+    return SWD_OK;
+}
+
+int swd_flush(SPIRegisters spi_registers) {
+    /* Turns the queue into the ops that actually go on the wire:
+     *  - writes dap_cache says wouldn't change anything are dropped
+     *  - an AP read's value gets taken from the next AP read, or an RDBUFF read
+     *    that's added before the next write (or at the end) if there's no AP read to use
+     * then sends them with run_queue_ops and hands each entry its result.
+     * More than one op goes out as a burst, which needs ORUNDETECT (a WAIT without it
+     * has the target decoding the next op's data as headers), so that gets turned on
+     * first if it isn't. If that fails nothing goes out and every entry is SWD_NOT_RUN.
+     */
+    static SWD_Op ops[2*SWD_QUEUE_MAX];
+    static SWD_QueueResult op_results[2*SWD_QUEUE_MAX];
+    static int own_op[SWD_QUEUE_MAX];  // The op for the entry itself, -1 if it was dropped
+    static int data_op[SWD_QUEUE_MAX]; // The op whose data is the entry's read value
+    unsigned int n_ops = 0, n_dropped = 0, i;
+    int pending = -1; // AP read still waiting for its value
+    int err = SWD_OK;
+    DAPCache planned = dap_cache;
+
+    if(swd_queue_len == 0) {
+        return SWD_OK;
+    }
+    for(i = 0; i < swd_queue_len; i++) {
+        const SWD_Op* op = &swd_queue[i].op;
+        if(!op->RnW && dap_cache_hit(op->APnDP, op->RnW, op->addr, op->data)) {
+            own_op[i] = data_op[i] = -1;
+            n_dropped++;
+            continue;
+        }
+        if(pending >= 0 && !op->RnW) {
+            data_op[pending] = n_ops;
+            ops[n_ops++] = swd_op_transfer(0, 1, SWD_RDBUFF_ADDR, 0);
+            pending = -1;
+        }
+        own_op[i] = data_op[i] = n_ops;
+        ops[n_ops++] = *op;
+        // Pretend it'll all be OK so later writes get checked against what'll be there by then
+        dap_cache_note(op->APnDP, op->RnW, op->addr, op->data, ACK_OK);
+        if(op->RnW && (op->APnDP || op->addr == SWD_RDBUFF_ADDR)) {
+            if(pending >= 0) {
+                data_op[pending] = own_op[i];
+            }
+            pending = op->APnDP ? (int) i : -1;
+        }
+    }
+    if(pending >= 0) {
+        data_op[pending] = n_ops;
+        ops[n_ops++] = swd_op_transfer(0, 1, SWD_RDBUFF_ADDR, 0);
+    }
+    dap_cache = planned;
+
+    if(n_ops > 1 && !overrun_detect && (err = set_overrun_detect(spi_registers, 1))) {
+        for(i = 0; i < swd_queue_len; i++) {
+            if(swd_queue[i].result) {
+                swd_queue[i].result->err = SWD_NOT_RUN;
+            }
+        }
+        swd_queue_len = 0;
+        return err;
+    }
+    if(n_ops) {
+        run_queue_ops(spi_registers, ops, n_ops, op_results);
+    }
+    metric_add(METRIC_SWD_ELIDED, n_dropped);
+    for(i = 0; i < swd_queue_len; i++) {
+        // A dropped write is as good as done, unless something before it failed
+        SWD_QueueResult result = { .err = err ? SWD_NOT_RUN : SWD_OK, .ack = ACK_OK, .data = 0 };
+        if(own_op[i] >= 0) {
+            result = op_results[own_op[i]];
+            if(result.err == SWD_OK && data_op[i] != own_op[i]) {
+                result.err = op_results[data_op[i]].err;
+                result.data = op_results[data_op[i]].data;
+            }
+        }
+        if(!err) {
+            err = result.err;
+        }
+        if(swd_queue[i].result) {
+            *swd_queue[i].result = result;
+        }
+    }
+    swd_queue_len = 0;
+    return err;
+}
+
+void swd_connect_sequence(SPIRegisters spi_registers) {
+    // Line reset, JTAG-to-SWD, line reset, all in one go so there's no gaps on the wire between them
+    SPI_Data reset_sequence[4] = {
+        swd_protocol_reset(),
+        swd_jtag_to_swd(),
+        swd_protocol_reset(),
+        swd_protocol_reset()
+    };
+    dap_cache_invalidate();
+    swd_trace_event(SWD_TRACE_LINE_RESET);
+    swd_trace_event(SWD_TRACE_JTAG_TO_SWD);
+    swd_trace_event(SWD_TRACE_LINE_RESET);
+    spi_io_chain(spi_registers, reset_sequence, 4);
+}
+
+// How long swd_connect gives the DP to answer, and then debug power to come up
+#define SWD_CONNECT_TIMEOUT_US 100000
+
+int swd_connect(SPIRegisters spi_registers, uint32_t* dpidr) {
+    /* Gets from nothing to a DP with the debug domain powered up, as soon as the target
+     * allows rather than after a fixed wait. The connect sequence goes out until a
+     * DPIDR read comes back OK (a target just plugged in or coming out of reset takes
+     * a moment), backing off a bit more each time. Then the sticky flags get cleared,
+     * debug and system power requested and CTRL/STAT polled until CDBGPWRUPACK and
+     * CSYSPWRUPACK are both set. Each half gets SWD_CONNECT_TIMEOUT_US.
+     * Leaves ORUNDETECT off.
+     */
+    SWD_Packet packet;
+    SWD_CNTRL_STAT_Reg ctrlstat_reg;
+    int speculative = swd_speculative;
+    uint64_t deadline = now_us() + SWD_CONNECT_TIMEOUT_US;
+    unsigned int sleep_us = 100;
+    int err;
+
+    swd_speculative = 0;
+    overrun_detect = 0;
+    for(;;) {
+        swd_connect_sequence(spi_registers);
+        packet = swd_read_dpidr_reg();
+        if(!(err = perform_swd_io(spi_registers, &packet)) || now_us() >= deadline) {
+            break;
+        }
+        metrics_sleep_us(sleep_us);
+        sleep_us *= 2;
+    }
+    if(!err && dpidr) {
+        *dpidr = packet.data;
+    }
+
+    if(!err && !(err = swd_clear_sticky(spi_registers))) {
+        memset(&ctrlstat_reg, 0, sizeof(ctrlstat_reg));
+        ctrlstat_reg.CSYSPWRUPREQ = 1;
+        ctrlstat_reg.CDBGPWRUPREQ = 1;
+        packet = swd_write_cntrl_stat_reg(ctrlstat_reg);
+        err = perform_swd_io(spi_registers, &packet);
+    }
+    deadline = now_us() + SWD_CONNECT_TIMEOUT_US;
+    while(!err) {
+        packet = swd_read_cntrl_stat_reg();
+        err = perform_swd_io(spi_registers, &packet);
+        ctrlstat_reg = interpret_ctrlstat_reg(packet.data);
+        if(!err && ctrlstat_reg.CDBGPWRUOACK && ctrlstat_reg.CSYSPWRUPACK) {
+            break;
+        }
+        if(now_us() >= deadline) {
+            printf("Debug power never came up, CTRL/STAT = 0x%x\n", packet.data);
+            err = err ? err : SWD_ACK_WAIT;
+        } else if(err == SWD_PARITY_MISMATCH) {
+            err = SWD_OK;
+        }
+    }
+    swd_speculative = speculative;
+    return err;
+}
+
+int set_overrun_detect(SPIRegisters spi_registers, int enable) {
+    // The CTRL/STAT write FAULTs while anything's sticky, so those get cleared first
+    int err;
+    int tries = 0;
+    SWD_Packet read_ctrlstat_reg = swd_read_cntrl_stat_reg();
+    while((err = perform_swd_io(spi_registers, &read_ctrlstat_reg)) == SWD_PARITY_MISMATCH && tries++ < 8);
+    if(err) {
+        return err;
+    }
+    SWD_CNTRL_STAT_Reg ctrlstat_reg = interpret_ctrlstat_reg(read_ctrlstat_reg.data);
+    if((ctrlstat_reg.STICKYORUN || ctrlstat_reg.STICKYERR || ctrlstat_reg.STICKYCMP || ctrlstat_reg.WDATAERR) &&
+       (err = swd_clear_sticky(spi_registers))) {
+        return err;
+    }
+    ctrlstat_reg.ORUNDETECT = enable;
+    SWD_Packet write_cntrlstat_packet = swd_write_cntrl_stat_reg(ctrlstat_reg);
+    return perform_swd_io(spi_registers, &write_cntrlstat_packet);
+}
+
+static int read_ap_posted(SPIRegisters spi_registers, uint8_t addr, uint32_t* value) {
+    // AP reads are posted, the value read shows up in RDBUFF afterwards. The AP read's
+    // own data is stale anyway so its parity doesn't matter, and RDBUFF can be read
+    // again as many times as it takes.
+    // After a garbage ACK the TAR's back where it was, so the read can just go again.
+    SWD_Packet read_ap_reg = swd_read_ap_addr(addr);
+    SWD_Packet read_rdbuff = swd_read_readbuff();
+    int err, tries = 0;
+    while((err = perform_swd_io_retry(spi_registers, &read_ap_reg)) == SWD_ACK_UNKNOWN && tries++ < SWD_RECONNECT_RETRIES) {
+        read_ap_reg = swd_read_ap_addr(addr);
+    }
+    tries = 0;
+    if(err && err != SWD_PARITY_MISMATCH) {
+        return err;
+    }
+    while((err = perform_swd_io_retry(spi_registers, &read_rdbuff)) == SWD_PARITY_MISMATCH && tries++ < 8);
+    *value = read_rdbuff.data;
+    return err;
+}
+
+int read_tar(SPIRegisters spi_registers, uint32_t* tar) {
+    return read_ap_posted(spi_registers, TAR_OFFSET, tar);
+}
+
+int write_tar(SPIRegisters spi_registers, uint32_t addr) {
+    SWD_Packet write_tar_reg = swd_write_ap_addr(TAR_OFFSET, addr);
+    return perform_swd_io_retry(spi_registers, &write_tar_reg);
+}
+
+int write_drw(SPIRegisters spi_registers, uint32_t data) {
+    SWD_Packet write_tar_reg = swd_write_ap_addr(DRW_OFFSET, data);
+    return perform_swd_io_retry(spi_registers, &write_tar_reg);
+}
+
+int read_drw(SPIRegisters spi_registers, uint32_t* data) {
+    return read_ap_posted(spi_registers, DRW_OFFSET, data);
+}
+
+int mem_ap_read(SPIRegisters spi_registers, uint32_t addr, uint32_t* data) {
+    int err;
+    if((err = write_tar(spi_registers, addr))) {
+        return err;
+    }
+    return read_drw(spi_registers, data);
+}
+
+int mem_ap_write (SPIRegisters spi_registers, uint32_t addr, uint32_t data){
+    // If the TAR write didn't happen the DRW write would land somewhere else
+    int err;
+    if((err = write_tar(spi_registers, addr))) {
+        return err;
+    }
+    return write_drw(spi_registers, data);
+}
+
+int write_csw(SPIRegisters spi_registers, int addr_increment) {
+    MEM_AP_CSW_Reg csw;
+    memset(&csw, 0, sizeof(csw));
+    csw.size = 0b010; // 32-bit transfers
+    csw.addr_increment = addr_increment;
+    SWD_Packet write_csw_reg = swd_write_csw_reg(csw);
+    return perform_swd_io_retry(spi_registers, &write_csw_reg);
+}
+
+static int write_block(SPIRegisters spi_registers, uint32_t addr, const uint32_t* data, unsigned int n, int skip_erased) {
+    /* Writes 'n' words starting at 'addr' using TAR single auto-increment.
+     * The TAR is only written at the start and when crossing a 1KB boundary,
+     * everything else is just a stream of DRW writes. With 'skip_erased' words that
+     * are 0xFFFFFFFF are skipped over (and the TAR re-written after them).
+     * Leaves the CSW with auto-increment turned off again. A single word doesn't
+     * bother turning it on, so back to back one word writes don't touch the CSW at all.
+     */
+    int err = 0;
+    int tar_valid = 0;
+    unsigned int i;
+
+    if((err = write_csw(spi_registers, n > 1))) {
+        return err;
+    }
+
+    for(i = 0; i < n; i++) {
+        if(skip_erased && data[i] == 0xFFFFFFFF) {
+            tar_valid = 0;
+            addr += 4;
+            continue;
+        }
+        if(!tar_valid || (addr % TAR_WRAP_SIZE) == 0) {
+            if((err = write_tar(spi_registers, addr))) {
+                break;
+            }
+            tar_valid = 1;
+        }
+        if((err = write_drw(spi_registers, data[i]))) {
+            break;
+        }
+        addr += 4;
+    }
+
+    int csw_err;
+    csw_err = write_csw(spi_registers, 0);
+    return err ? err : csw_err;
+}
+
+// Programs it takes to send a TAR write and a whole 1KB block of DRW writes
+#define STREAM_PROGRAMS ((TAR_WRAP_SIZE/4 + 1 + SWD_PROGRAM_MAX_OPS - 1) / SWD_PROGRAM_MAX_OPS)
+// Goes at streaming a block's leftovers before giving up and using write_block
+#define STREAM_TRIES 4
+
+static int stream_block(SPIRegisters spi_registers, uint32_t addr, const uint32_t* data, unsigned int n, unsigned int* written) {
+    /* Sends the TAR write (unless dap_cache says it's already there) and 'n' DRW writes,
+     * which have to stay inside one 1KB block, as back to back programs without looking
+     * at a single ACK, then reads CTRL/STAT once. With ORUNDETECT on a WAIT sets
+     * STICKYORUN and the target FAULTs everything after it without doing it (but stays
+     * in step), so if the sticky bits are clear everything went in. If they aren't, the
+     * first op that wasn't OK gets found in the responses and the line is put right.
+     * 'written' gets how many words went in, only a FAULT (or worse) is an error.
+     */
+    static SWD_Op ops[TAR_WRAP_SIZE/4 + 1];
+    static SWD_Program programs[STREAM_PROGRAMS];
+    static uint32_t miso[STREAM_PROGRAMS][SWD_STREAM_MAX_WORDS];
+    SWD_Packet read_ctrlstat_reg = swd_read_cntrl_stat_reg();
+    SWD_CNTRL_STAT_Reg ctrlstat_reg;
+    SWD_Bitstream rx;
+    unsigned int n_ops = 0, n_programs = 0, first_word, i, j;
+    uint8_t ack = ACK_OK;
+    int err, tries = 0;
+
+    if(!dap_cache_hit(1, 0, TAR_OFFSET, addr)) {
+        ops[n_ops++] = swd_op_transfer(1, 0, TAR_OFFSET, addr);
+    }
+    first_word = n_ops;
+    for(i = 0; i < n; i++) {
+        ops[n_ops++] = swd_op_transfer(1, 0, DRW_OFFSET, data[i]);
+    }
+    // All the encoding happens up front so nothing holds up the FIFO between programs
+    *written = 0;
+    for(i = 0; i < n_ops; i += SWD_PROGRAM_MAX_OPS) {
+        if(swd_compile_program(ops + i, n_ops - i < SWD_PROGRAM_MAX_OPS ? n_ops - i : SWD_PROGRAM_MAX_OPS, &programs[n_programs++])) {
+            printf("Could not compile a stream of %u ops\n", n_ops);
+            return SWD_NOT_RUN;
+        }
+    }
+    for(i = 0; i < n_programs; i++) {
+        spi_io_stream(spi_registers, programs[i].mosi, miso[i], programs[i].lengths, programs[i].n_words);
+    }
+    metric_add(METRIC_SWD_PROGRAMS, n_programs);
+    metric_add(METRIC_SWD_TRANSFERS, n_ops);
+    metric_inc(METRIC_SWD_STREAM_BLOCKS);
+
+    while((err = perform_swd_io_retry(spi_registers, &read_ctrlstat_reg)) == SWD_PARITY_MISMATCH && tries++ < 8);
+    ctrlstat_reg = interpret_ctrlstat_reg(read_ctrlstat_reg.data);
+    if(!err && !ctrlstat_reg.STICKYORUN && !ctrlstat_reg.STICKYERR && !ctrlstat_reg.WDATAERR) {
+        i = n_ops;
+    } else {
+        for(i = 0; i < n_ops; i++) {
+            const SWD_Program* program = &programs[i / SWD_PROGRAM_MAX_OPS];
+            if(i % SWD_PROGRAM_MAX_OPS == 0) {
+                swd_stream_gather(&rx, miso[i / SWD_PROGRAM_MAX_OPS], program->lengths, program->n_words);
+            }
+            ack = swd_stream_extract(&rx, program->offsets[i % SWD_PROGRAM_MAX_OPS].ack, 3);
+            if(ack != ACK_OK) {
+                break;
+            }
+        }
+    }
+
+    // Everything before op i went in
+    metric_add(METRIC_SWD_ACK_OK, i);
+    for(j = 0; j < i; j++) {
+        dap_cache_note(ops[j].APnDP, ops[j].RnW, ops[j].addr, ops[j].data, ACK_OK);
+        if(swd_trace_enabled) {
+            SWD_Packet traced = { .header = { .APnDP = 1, .RnW = 0, .addr = ops[j].addr }, .ack = ACK_OK, .data = ops[j].data };
+            traced.parity = swd_parity32(ops[j].data);
+            swd_trace_packet(SWD_TRACE_PROGRAM_OP, &traced, SWD_OK, 0);
+        }
+    }
+    *written = i < first_word ? 0 : i - first_word;
+    if(i == n_ops) {
+        // Every ACK was OK but something's sticky, a bus error on the last write or
+        // CTRL/STAT couldn't be read. Either way the next access would find out.
+        return err ? err : (ctrlstat_reg.STICKYORUN || ctrlstat_reg.STICKYERR || ctrlstat_reg.WDATAERR) ? SWD_ACK_FAULT : SWD_OK;
+    }
+
+    metric_inc(METRIC_SWD_STREAM_REPLAYS);
+    recover_from_burst(spi_registers, ack);
+    return ack == ACK_FAULT ? SWD_ACK_FAULT : SWD_OK;
+}
+
+int mem_ap_write_stream(SPIRegisters spi_registers, uint32_t addr, const uint32_t* data, unsigned int n) {
+    /* Same result as mem_ap_write_block, but each 1KB block goes out without stopping
+     * for ACKs and only gets checked afterwards, see stream_block. Whatever didn't go in
+     * is streamed again from the word that failed. Turns ORUNDETECT on if it isn't
+     * already, that's what keeps a WAIT from throwing the rest out of step.
+     */
+    int err = SWD_OK;
+    int csw_err;
+
+    if(!overrun_detect && (err = set_overrun_detect(spi_registers, 1))) {
+        return err;
+    }
+    while(n && !err) {
+        unsigned int chunk = (TAR_WRAP_SIZE - (addr % TAR_WRAP_SIZE)) / 4;
+        unsigned int done = 0, tries = 0;
+        if(chunk > n) {
+            chunk = n;
+        }
+        while(done < chunk && !err) {
+            unsigned int written = 0;
+            if(tries++ == STREAM_TRIES) {
+                // Target keeps saying WAIT, finish the block one op at a time
+                err = write_block(spi_registers, addr + done*4, data + done, chunk - done, 0);
+                break;
+            }
+            // Only goes on the wire after write_block, which leaves auto-increment off
+            err = write_csw(spi_registers, 1);
+            if(!err) {
+                // After an overrun only go a program's worth at a time,
+                // so another WAIT doesn't throw away the rest of the block
+                unsigned int count = chunk - done;
+                if(tries > 1 && count > SWD_PROGRAM_MAX_OPS - 1) {
+                    count = SWD_PROGRAM_MAX_OPS - 1;
+                }
+                err = stream_block(spi_registers, addr + done*4, data + done, count, &written);
+            }
+            done += written;
+        }
+        addr += chunk*4;
+        data += chunk;
+        n -= chunk;
+    }
+
+    csw_err = write_csw(spi_registers, 0);
+    return err ? err : csw_err;
+}
+
+int mem_ap_write_block(SPIRegisters spi_registers, uint32_t addr, const uint32_t* data, unsigned int n) {
+    // One word has nothing to stream
+    if(n > 1) {
+        return mem_ap_write_stream(spi_registers, addr, data, n);
+    }
+    return write_block(spi_registers, addr, data, n, 0);
+}
+
+int mem_ap_write_block_sparse(SPIRegisters spi_registers, uint32_t addr, const uint32_t* data, unsigned int n) {
+    // For freshly erased flash, words that are already 0xFFFFFFFF don't need to be sent
+    return write_block(spi_registers, addr, data, n, 1);
+}
+
+int mem_ap_read_block(SPIRegisters spi_registers, uint32_t addr, uint32_t* buf, unsigned int n) {
+    /* Reads 'n' words starting at 'addr' into 'buf' using TAR single auto-increment.
+     *
+     * AP reads are posted, every DRW read returns the result of the DRW read before it.
+     * So rather than reading everything twice the DRW reads are just issued back to back
+     * with each result going into the previous word, and the last word comes out of RDBUFF.
+     * That's N+1 reads for N words. Re-writing the TAR at a 1KB boundary breaks the
+     * pipeline, so that costs an extra RDBUFF read per 1KB.
+     *
+     * A single word is read with auto-increment off, so polling one register is
+     * just the DRW and RDBUFF reads once the TAR is pointing at it.
+     */
+    int err = 0;
+    int restarts = 0;
+    unsigned int i = 0;
+    SWD_Packet read_drw_reg = swd_read_ap_addr(DRW_OFFSET);
+    SWD_Packet read_rdbuff = swd_read_readbuff();
+
+    if((err = write_csw(spi_registers, n > 1))) {
+        return err;
+    }
+
+    while(i < n) {
+        // Number of words until the end of this 1KB block
+        unsigned int chunk = (TAR_WRAP_SIZE - (addr % TAR_WRAP_SIZE)) / 4;
+        unsigned int next = 0; // Next word to issue a read for
+        int pending = 0;       // Is there a read for word next-1 in flight
+        if(chunk > n - i) {
+            chunk = n - i;
+        }
+
+        if((err = write_tar(spi_registers, addr))) {
+            goto done;
+        }
+        while(next < chunk) {
+            err = perform_swd_io_retry(spi_registers, &read_drw_reg);
+            if(err == SWD_PARITY_MISMATCH && !pending) {
+                // First read of a pipeline returns stale data anyway
+                err = SWD_OK;
+            } else if((err == SWD_PARITY_MISMATCH || err == SWD_ACK_UNKNOWN) && restarts++ < 8) {
+                // The data for word next-1 got mangled (or a reconnect after a garbage ACK
+                // threw it away), and the TAR has moved past it. Start the pipeline again
+                // from the last word that isn't in buf yet.
+                next -= pending;
+                if((err = write_tar(spi_registers, addr + next*4))) {
+                    goto done;
+                }
+                pending = 0;
+                continue;
+            }
+            if(err) {
+                goto done;
+            }
+            if(pending) {
+                buf[i + next - 1] = read_drw_reg.data;
+                restarts = 0; // Only give up on 8 in a row
+            }
+            pending = 1;
+            next++;
+        }
+
+        // RDBUFF can be read as many times as needed without side effects
+        do {
+            err = perform_swd_io_retry(spi_registers, &read_rdbuff);
+        } while(err == SWD_PARITY_MISMATCH && restarts++ < 8);
+        if(err) {
+            goto done;
+        }
+        buf[i + chunk - 1] = read_rdbuff.data;
+
+        i += chunk;
+        addr += chunk*4;
+    }
+
+done:
+    {
+        int csw_err;
+        csw_err = write_csw(spi_registers, 0);
+        return err ? err : csw_err;
+    }
+}
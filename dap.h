@@ -0,0 +1,77 @@
+#ifndef RASBERRY_PINE_DAP_H
+#define RASBERRY_PINE_DAP_H
+#include <inttypes.h>
+#include "rbpi.h"
+#include "swd.h"
+
+// SWD transfers and the MEM-AP on top of them, the core of libswd (see the Makefile).
+// Everything returns an SWD_ERROR, WAIT/FAULT/garbage ACKs leave the line in a
+// usable state (see recover_from_ack in dap.c) and everything but perform_swd_io
+// itself retries them (see perform_swd_io_retry).
+
+// The MEM-AP only promises to auto-increment the TAR inside a 1KB block,
+// so it needs re-writing every time a block write crosses one of these.
+#define TAR_WRAP_SIZE 0x400
+
+// Send each transaction as one burst assuming the ACK will be OK, see perform_swd_io
+extern int swd_speculative;
+
+// SELECT, CSW and TAR writes that wouldn't change anything are skipped (they come back
+// ACK_OK without going on the wire). Line resets, FAULTs and DAPABORT forget what they
+// were, anything else that could change them behind dap.c's back should call this.
+void dap_cache_invalidate();
+
+int perform_swd_io(SPIRegisters spi_registers, SWD_Packet* packet_data);
+// Same but recovers from WAIT, FAULT and garbage ACKs (backing off, clearing sticky
+// flags, reconnecting) until it works or RBPI_SWD_BUDGET_MS runs out, see dap.c.
+// An AP read isn't sent again after a reconnect, it comes back SWD_ACK_UNKNOWN.
+int perform_swd_io_retry(SPIRegisters spi_registers, SWD_Packet* packet_data);
+// Writes ABORT to clear every sticky flag in CTRL/STAT
+int swd_clear_sticky(SPIRegisters spi_registers);
+int run_swd_program(SPIRegisters spi_registers, const SWD_Program* program, uint32_t* read_data);
+
+// Queued transfers. DP/AP reads and writes get queued with somewhere for their result
+// to go (or NULL) and swd_flush sends the whole queue as back to back bursts, only
+// going one transaction at a time after something wasn't OK. Unlike on the wire AP
+// reads aren't posted here, an AP read's result is the value of the register it read
+// (swd_flush gets it from the next AP read, or an RDBUFF read it adds).
+// The queue gets flushed by itself when it's full, the queue functions return that
+// flush's error (and don't queue anything) if it had one.
+#define SWD_QUEUE_MAX 512
+
+typedef struct SWD_QueueResult {
+    int err;       // SWD_ERROR for this entry, SWD_NOT_RUN if something before it failed
+    uint8_t ack;
+    uint32_t data; // For reads
+} SWD_QueueResult;
+
+int swd_queue_read(SPIRegisters spi_registers, int APnDP, uint8_t addr, SWD_QueueResult* result);
+int swd_queue_write(SPIRegisters spi_registers, int APnDP, uint8_t addr, uint32_t data, SWD_QueueResult* result);
+// Queues whatever one of the swd_read_*/swd_write_* packet builders made
+int swd_queue_packet(SPIRegisters spi_registers, const SWD_Packet* packet, SWD_QueueResult* result);
+// Returns the first error any entry had
+int swd_flush(SPIRegisters spi_registers);
+// Line reset, JTAG-to-SWD and line resets to get the DP talking SWD, the DPIDR read is up to the caller
+void swd_connect_sequence(SPIRegisters spi_registers);
+// The connect sequence, DPIDR and debug power, polling instead of sleeping. dpidr can be NULL
+int swd_connect(SPIRegisters spi_registers, uint32_t* dpidr);
+// CTRL/STAT.ORUNDETECT, which bursts (speculative, compiled programs, the queue, streaming) rely on
+int set_overrun_detect(SPIRegisters spi_registers, int enable);
+
+// These all go through perform_swd_io_retry
+int read_tar(SPIRegisters spi_registers, uint32_t* tar);
+int write_tar(SPIRegisters spi_registers, uint32_t addr);
+int write_drw(SPIRegisters spi_registers, uint32_t data);
+int read_drw(SPIRegisters spi_registers, uint32_t* data);
+int write_csw(SPIRegisters spi_registers, int addr_increment);
+int mem_ap_read(SPIRegisters spi_registers, uint32_t addr, uint32_t* data);
+int mem_ap_write(SPIRegisters spi_registers, uint32_t addr, uint32_t data);
+// More than one word goes through mem_ap_write_stream
+int mem_ap_write_block(SPIRegisters spi_registers, uint32_t addr, const uint32_t* data, unsigned int n);
+// DRW writes sent a 1KB block at a time without checking ACKs, then one CTRL/STAT read
+// per block to see if anything overran. Only what didn't go in gets sent again.
+int mem_ap_write_stream(SPIRegisters spi_registers, uint32_t addr, const uint32_t* data, unsigned int n);
+// Skips words that are 0xFFFFFFFF, for writing into erased flash
+int mem_ap_write_block_sparse(SPIRegisters spi_registers, uint32_t addr, const uint32_t* data, unsigned int n);
+int mem_ap_read_block(SPIRegisters spi_registers, uint32_t addr, uint32_t* buf, unsigned int n);
+#endif
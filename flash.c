@@ -8,10 +8,20 @@
 #include <stdio.h>
 #include <sys/mman.h>
 #include <assert.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/wait.h>
 
 #include "common_utils.h"
 #include "rbpi.h" 
 #include "swd.h" 
+#include "transport.h"
+#include "dap.h"
+#include "metrics.h"
+#include "flash_stub.h"
+#include "image.h"
+#include "nrf.h"
 
 
 
@@ -28,425 +38,515 @@
 #define SWD_PARK_BIT   0x01
 
 
+// Clock divisors tried by --calibrate, slowest first
+static const uint32_t calibration_speeds[] = {
+    0x28, 0x20, 0x18, 0x10, 0x0C, 0x0A, 0x08, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01
+};
+#define CALIBRATION_ROUNDS 8
+#define CALIBRATION_WORDS (TAR_WRAP_SIZE/4)
+#define CALIBRATION_ADDR 0x20000000
+// What goes through the queue each round: ABORT, SELECT, CSW, TAR, the writes, TAR, the reads
+#define CALIBRATION_PACKETS (5 + 2*CALIBRATION_WORDS)
+
+static int calibration_transfer(SPIRegisters spi_registers, SWD_Packet* packet, unsigned int* transfers, unsigned int* errors) {
+    // WAIT just means the target is busy, it's not the wire's fault
+    int err = perform_swd_io_retry(spi_registers, packet);
+    (*transfers)++;
+    if(err) {
+        (*errors)++;
+    }
+    return err;
+}
 
-int perform_swd_io(SPIRegisters spi_registers, SWD_Packet* packet_data) {
-    /* This function uses the data in 'packet_data' to create an SPI_Data packet which
-     * is then sent out to the SPI interface where the actual "on the wire" stuff happens.
-     *
-     * If the "packet_data" is a read operation, then the response is packed into the "data"
-     * field of the packet_data. For both a read and a write operation the "ack" field
-     * of packet_data is filled in.
+static void calibration_round(SPIRegisters spi_registers, uint32_t dpidr, uint32_t seed, unsigned int* transfers, unsigned int* errors) {
+    /* One go at the current clock setting. Reconnects from scratch (so whatever the
+     * last setting left behind doesn't count against this one), reads the DPIDR,
+     * then writes a 1KB pattern into RAM and reads it back. All but the DPIDR read go
+     * through the queue, so this is the same packed, back to back traffic flashing
+     * sends. swd_flush gives up at the first thing that goes wrong (the line is
+     * probably out of step by then) and whatever didn't run counts as failed, the
+     * same as when the DPIDR read fails and nothing gets queued at all. Otherwise a
+     * setting that breaks early in every round would look almost clean.
      */
+    static SWD_Packet packets[CALIBRATION_PACKETS];
+    static SWD_QueueResult results[CALIBRATION_PACKETS];
+    uint32_t pattern[CALIBRATION_WORDS];
+    unsigned int i, n = 0;
+    SWD_ABORT_Reg abort_reg = { .ORUNERRCLR = 1, .WDERRCLR = 1, .SKERRCLR = 1, .STKCMPCLR = 1, .DAPABORT = 0 };
+    SWD_SELECT_Reg select_reg = { .APSEL = 0x0, .APBANKSEL = 0x0, .DPBANKSEL = 0x0 };
+    SWD_Packet packet;
+
+    // Lots of edges and runs of the same bit, the sort of thing a bad line gets wrong
+    for(i = 0; i < CALIBRATION_WORDS; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        pattern[i] = (i & 3) == 0 ? 0x55555555u << (i & 4 ? 1 : 0) : seed;
+    }
 
-    //First thing is to send out the header and read back the response (which should include the ACK)
-    uint32_t header_word = create_header_word(packet_data->header);
-    int parity_bit;
-
-
-    //printf("%s", packet_data->debug_string);
-    SPI_Data spi_data;
-    spi_data.n_writes = 1;
-    spi_data.mosi[0] = header_word;
-
-    // Need to pad the header word with some extra bits so that the ACK gets sent back.
-    // If this is a read operation the padding is 4 bits (1 turnaround + 3 ACK bits).
-    // If this is a write operation the padding is 5 bits (1 turnaround + 3 ACK bits + 1 turnaround)
-    // TODO, logically this should be done in SWD.c but that's a pain so we'll just do it here
-    spi_data.mosi[0] |= 0b1111 << 8;
-    spi_data.lengths[0] = 12;
-    if(!packet_data->header.RnW) {
-        spi_data.mosi[0] |= 1<<12;
-        spi_data.lengths[0] += 1;
+    swd_connect_sequence(spi_registers);
+    packet = swd_read_dpidr_reg();
+    int err = calibration_transfer(spi_registers, &packet, transfers, errors);
+    if(!err && packet.data != dpidr) {
+        (*errors)++;
+        err = 1;
     }
-    spi_io(spi_registers, &spi_data);
-    packet_data->ack = (spi_data.miso[0] >> 9) & 0b111;
-
-
-    // TODO, implement something here.
-    switch(packet_data->ack) {
-        case ACK_OK:
-            break;
-        case ACK_WAIT:
-            return SWD_ACK_WAIT;
-        case ACK_FAULT:
-            return SWD_ACK_FAULT;
-        default:
-            printf("Invalid ACK from slave device ACK = 0x%x\n", packet_data->ack);
-            return SWD_ACK_UNKNOWN;
+    if(err) {
+        *transfers += CALIBRATION_PACKETS;
+        *errors += CALIBRATION_PACKETS;
+        return;
     }
 
-    // If here we can continue with the transfer
-    if(packet_data->header.RnW) {
-        // Read data is all 1s to provide a pull-up.
-        // The slave device will do the actual work
-        spi_data.mosi[0] = 0xFFFF;
-        spi_data.lengths[0] = 16;
-        spi_data.mosi[1] = 0x1FFFF;
-        spi_data.lengths[1] = 17;
-
-    } else {
-        // I could rely on the user to send in the correct parity bit...
-        // but why not just do it here.
-        parity_bit = has_even_parity(packet_data->data, 32) ? 0 : 1;
-        spi_data.mosi[0] = packet_data->data & 0xFFFF;
-        spi_data.lengths[0] = 16;
-        spi_data.mosi[1] = ((packet_data->data >> 16) & 0xFFFF);
-        spi_data.mosi[1] |= parity_bit ? 1 << 16 : 0; // Add the parity bit
-        spi_data.lengths[1] = 17;
+    MEM_AP_CSW_Reg csw;
+    memset(&csw, 0, sizeof(csw));
+    csw.size = 0b010;
+    csw.addr_increment = 1;
+    packets[n++] = swd_write_abort_reg(abort_reg);
+    packets[n++] = swd_write_select_reg(select_reg);
+    packets[n++] = swd_write_csw_reg(csw);
+    packets[n++] = swd_write_ap_addr(TAR_OFFSET, CALIBRATION_ADDR);
+    for(i = 0; i < CALIBRATION_WORDS; i++) {
+        packets[n++] = swd_write_ap_addr(DRW_OFFSET, pattern[i]);
+    }
+    packets[n++] = swd_write_ap_addr(TAR_OFFSET, CALIBRATION_ADDR);
+    for(i = 0; i < CALIBRATION_WORDS; i++) {
+        packets[n++] = swd_read_ap_addr(DRW_OFFSET);
     }
 
-    // Need to "close" the transaction with at least 8 "idles".
-    spi_data.mosi[2] = 0x0;
-    spi_data.lengths[2] = 16;
-    spi_data.n_writes = 3;
-
-
-    spi_io(spi_registers, &spi_data); // Send it
-
-    // If this was a read-op then get the data back and stuff in "packet_data"
-    if(packet_data->header.RnW) {
-        packet_data->data = spi_data.miso[0] | (spi_data.miso[1] << 16);
-        packet_data->parity = (spi_data.miso[1] >> 16) & 0x1;
-
-        int expected_parity = !has_even_parity(packet_data->data, 32);
-
-        if(!packet_data->parity != !expected_parity) {
-            printf("Parity mismatch 0x%x %i\n", packet_data->data, packet_data->parity);
-            return SWD_PARITY_MISMATCH;
+    for(i = 0; i < n; i++) {
+        results[i].err = SWD_NOT_RUN;
+    }
+    // Only a flush when the queue fills up can fail here, nothing more goes out after that
+    for(i = 0; i < n && !swd_queue_packet(spi_registers, &packets[i], &results[i]); i++);
+    swd_flush(spi_registers);
+
+    for(i = 0; i < n; i++) {
+        (*transfers)++;
+        if(results[i].err) {
+            (*errors)++;
+        } else if(i >= n - CALIBRATION_WORDS && results[i].data != pattern[i - (n - CALIBRATION_WORDS)]) {
+            (*errors)++;
         }
     }
-    return SWD_OK; 
 }
 
-uint32_t read_tar(SPIRegisters spi_registers) {
-    SWD_Packet read_tar_reg = swd_read_ap_addr(TAR_OFFSET);
-    perform_swd_io(spi_registers, &read_tar_reg);
-    perform_swd_io(spi_registers, &read_tar_reg);
-    return read_tar_reg.data;
-}
+int calibrate_clock(SPIRegisters spi_registers, uint32_t dpidr, double max_error_rate) {
+    /* Sweeps the clock divisor (slowest first) and both sample edges, running a few
+     * calibration rounds at each. The fastest setting with an error rate (errors per
+     * transfer) no higher than 'max_error_rate' gets saved as this host's profile.
+     * Once two divisors in a row have nothing that passes there's no point going faster.
+     * Leaves the link on the chosen setting (or the default if nothing passed).
+     */
+    SPIClockProfile best = spi_default_clock_profile();
+    int found = 0;
+    unsigned int s, edge, round, failed_speeds = 0;
+
+    printf("Calibrating SPI clock, error rate must be <= %g\n", max_error_rate);
+    for(s = 0; s < sizeof(calibration_speeds)/sizeof(calibration_speeds[0]) && failed_speeds < 2; s++) {
+        int speed_passed = 0;
+        for(edge = 0; edge < 4; edge++) {
+            // The current defaults (both rising) get tried first so they win a tie
+            SPIClockProfile profile = { .speed = calibration_speeds[s], .in_rising = !(edge & 1), .out_rising = !(edge & 2) };
+            unsigned int transfers = 0, errors = 0;
+            spi_set_clock_profile(spi_registers, profile);
+            for(round = 0; round < CALIBRATION_ROUNDS; round++) {
+                calibration_round(spi_registers, dpidr, 0x9E3779B9u * (round + 1), &transfers, &errors);
+            }
+            double rate = transfers ? (double) errors / transfers : 1.0;
+            int passed = rate <= max_error_rate;
+            printf("speed = 0x%02x (%u Hz), in_rising = %u, out_rising = %u: %u errors in %u transfers%s\n",
+                   profile.speed, spi_clock_hz(profile.speed), profile.in_rising, profile.out_rising,
+                   errors, transfers, passed ? "" : ", FAILED");
+            if(passed && !speed_passed) {
+                best = profile;
+                found = 1;
+                speed_passed = 1;
+            }
+        }
+        failed_speeds = speed_passed ? 0 : failed_speeds + 1;
+    }
 
-int write_tar(SPIRegisters spi_registers, uint32_t addr) {
-    SWD_Packet write_tar_reg = swd_write_ap_addr(TAR_OFFSET, addr);
-    return perform_swd_io(spi_registers, &write_tar_reg);
+    // Back to something that works, then get the DP in a known state again
+    spi_set_clock_profile(spi_registers, best);
+    unsigned int transfers = 0, errors = 0;
+    calibration_round(spi_registers, dpidr, 1, &transfers, &errors);
+    if(!found) {
+        printf("No clock setting passed, not saving a profile\n");
+        return 1;
+    }
+    printf("Fastest passing setting: speed = 0x%x (%u Hz), in_rising = %u, out_rising = %u\n",
+           best.speed, spi_clock_hz(best.speed), best.in_rising, best.out_rising);
+    return spi_save_clock_profile(best);
 }
 
-int write_drw(SPIRegisters spi_registers, uint32_t data) {
-    SWD_Packet write_tar_reg = swd_write_ap_addr(DRW_OFFSET, data);
-    return perform_swd_io(spi_registers, &write_tar_reg);
+// Flashing several watches at once, one per AUX SPI master. Every target gets its
+// own process with its own SWD session (all the per-session state is global), which
+// runs the normal flash flow with its output going back here through a pipe.
+#define MAX_TARGETS 2
+#define TARGET_LOG_LINES 4
+
+typedef struct TargetWorker {
+    unsigned int spi;           // AUX_SPI1 or AUX_SPI2
+    pid_t pid;
+    int fd;                     // The worker's stdout, -1 once it's closed
+    char line[256];
+    unsigned int line_len;
+    char log[TARGET_LOG_LINES][256]; // The last few lines, for when it fails
+    unsigned int n_log;
+    const char* phase;
+    unsigned int pages_done;
+    int status;
+    uint64_t start_ns, end_ns;
+} TargetWorker;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-uint32_t read_drw(SPIRegisters spi_registers) {
-    SWD_Packet read_drw_reg = swd_read_ap_addr(DRW_OFFSET);
-    perform_swd_io(spi_registers, &read_drw_reg);
-    perform_swd_io(spi_registers, &read_drw_reg);
-    return read_drw_reg.data;
+static const char* spi_name(unsigned int spi) {
+    return spi == AUX_SPI2 ? "spi2" : "spi1";
 }
 
-uint32_t mem_ap_read(SPIRegisters spi_registers, uint32_t addr) {
-    write_tar(spi_registers, addr);
-    return read_drw(spi_registers);
+static int parse_targets(const char* list, TargetWorker* workers, unsigned int* n) {
+    // "1,2" or "spi1,spi2"
+    char copy[64];
+    char* token;
+    char* save;
+    snprintf(copy, sizeof(copy), "%s", list);
+    *n = 0;
+    for(token = strtok_r(copy, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        unsigned int spi;
+        if(strncmp(token, "spi", 3) == 0) {
+            token += 3;
+        }
+        if(strcmp(token, "1") == 0) {
+            spi = AUX_SPI1;
+        } else if(strcmp(token, "2") == 0) {
+            spi = AUX_SPI2;
+        } else {
+            // SPI0 can't do the odd lengths the SWD turnarounds need
+            printf("Unknown target '%s', only the AUX SPI masters 1 and 2 can do SWD\n", token);
+            return 1;
+        }
+        if((*n >= 1 && workers[0].spi == spi) || *n == MAX_TARGETS) {
+            printf("Each of the %i AUX SPI masters can only be used once\n", MAX_TARGETS);
+            return 1;
+        }
+        memset(&workers[*n], 0, sizeof(workers[*n]));
+        workers[*n].spi = spi;
+        (*n)++;
+    }
+    return *n == 0;
 }
 
-int mem_ap_write (SPIRegisters spi_registers, uint32_t addr, uint32_t data){
-    write_tar(spi_registers, addr);
-    return write_drw(spi_registers, data);
+static void suffix_env(const char* name, const char* suffix) {
+    // Anything a target writes out gets its own file
+    char value[512];
+    const char* old = getenv(name);
+    if(old && *old && strcmp(old, "-") != 0) {
+        snprintf(value, sizeof(value), "%s.%s", old, suffix);
+        setenv(name, value, 1);
+    }
 }
 
-int nvmc_config(SPIRegisters spi_registers, int write, int erase) {
-    assert(!(write && erase)); // Can't set both at the same time
-    int err = 0;
-
-    uint32_t value = write ? 1 : 0;
-    value = erase ? 2 : value;
-
-    // TODO really need to overhaul the error stuff here
-    err = mem_ap_write(spi_registers, NVMC_OFFSET + NVMC_CONFIG_OFFSET, value);
-    return err;
+static int start_targets(TargetWorker* workers, unsigned int n) {
+    /* Returns the index of the target to flash in each worker process,
+     * -1 in this one once they've all been started.
+     */
+    unsigned int i, masters = 0;
+    for(i = 0; i < n; i++) {
+        masters |= workers[i].spi;
+    }
+    enable_aux_spi_masters_or_die(masters);
+    fflush(stdout);
+    for(i = 0; i < n; i++) {
+        int fds[2];
+        if(pipe(fds)) {
+            printf("Could not create pipe\n");
+            exit(1);
+        }
+        workers[i].start_ns = now_ns();
+        workers[i].phase = "starting";
+        workers[i].pid = fork();
+        if(workers[i].pid < 0) {
+            printf("Could not start worker for %s\n", spi_name(workers[i].spi));
+            exit(1);
+        }
+        if(workers[i].pid == 0) {
+            unsigned int j;
+            for(j = 0; j < i; j++) {
+                close(workers[j].fd);
+            }
+            close(fds[0]);
+            dup2(fds[1], STDOUT_FILENO);
+            dup2(fds[1], STDERR_FILENO);
+            close(fds[1]);
+            setvbuf(stdout, NULL, _IOLBF, 0);
+            setenv("RBPI_AUX_SPI", workers[i].spi == AUX_SPI2 ? "2" : "1", 1);
+            suffix_env("RBPI_SIM_FLASH", spi_name(workers[i].spi));
+            suffix_env("RBPI_TRACE", spi_name(workers[i].spi));
+            suffix_env("RBPI_METRICS_FILE", spi_name(workers[i].spi));
+            if(getenv("RBPI_SIM_SEED")) {
+                // Two identical sims would make for a pretty boring test
+                char seed[32];
+                snprintf(seed, sizeof(seed), "%lu", strtoul(getenv("RBPI_SIM_SEED"), NULL, 0) + i);
+                setenv("RBPI_SIM_SEED", seed, 1);
+            }
+            return i;
+        }
+        close(fds[1]);
+        workers[i].fd = fds[0];
+    }
+    return -1;
 }
 
-int nvmc_erase_all(SPIRegisters spi_registers) {
-    int err;
-
-    if((err = nvmc_config(spi_registers, 0, 1))) {
-        return err;
+static void target_line(TargetWorker* worker, const char* line) {
+    // Works out how far along the worker is from what it prints
+    if(strncmp(line, "performing reset", 16) == 0) {
+        worker->phase = "connecting";
+    } else if(strncmp(line, "Beginning WRITE", 15) == 0) {
+        worker->phase = "writing";
+    } else if(strncmp(line, "Writing 0x", 10) == 0 || strncmp(line, "Page 0x", 7) == 0) {
+        worker->phase = "writing";
+        worker->pages_done++;
+    } else if(strncmp(line, "Writing done", 12) == 0) {
+        worker->phase = "verifying";
     }
-
-    err = mem_ap_write(spi_registers, NVMC_OFFSET + NVMC_ERASEALL, 1);
-    return err;
+    snprintf(worker->log[worker->n_log++ % TARGET_LOG_LINES], sizeof(worker->log[0]), "%s", line);
 }
 
-// Why does this return an SWD_Packet? TODO
-SWD_Packet debug_power(SPIRegisters spi_registers, int powerup) {
-    // Now read the CNTRL/STAT reg
-    SWD_Packet read_ctrlstat_reg = swd_read_cntrl_stat_reg();
-    // I need to write to the cntrl/stat register to power up
-    // the various debug subsystems.
-    perform_swd_io(spi_registers, &read_ctrlstat_reg);
-    SWD_CNTRL_STAT_Reg ctrlstat_reg = interpret_ctrlstat_reg(read_ctrlstat_reg.data);
-
-    if(ctrlstat_reg.WDATAERR || ctrlstat_reg.STICKYERR || ctrlstat_reg.STICKYCMP || ctrlstat_reg.STICKYORUN) {
-        printf("Error bits in CTRL/STAT register set. You should clear those errors. Aborting\n");
-        exit(1); // TODO shouldn't exit like this without cleaning shit up
+static void read_target_output(TargetWorker* worker) {
+    char buffer[1024];
+    ssize_t i, nread = read(worker->fd, buffer, sizeof(buffer));
+    if(nread <= 0) {
+        close(worker->fd);
+        worker->fd = -1;
+        waitpid(worker->pid, &worker->status, 0);
+        worker->end_ns = now_ns();
+        worker->phase = WIFEXITED(worker->status) && WEXITSTATUS(worker->status) == 0 ? "done" : "FAILED";
+        return;
     }
-
-    // Check to see if the debug power state is equal to the desired debug power state
-    // https://stackoverflow.com/questions/1596668/logical-xor-operator-in-c
-    if( (!ctrlstat_reg.CSYSPWRUPACK == !powerup) && (!ctrlstat_reg.CDBGPWRUOACK == !powerup)) {
-        // Debug is already powered as desired
-        return read_ctrlstat_reg;
+    for(i = 0; i < nread; i++) {
+        if(buffer[i] == '\n' || worker->line_len == sizeof(worker->line) - 1) {
+            worker->line[worker->line_len] = 0;
+            target_line(worker, worker->line);
+            worker->line_len = 0;
+        }
+        if(buffer[i] != '\n') {
+            worker->line[worker->line_len++] = buffer[i];
+        }
     }
+}
 
-    ctrlstat_reg.CSYSPWRUPREQ = powerup;
-    ctrlstat_reg.CDBGPWRUPREQ = powerup;
-
-
-    SWD_Packet write_cntrlstat_packet = swd_write_cntrl_stat_reg(ctrlstat_reg);
-    perform_swd_io(spi_registers, &write_cntrlstat_packet);
-    perform_swd_io(spi_registers, &read_ctrlstat_reg);
-    printf("CNTRL_STAT = 0x%x\n", read_ctrlstat_reg.data);
-    return read_ctrlstat_reg;
+static void print_target_progress(const TargetWorker* workers, unsigned int n, unsigned int n_pages, int tty) {
+    unsigned int i;
+    for(i = 0; i < n; i++) {
+        unsigned int done = workers[i].pages_done < n_pages ? workers[i].pages_done : n_pages;
+        printf("%s%s %3u%% %-10s", i ? "  " : "", spi_name(workers[i].spi), n_pages ? 100*done/n_pages : 0, workers[i].phase);
+    }
+    printf(tty ? "\r" : "\n");
+    fflush(stdout);
 }
 
-int reset_nrf(SPIRegisters spi_registers) {
-    SWD_SELECT_Reg select_reg = { .APSEL = 0x1, .APBANKSEL = 0x0, .DPBANKSEL = 0x0 };
-    SWD_Packet write_select_packet = swd_write_select_reg(select_reg);
-    perform_swd_io(spi_registers, &write_select_packet);
+static int wait_for_targets(TargetWorker* workers, unsigned int n, unsigned int n_pages) {
+    /* Shows everyone's progress on one line (a new line every second if stdout
+     * isn't a terminal) until all the workers have finished, then a report.
+     * Returns the number of targets that failed.
+     */
+    struct pollfd fds[MAX_TARGETS];
+    unsigned int i, running = n, failed = 0;
+    int tty = isatty(STDOUT_FILENO);
+    uint64_t start = now_ns(), next_progress = start;
+    while(running) {
+        unsigned int nfds = 0;
+        for(i = 0; i < n; i++) {
+            if(workers[i].fd >= 0) {
+                fds[nfds].fd = workers[i].fd;
+                fds[nfds].events = POLLIN;
+                nfds++;
+            }
+        }
+        poll(fds, nfds, 100);
+        nfds = 0;
+        for(i = 0; i < n; i++) {
+            if(workers[i].fd < 0) {
+                continue;
+            }
+            if(fds[nfds++].revents) {
+                read_target_output(&workers[i]);
+                running -= workers[i].fd < 0;
+            }
+        }
+        if(now_ns() >= next_progress || !running) {
+            print_target_progress(workers, n, n_pages, tty);
+            next_progress = now_ns() + (tty ? 200000000ull : 1000000000ull);
+        }
+    }
+    if(tty) {
+        printf("\n");
+    }
 
-    SWD_Packet write_reset = swd_write_ap_addr(0x0, 0x1);
-    perform_swd_io(spi_registers, &write_reset);
-    write_reset = swd_write_ap_addr(0x0, 0x0);
-    return  perform_swd_io(spi_registers, &write_reset);
+    printf("\ntarget  result   time      pages\n");
+    for(i = 0; i < n; i++) {
+        const TargetWorker* worker = &workers[i];
+        int ok = WIFEXITED(worker->status) && WEXITSTATUS(worker->status) == 0;
+        printf("%-7s %-8s %6.2f s  %u/%u\n", spi_name(worker->spi), ok ? "ok" : "FAILED",
+               (worker->end_ns - worker->start_ns) * 1e-9, worker->pages_done, n_pages);
+        if(!ok) {
+            unsigned int j = worker->n_log > TARGET_LOG_LINES ? worker->n_log - TARGET_LOG_LINES : 0;
+            for(; j < worker->n_log; j++) {
+                printf("    %s\n", worker->log[j % TARGET_LOG_LINES]);
+            }
+            failed++;
+        }
+    }
+    printf("%u targets in %.2f s: %u ok, %u failed\n", n, (now_ns() - start) * 1e-9, n - failed, failed);
+    return failed;
 }
 
-
 int main(int argc, char** argv) {
 
     int err = 0;
-    if(argc !=2) {
-        printf("Must specify binary code file for sending to PineTime\n");
-        return 0;
-    }
-    const char* code_filename = argv[1];
-    FILE* code_source = fopen(code_filename, "rb");
-    if(!code_source) {
-        printf("Could not open file '%s'\n", code_filename);
-        return -1;
-    }
-
-    uint32_t* mem = create_gpio_mmap();
-    if(!mem) {
-        return 1;
+    int opt;
+    static struct option long_options[] = {
+        {"speculative", no_argument, NULL, 's'},
+        {"diff", no_argument, NULL, 'd'},
+        {"loader", no_argument, NULL, 'l'},
+        {"crc", no_argument, NULL, 'c'},
+        {"calibrate", no_argument, NULL, 'C'},
+        {"max-error-rate", required_argument, NULL, 'e'},
+        {"targets", required_argument, NULL, 't'},
+        {"ram", no_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}
+    };
+    int diff = 0;
+    int loader = 0;
+    int use_crc = 0;
+    int calibrate = 0;
+    int ram = 0;
+    double max_error_rate = 0;
+    TargetWorker workers[MAX_TARGETS];
+    unsigned int n_targets = 0;
+    while((opt = getopt_long(argc, argv, "sdlcCe:t:r", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 's':
+                // Single burst per transaction, assume the ACK will be OK
+                swd_speculative = 1;
+                break;
+            case 'd':
+                // Only erase/write the pages that changed, see flash_diff
+                diff = 1;
+                break;
+            case 'l':
+                // Let a stub on the target do the flash writes, see flash_with_loader
+                loader = 1;
+                break;
+            case 'c':
+                // Check pages with a CRC32 worked out on the target instead of reading them back
+                use_crc = 1;
+                break;
+            case 'C':
+                // Find the fastest SPI clock that works and save it, see calibrate_clock
+                calibrate = 1;
+                break;
+            case 'e':
+                max_error_rate = strtod(optarg, NULL);
+                break;
+            case 'r':
+                // Load an image linked for RAM and run it, nothing gets flashed, see nrf_run_in_ram
+                ram = 1;
+                break;
+            case 't':
+                // Flash a watch on each of these AUX SPI masters at the same time
+                if(parse_targets(optarg, workers, &n_targets)) {
+                    return -1;
+                }
+                break;
+            default:
+                printf("Usage: %s [--speculative] [--diff] [--loader] [--crc] [--targets 1,2] binary_file\n", argv[0]);
+                printf("       %s --ram [--targets 1,2] ram_image\n", argv[0]);
+                printf("       %s --calibrate [--max-error-rate rate]\n", argv[0]);
+                return 0;
+        }
     }
-    SPIRegisters spi_registers = init_aux_spi(mem);
-
-    // Enable the AUX SPI1 interface
-    const uint32_t ENABLE_AUX_SPI1 = 0x2; // Bit 1
-    *spi_registers.enable = ENABLE_AUX_SPI1;
-
-    // Now  adjust the RB-PI AUX SPI control reg
-    ControlReg control_reg = {
-        .speed = 0x28,
-        .chip_select_pattern = 0,
-        .post_input_mode = 0,
-        .variable_cs = 0,
-        .variable_width = 1,
-        .dout_hold_time = 4,
-        .enable = 1,
-        .in_rising = 1,
-        .clear_fifos = 0,
-        .out_rising = 1,
-        .invert_clk =0,
-        .msb_out_first = 0,
-        .shift_length = 0,
-        .cs_high_time = 0,
-        .tx_empty_irq = 0,
-        .done_irq = 0,
-        .msb_in_first = 0,
-        .keep_input = 0
-        };
-    write_control_reg(spi_registers, control_reg);
-
-    // Once here we're ready to start doing SPI stuff with the PineTime
-    // Here's the basic steps needed to get code into the NRF's flash memory
-    // SWD_RESET, JTAG_TO_SWD, SWD_RESET
-    // Read the DP-ID b/c you have to do that I guess
-    // Power up the debug bits inthe CTRL/STAT
-    // Read CTRL/STAT, make sure error bits are off and debug power is 0=on
-    // Read the CTRL-AP to make sure no protection is turned on
-    // Maybe perform a reset in the CTRL-AP (idk yet)
-    // (Any other checks in the CTRL AP?)
-    // Go the MEM-AP (APSEL=0)
-    // Read the CSW make sure the size field is 0b010 (32-bit transfers)
-    // Using the TAR/DRW enable erase in the NVMC config
-    // Do an "ERASE ALL" in the NVMC
-    // Enable write  & disable erase in the NVMC config
-    // start squirting data in the NV memory startin at address 0x0, 32-bits at a  time.
-    // Perhaps here I should consider autoincrementing the TAR.
-    // Once the squirting has finished do a reset in the CTRL-AP again.
-    //
-    // Set the NVMC config to read-only
-    // power downt the debug stuff
-    // Success?
-
-    // Perform a SWD line reset
-    printf("performing reset\n");
-    SPI_Data swd_to_jtag_data = swd_jtag_to_swd();
-    SPI_Data reset_data = swd_protocol_reset();
-    spi_io(spi_registers, &reset_data);
-    spi_io(spi_registers, &swd_to_jtag_data);
-    spi_io(spi_registers, &reset_data);
-    spi_io(spi_registers, &reset_data);
-    sleep(1);
-
-    // Read the DP ID register
-    SWD_Packet read_idr_packet = swd_read_dpidr_reg();
-    if(perform_swd_io(spi_registers, &read_idr_packet)) {
-        printf("SWD protocol error encountered, quitting\n");
-        err = -1;
-        goto done;
+    Image image;
+    memset(&image, 0, sizeof(image));
+    if(!calibrate) {
+        if(optind != argc-1) {
+            printf("Must specify binary code file for sending to PineTime\n");
+            return 0;
+        }
+        const char* code_filename = argv[optind];
+        if(image_open(code_filename, &image)) {
+            return -1;
+        }
+        if(!ram && !image_fits(&image)) {
+            image_close(&image);
+            return -1;
+        }
     }
 
-    printf("IDCode = 0x%x\n", read_idr_packet.data);
-    struct SWD_DPIDR_Reg idr_reg = interpret_dp_idr_reg(read_idr_packet.data);
-    printf("revision = 0x%x\n", idr_reg.revision);
-    printf("part_number = 0x%x\n", idr_reg.part_number);
-    printf("min = 0x%x\n", idr_reg.min);
-    printf("version = 0x%x\n", idr_reg.version);
-    printf("designer = 0x%x\n", idr_reg.designer);
-    printf("\n");
-
-    debug_power(spi_registers, 1);
-
-    // AP_SEL=1 is the CTRL_AP
-    // AP_SEL=0 is the AHB MEM_AP
-    // Right now want to read the CTRL_AP PROT_STATUS (Addr=0xC)
-    SWD_SELECT_Reg select_reg = { .APSEL = 0x1, .APBANKSEL = 0x0, .DPBANKSEL = 0x0 };
-    SWD_Packet write_select_packet = swd_write_select_reg(select_reg);
-    perform_swd_io(spi_registers, &write_select_packet);
-
-    // Now read protect status (reminder, need to do two reads b/c idk thats the way it works)
-    SWD_Packet read_protect_status_reg = swd_read_protect_status_reg();
-    perform_swd_io(spi_registers, &read_protect_status_reg);
-    perform_swd_io(spi_registers, &read_protect_status_reg);
-    if(read_protect_status_reg.data != 0x1) {
-        printf("NRF data protection is ON. Must do an ERASE ALL to fix this. Aborting\n");
-        err = -1;
-        goto done;
-        // TODO do the below instead of quitting?
-        // Perform an "eraseall" to remove firmware lock
-        //SWD_Packet write_eraseall_reg = swd_ap_write_eraseall();
-        //perform_swd_io(spi_registers, &write_eraseall_reg);
+    if(nrf_load_programs()) {
+        printf("Could not compile SWD programs\n");
+        return -1;
     }
-    
-    // TODO could maybe check the erase status here...make sure an erase isn't going on
-    // that'd be good eventually maybe
 
-    if(reset_nrf(spi_registers)) {
-        printf("Error doing reset\n");
-        goto done;
+    if(n_targets && !calibrate) {
+        // Each worker carries on from here with its own target, this process just watches
+        if(start_targets(workers, n_targets) < 0) {
+            unsigned int n_pages = 0;
+            uint32_t page_addr;
+            for(page_addr = image_first_page(&image); page_addr < image_end(&image); page_addr += FLASH_PAGE_SIZE) {
+                n_pages += image_covers(&image, page_addr, FLASH_PAGE_SIZE);
+            }
+            err = wait_for_targets(workers, n_targets, n_pages) ? -1 : 0;
+            image_close(&image);
+            return err;
+        }
     }
 
-    // Now done with the CTRL-AP, lets move to the MEM-AP/AHB-AP
-    select_reg.APSEL = 0x0;
-    select_reg.APBANKSEL = 0x0;
-    select_reg.DPBANKSEL = 0x0;
-    write_select_packet = swd_write_select_reg(select_reg);
-    perform_swd_io(spi_registers, &write_select_packet);
-
-    // Read the CSW make sure the size field is 0b010 (32-bit transfers)
-    MEM_AP_CSW_Reg csw;
-    memset(&csw, 0, sizeof(csw));
-    csw.size = 0b010;
-    csw.addr_increment = 0;
-
-    SWD_Packet write_csw = swd_write_csw_reg(csw);
-
-    if(perform_swd_io(spi_registers, &write_csw)) {
-        printf("Error writing to MEM AP CSW reg\n");
-        goto done;
+    SPIRegisters spi_registers = init_spi_or_die();
+    if(calibrate) {
+        // Whatever the old profile says might be what's broken
+        spi_set_clock_profile(spi_registers, spi_default_clock_profile());
     }
 
-    // Next erase all the NVMC memory
-    if(nvmc_erase_all(spi_registers)) {
-        printf("Error encountered while doing NVMC ERASE ALL\n");
+    uint32_t dpidr;
+    if(nrf_connect(spi_registers, &dpidr)) {
+        err = -1;
         goto done;
     }
-    // Set NVMC CONFIG to write_enable
-    nvmc_config(spi_registers, 1, 0);
-
-    // Now start writing data
-    uint32_t flash_addr = 0x0;
-    uint32_t flash_data;
-    printf("Beginning WRITE!\n");
-    int write_err=0;
-    while(fread(&flash_data, sizeof(flash_data), 1, code_source) == 1) {
-        if(flash_addr >= 0x80000) {
-            printf("Binary file too big to fit in FLASH. Quitting mid-write\n");
-            break;
-        }
 
-        // TODO. should perhaps check the transfer in progress bit in the CSW register
-        // (I think thats where it is) to make sure things don't go too fast
-        printf("Writing 0x%x = 0x%x\n", flash_addr, flash_data);
-        do {
-            if(write_err) {
-                // I'm pretty sure if I got an ACK_WAIT then the TAR address doens't increment
-                // if that's not true I'll have to incremement it myself or something
-                usleep(5);
-            }
-            write_err = mem_ap_write(spi_registers, flash_addr, flash_data);
-        } while(write_err == SWD_ACK_WAIT);
-
-        if(write_err) {
-            printf("Error(%i) encountered while writing addr=0x%x\n", write_err, flash_addr);
+    if(calibrate) {
+        // Keep the firmware's hands off the RAM being used for the pattern
+        if(core_halt(spi_registers) || calibrate_clock(spi_registers, dpidr, max_error_rate)) {
+            err = -1;
             goto done;
         }
-        flash_addr += 0x4;
-    }
-    if(ferror(code_source) || !feof(code_source)) {
-        printf("Error encountered reading data from binary code source\n");
+        if(reset_nrf(spi_registers)) {
+            printf("Error doing reset\n");
+            err = -1;
+        }
         goto done;
     }
 
-
-    printf("Writing done, doing check now\n");
-    // Now that writing has finished, set the NVMC back to read only
-    // then go through all the data and confirm that it's right
-    nvmc_config(spi_registers, 0, 0);
-    fseek(code_source, 0, SEEK_SET);
-    int err_count = 0;
-    flash_addr = 0;
-
-
-    while(fread(&flash_data, sizeof(flash_data), 1, code_source) == 1) {
-        // Don't need to check for stepping past end of flash memory b/c we
-        // won't get here if that happened above...and unless someone re-wrote the 
-        // code source file between above and now we're fine to assume everything's ok
-        uint32_t rb_data = mem_ap_read(spi_registers, flash_addr);
-        if(flash_data != rb_data) {
-            printf("Flash data mismatch at address 0x%x: Readback = 0x%x, Expected = 0x%x\n", flash_addr, rb_data, flash_data);
-            err_count++;
-            if(err_count > 100) {
-            printf("Too many errors found quitting readback check\n");
-                break;
-            }
+    if(ram) {
+        if(nrf_run_in_ram(spi_registers, &image)) {
+            err = -1;
         }
-        flash_addr += 0x4;
-    }
-    if(ferror(code_source) || !feof(code_source)) {
-        printf("Error encountered checking data put in the flash\n");
         goto done;
     }
 
-    // And finally do a system reset I guess
-    if(reset_nrf(spi_registers)) {
-        printf("Error doing reset\n");
-        goto done;
+    if(nrf_flash_image(spi_registers, &image, (diff ? NRF_FLASH_DIFF : 0) | (loader ? NRF_FLASH_LOADER : 0) |
+                                              (use_crc ? NRF_FLASH_CRC : 0))) {
+        err = -1;
     }
 
     // Clean up
 done:
-    clean_up_mmap();
-    mem = NULL;
+    clean_up_spi();
+    image_close(&image);
     return err;
 }
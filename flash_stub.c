@@ -0,0 +1,83 @@
+#include "flash_stub.h"
+
+// There's no ARM assembler in the build so these are hand assembled,
+// the listing is next to each instruction. Two Thumb instructions per word, low half first.
+//
+// The flash loader, see flash_stub.h for the mailbox
+//   r0 current slot, r1 src, r2 dst, r3 words left, r4 scratch
+//   r5 &NVMC.CONFIG, r6 &NVMC.READY, r7 mailbox
+const uint32_t flash_loader_code[] = {
+    0x4D0F4F0E, // 00: ldr r7, [pc, #56]     ; mailbox
+                // 02: ldr r5, [pc, #60]     ; NVMC.CONFIG
+    0x46384E0F, // 04: ldr r6, [pc, #60]     ; NVMC.READY
+                // 06: mov r0, r7            ; slot 0
+    0x2C016884, // 08: ldr r4, [r0, #8]      ; wait: state
+                // 0a: cmp r4, #1
+    0x6802D1FC, // 0c: bne wait
+                // 0e: ldr r2, [r0, #0]      ; dst
+    0x68C16843, // 10: ldr r3, [r0, #4]      ; nwords
+                // 12: ldr r1, [r0, #12]     ; src
+    0x602C2401, // 14: movs r4, #1
+                // 16: str r4, [r5]          ; CONFIG = WEN
+    0xD0082B00, // 18: cmp r3, #0            ; copy:
+                // 1a: beq done
+    0x6014680C, // 1c: ldr r4, [r1]
+                // 1e: str r4, [r2]
+    0x07E46834, // 20: ldr r4, [r6]          ; ready:
+                // 22: lsls r4, r4, #31
+    0x3104D0FC, // 24: beq ready
+                // 26: adds r1, #4
+    0x3B013204, // 28: adds r2, #4
+                // 2a: subs r3, #1
+    0x2400E7F4, // 2c: b copy
+                // 2e: movs r4, #0           ; done:
+    0x6084602C, // 30: str r4, [r5]          ; CONFIG = REN
+                // 32: str r4, [r0, #8]      ; state = EMPTY
+    0x40602410, // 34: movs r4, #16
+                // 36: eors r0, r4           ; other slot
+    0xBF00E7E6, // 38: b wait
+                // 3a: nop
+    0x20000200, // 3c: mailbox
+    0x4001E504, // 40: NVMC.CONFIG
+    0x4001E400  // 44: NVMC.READY
+};
+const unsigned int flash_loader_code_words = sizeof(flash_loader_code)/sizeof(flash_loader_code[0]);
+
+// CRC32 over flash pages, see flash_stub.h for the parameters.
+// Bit at a time, there isn't any room for a table in 16-bit Thumb worth the bother
+// and it's still a lot quicker than reading the flash back over SWD.
+//   r0 params, r1 address, r2 words left in page, r3 pages left, r4 crc,
+//   r5 word/bit counter, r6 results, r7 polynomial
+const uint32_t flash_crc_code[] = {
+    0x4F0E480D, // 00: ldr r0, [pc, #52]     ; params
+                // 02: ldr r7, [pc, #56]     ; polynomial
+    0x68836801, // 04: ldr r1, [r0, #0]      ; start
+                // 06: ldr r3, [r0, #8]      ; npages
+    0x2B0068C6, // 08: ldr r6, [r0, #12]     ; results
+                // 0a: cmp r3, #0            ; page:
+    0x6842D012, // 0c: beq finished
+                // 0e: ldr r2, [r0, #4]      ; page_words
+    0x43E42400, // 10: movs r4, #0
+                // 12: mvns r4, r4           ; crc = ~0
+    0x406C680D, // 14: ldr r5, [r1]          ; word:
+                // 16: eors r4, r5
+    0x25203104, // 18: adds r1, #4
+                // 1a: movs r5, #32
+    0xD3000864, // 1c: lsrs r4, r4, #1       ; bit:
+                // 1e: bcc nox
+    0x3D01407C, // 20: eors r4, r7
+                // 22: subs r5, #1           ; nox:
+    0x3A01D1FA, // 24: bne bit
+                // 26: subs r2, #1
+    0x43E4D1F4, // 28: bne word
+                // 2a: mvns r4, r4
+    0x36046034, // 2c: str r4, [r6]
+                // 2e: adds r6, #4
+    0xE7EA3B01, // 30: subs r3, #1
+                // 32: b page
+    0xBF00BE00, // 34: bkpt #0               ; finished:
+                // 36: nop
+    0x20000200, // 38: params
+    0xEDB88320  // 3c: polynomial (reflected)
+};
+const unsigned int flash_crc_code_words = sizeof(flash_crc_code)/sizeof(flash_crc_code[0]);
@@ -0,0 +1,63 @@
+#ifndef RASBERRY_PINE_FLASH_STUB_H
+#define RASBERRY_PINE_FLASH_STUB_H
+#include <inttypes.h>
+
+// Little bits of Cortex-M4 code that get loaded into the nRF52's RAM and run
+// on the core, so the slow parts of flashing happen on the target instead of over SWD.
+
+// Cortex-M debug registers (see the ARMv7-M ARM, C1.6)
+#define DHCSR_ADDR 0xE000EDF0
+#define DCRSR_ADDR 0xE000EDF4
+#define DCRDR_ADDR 0xE000EDF8
+#define DHCSR_KEY 0xA05F0000
+#define DHCSR_C_DEBUGEN (1 << 0)
+#define DHCSR_C_HALT    (1 << 1)
+#define DHCSR_C_MASKINTS (1 << 3) // Only changes while the core is halted
+#define DHCSR_S_REGRDY  (1 << 16)
+#define DHCSR_S_HALT    (1 << 17)
+#define DCRSR_REGWnR    (1 << 16)
+#define CORE_REG_SP   13
+#define CORE_REG_LR   14
+#define CORE_REG_PC   15
+#define CORE_REG_XPSR 16
+#define XPSR_THUMB    0x01000000
+#define SCB_VTOR_ADDR 0xE000ED08 // Where the vector table is
+
+// RAM layout while the flash loader runs
+//   0x20000000 the loader code
+//   0x20000200 two mailbox slots, 16 bytes each
+//   0x20001000 buffer 0, 0x20002000 buffer 1 (a flash page each)
+// A slot is { dst, nwords, state, src }. The host fills a buffer, then writes
+// dst, nwords and state=FULL in that order (one auto-increment block write).
+// The loader writes the words to flash and sets state back to EMPTY, then
+// moves on to the other slot. So the host can fill one buffer while the
+// other one is going into flash.
+#define FLASH_LOADER_BASE 0x20000000
+#define FLASH_LOADER_MAILBOX 0x20000200
+#define FLASH_LOADER_SLOT_SIZE 0x10
+#define FLASH_LOADER_SLOT_DST 0x0
+#define FLASH_LOADER_SLOT_NWORDS 0x4
+#define FLASH_LOADER_SLOT_STATE 0x8
+#define FLASH_LOADER_SLOT_SRC 0xC
+#define FLASH_LOADER_BUFFER0 0x20001000
+#define FLASH_LOADER_BUFFER1 0x20002000
+#define FLASH_LOADER_BUFFER_SIZE 0x1000
+#define FLASH_LOADER_STACK 0x20010000
+#define FLASH_LOADER_EMPTY 0
+#define FLASH_LOADER_FULL 1
+
+// The CRC32 stub. Runs over 'npages' pages of 'page_words' words starting at 'start'
+// and puts one CRC32 (the usual zlib one) per page in the results, then halts on a BKPT.
+//   0x20000000 the stub
+//   0x20000200 { start, page_words, npages, results }
+//   0x20000210 the results
+#define FLASH_CRC_BASE 0x20000000
+#define FLASH_CRC_PARAMS 0x20000200
+#define FLASH_CRC_RESULTS 0x20000210
+#define FLASH_CRC_MAX_PAGES 128
+
+extern const uint32_t flash_loader_code[];
+extern const unsigned int flash_loader_code_words;
+extern const uint32_t flash_crc_code[];
+extern const unsigned int flash_crc_code_words;
+#endif
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "gpio_swd.h"
+#include "swd.h"
+
+/* The SPI words coming in are just bits, and with the AUX SPI that's all that matters
+ * since the resistor lets the target overdrive MOSI whenever it likes. With one real
+ * bidirectional pin the host has to stop driving SWDIO for the turnarounds, ACK and read
+ * data, so this follows the frames the same way the target does:
+ *   header (8 out), turnaround + ACK (4 in), then
+ *   read:  data + parity + turnaround (34 in)
+ *   write: turnaround (1 in), data + parity (33 out)
+ *   WAIT/FAULT: a turnaround, or the whole data phase if ORUNDETECT is set
+ * Anything the host drives is known up front, so each run of host driven bits gets turned
+ * into a list of GPSET/GPCLR writes first and then blasted out in an unrolled loop.
+ * The target samples SWDIO on the rising edge of SWCLK and changes it after the rising
+ * edge, so the host changes SWDIO while SWCLK is high and reads it while SWCLK is low.
+ */
+
+enum GPIO_SWD_STATE {
+    GPIO_SWD_IDLE = 0,
+    GPIO_SWD_HEADER,
+    GPIO_SWD_ACK,       // Turnaround + 3 ACK bits, target driven
+    GPIO_SWD_READ,      // 32 data bits + parity + turnaround, target driven
+    GPIO_SWD_TRN,       // Turnaround after a WAIT/FAULT with no data phase
+    GPIO_SWD_TRN_WRITE, // Turnaround before write data
+    GPIO_SWD_WRITE,     // 32 data bits + parity, host driven
+    GPIO_SWD_LOCKOUT    // Bad header, the target ignores everything until a line reset
+};
+
+#define EDGE_SET 0
+#define EDGE_CLR 1
+// Worst case 3 register writes per bit, see out_edges
+#define MAX_EDGES (24*3)
+
+typedef struct GPIOEdge {
+    uint32_t reg;
+    uint32_t mask;
+} GPIOEdge;
+
+GPIORegisters gpio_registers(uint32_t* local_mem) {
+    // Same block init_aux_spi sets the pin functions in
+    const uint32_t gpio_offset = 0x200000;
+    volatile uint32_t* base = local_mem + gpio_offset/4;
+    GPIORegisters regs = {
+        .fsel = base + GPIO_GPFSEL0/4,
+        .set = base + GPIO_GPSET0/4,
+        .clr = base + GPIO_GPCLR0/4,
+        .lev = base + GPIO_GPLEV0/4,
+        .sim = NULL
+    };
+    return regs;
+}
+
+GPIORegisters gpio_sim_registers(SimGPIO* sim) {
+    GPIORegisters regs;
+    memset(&regs, 0, sizeof(regs));
+    regs.sim = sim;
+    return regs;
+}
+
+static void write_fsel(GPIOSWD* swd, uint32_t value) {
+    if(swd->regs.sim) {
+        sim_gpio_write(swd->regs.sim, GPIO_GPFSEL0 + swd->fsel_index*4, value);
+    } else {
+        swd->regs.fsel[swd->fsel_index] = value;
+    }
+}
+
+static void set_dio_output(GPIOSWD* swd, int output) {
+    if(swd->dio_output != output) {
+        write_fsel(swd, output ? swd->fsel_output : swd->fsel_input);
+        swd->dio_output = output;
+        swd->turnarounds++;
+    }
+}
+
+static inline void spin(unsigned int n) {
+    volatile unsigned int i;
+    for(i = 0; i < n; i++);
+}
+
+int gpio_swd_init(GPIOSWD* swd, GPIORegisters regs, unsigned int swclk, unsigned int swdio, unsigned int delay) {
+    // GPSET0/GPCLR0/GPLEV0 only cover GPIO 0-31, and 28+ aren't on the header anyway
+    if(swclk > 27 || swdio > 27 || swclk == swdio) {
+        printf("SWCLK (GPIO %u) and SWDIO (GPIO %u) need to be two different GPIOs between 0 and 27\n", swclk, swdio);
+        return 1;
+    }
+    memset(swd, 0, sizeof(*swd));
+    swd->regs = regs;
+    swd->clk_mask = 1u << swclk;
+    swd->dio_mask = 1u << swdio;
+    swd->delay = delay;
+
+    // SWCLK is always an output, SWDIO starts out driven
+    unsigned int clk_index = swclk/10;
+    uint32_t fsel = regs.sim ? sim_gpio_read(regs.sim, GPIO_GPFSEL0 + clk_index*4) : regs.fsel[clk_index];
+    fsel = (fsel & ~(0x7u << (swclk%10)*3)) | (GPIO_FSEL_OUTPUT << (swclk%10)*3);
+    if(regs.sim) {
+        sim_gpio_write(regs.sim, GPIO_GPFSEL0 + clk_index*4, fsel);
+    } else {
+        regs.fsel[clk_index] = fsel;
+    }
+    swd->fsel_index = swdio/10;
+    fsel = regs.sim ? sim_gpio_read(regs.sim, GPIO_GPFSEL0 + swd->fsel_index*4) : regs.fsel[swd->fsel_index];
+    swd->fsel_input = fsel & ~(0x7u << (swdio%10)*3);
+    swd->fsel_output = swd->fsel_input | (GPIO_FSEL_OUTPUT << (swdio%10)*3);
+
+    // Clock idles high so each bit is low then high, SWDIO high like after a line reset
+    if(regs.sim) {
+        sim_gpio_write(regs.sim, GPIO_GPSET0, swd->clk_mask | swd->dio_mask);
+    } else {
+        *regs.set = swd->clk_mask | swd->dio_mask;
+    }
+    swd->dio_level = 1;
+    swd->dio_output = 0;
+    set_dio_output(swd, 1);
+    swd->turnarounds = 0;
+    return 0;
+}
+
+static int header_is_valid(uint8_t header) {
+    unsigned int parity = ((header >> 1) ^ (header >> 2) ^ (header >> 3) ^ (header >> 4)) & 1;
+    return (header & 1) && ((header >> 5) & 1) == parity && !((header >> 6) & 1) && ((header >> 7) & 1);
+}
+
+static void frame_out_bit(GPIOSWD* swd, int bit) {
+    // At least 50 high bits followed by a low one is a line reset, no matter what state it's in
+    if(!bit && swd->ones >= 50) {
+        swd->state = GPIO_SWD_IDLE;
+    }
+    swd->ones = bit ? swd->ones + 1 : 0;
+    switch(swd->state) {
+        case GPIO_SWD_IDLE:
+            if(bit) {
+                swd->header = 1;
+                swd->nbits = 1;
+                swd->state = GPIO_SWD_HEADER;
+            }
+            break;
+        case GPIO_SWD_HEADER:
+            swd->header |= bit << swd->nbits;
+            if(++swd->nbits == 8) {
+                swd->nbits = 0;
+                swd->ack = 0;
+                swd->state = header_is_valid(swd->header) ? GPIO_SWD_ACK : GPIO_SWD_LOCKOUT;
+            }
+            break;
+        case GPIO_SWD_WRITE:
+            if(swd->nbits < 32) {
+                swd->wdata |= (uint32_t) bit << swd->nbits;
+            }
+            if(++swd->nbits < 33) {
+                break;
+            }
+            // The only DP writes that change how frames look
+            if(swd->ack == ACK_OK && !(swd->header & 0x6)) {
+                unsigned int addr = ((swd->header >> 3) & 0x3) << 2;
+                if(addr == SWD_SELECT_ADDR) {
+                    swd->dpbanksel = swd->wdata & 0xF;
+                } else if(addr == 0x4 && swd->dpbanksel == 0) {
+                    swd->orundetect = swd->wdata & 1;
+                }
+            }
+            swd->state = GPIO_SWD_IDLE;
+            break;
+        default:
+            break;
+    }
+}
+
+static unsigned int frame_input_bits(GPIOSWD* swd) {
+    // How many target driven bits come next, 0 if the host is driving
+    switch(swd->state) {
+        case GPIO_SWD_ACK: return 4 - swd->nbits;
+        case GPIO_SWD_READ: return 34 - swd->nbits;
+        case GPIO_SWD_TRN:
+        case GPIO_SWD_TRN_WRITE: return 1;
+        default: return 0;
+    }
+}
+
+static void frame_in_bits(GPIOSWD* swd, uint32_t bits, unsigned int n) {
+    // The bits only matter for the ACK, everything else just moves the frame along
+    swd->ones = 0;
+    switch(swd->state) {
+        case GPIO_SWD_ACK:
+            swd->ack |= ((bits << swd->nbits) >> 1) & 0x7;
+            swd->nbits += n;
+            if(swd->nbits < 4) {
+                break;
+            }
+            swd->nbits = 0;
+            swd->wdata = 0;
+            if(swd->ack == ACK_OK || (swd->orundetect && (swd->ack == ACK_WAIT || swd->ack == ACK_FAULT))) {
+                swd->state = (swd->header & (1 << 2)) ? GPIO_SWD_READ : GPIO_SWD_TRN_WRITE;
+            } else {
+                swd->state = GPIO_SWD_TRN;
+            }
+            break;
+        case GPIO_SWD_READ:
+            swd->nbits += n;
+            if(swd->nbits == 34) {
+                swd->state = GPIO_SWD_IDLE;
+            }
+            break;
+        case GPIO_SWD_TRN:
+            swd->state = GPIO_SWD_IDLE;
+            break;
+        case GPIO_SWD_TRN_WRITE:
+            swd->nbits = 0;
+            swd->state = GPIO_SWD_WRITE;
+            break;
+        default:
+            break;
+    }
+}
+
+static unsigned int out_edges(GPIOSWD* swd, uint32_t bits, unsigned int max, GPIOEdge* edges, unsigned int* n_edges) {
+    /* Works out the register writes for the host driven bits at the start of 'bits',
+     * stopping at the first target driven one. Returns how many bits that was.
+     * SWCLK is high between bits. SWDIO only gets written when it changes: going low
+     * that can happen in the same GPCLR write that drops the clock, going high it's
+     * set while the clock is still high.
+     */
+    unsigned int i, n = 0;
+    for(i = 0; i < max && frame_input_bits(swd) == 0; i++) {
+        int bit = (bits >> i) & 1;
+        if(bit && !swd->dio_level) {
+            edges[n].reg = EDGE_SET;
+            edges[n++].mask = swd->dio_mask;
+        }
+        edges[n].reg = EDGE_CLR;
+        edges[n++].mask = swd->clk_mask | (!bit && swd->dio_level ? swd->dio_mask : 0);
+        edges[n].reg = EDGE_SET;
+        edges[n++].mask = swd->clk_mask;
+        swd->dio_level = bit;
+        frame_out_bit(swd, bit);
+    }
+    *n_edges = n;
+    return i;
+}
+
+static void run_edges(GPIOSWD* swd, const GPIOEdge* edges, unsigned int n) {
+    if(swd->regs.sim) {
+        static const unsigned int offsets[2] = {GPIO_GPSET0, GPIO_GPCLR0};
+        unsigned int i;
+        for(i = 0; i < n; i++) {
+            sim_gpio_write(swd->regs.sim, offsets[edges[i].reg], edges[i].mask);
+        }
+        return;
+    }
+    volatile uint32_t* regs[2] = {swd->regs.set, swd->regs.clr};
+    unsigned int delay = swd->delay;
+    unsigned int i = 0;
+    if(delay) {
+        for(; i < n; i++) {
+            *regs[edges[i].reg] = edges[i].mask;
+            spin(delay);
+        }
+        return;
+    }
+    for(; i + 4 <= n; i += 4) {
+        *regs[edges[i].reg] = edges[i].mask;
+        *regs[edges[i+1].reg] = edges[i+1].mask;
+        *regs[edges[i+2].reg] = edges[i+2].mask;
+        *regs[edges[i+3].reg] = edges[i+3].mask;
+    }
+    for(; i < n; i++) {
+        *regs[edges[i].reg] = edges[i].mask;
+    }
+}
+
+static uint32_t in_bits(GPIOSWD* swd, unsigned int n) {
+    // Clock low, read what the target put out after the last rising edge, clock high
+    uint32_t bits = 0;
+    unsigned int i;
+    if(swd->regs.sim) {
+        for(i = 0; i < n; i++) {
+            sim_gpio_write(swd->regs.sim, GPIO_GPCLR0, swd->clk_mask);
+            bits |= (uint32_t) !!(sim_gpio_read(swd->regs.sim, GPIO_GPLEV0) & swd->dio_mask) << i;
+            sim_gpio_write(swd->regs.sim, GPIO_GPSET0, swd->clk_mask);
+        }
+        return bits;
+    }
+    volatile uint32_t* set = swd->regs.set;
+    volatile uint32_t* clr = swd->regs.clr;
+    volatile uint32_t* lev = swd->regs.lev;
+    uint32_t clk = swd->clk_mask, dio = swd->dio_mask;
+    unsigned int delay = swd->delay;
+    for(i = 0; i < n; i++) {
+        *clr = clk;
+        spin(delay);
+        bits |= (uint32_t) !!(*lev & dio) << i;
+        *set = clk;
+        spin(delay);
+    }
+    return bits;
+}
+
+static int gpio_swd_io(void* ctx, const uint32_t* mosi, uint32_t* miso, const unsigned int* lengths, unsigned int n) {
+    GPIOSWD* swd = ctx;
+    GPIOEdge edges[MAX_EDGES];
+    unsigned int i;
+    for(i = 0; i < n; i++) {
+        unsigned int length = lengths[i];
+        unsigned int done = 0;
+        uint32_t in = 0;
+        if(length == 0 || length > 24) {
+            printf("gpio: invalid SPI word length %u\n", length);
+            return 1;
+        }
+        while(done < length) {
+            unsigned int run = frame_input_bits(swd);
+            if(run) {
+                // Reading doesn't say what comes after the ACK until it's been read, so one run at a time
+                run = run < length - done ? run : length - done;
+                set_dio_output(swd, 0);
+                uint32_t bits = in_bits(swd, run);
+                frame_in_bits(swd, bits, run);
+                in |= bits << done;
+            } else {
+                unsigned int n_edges;
+                uint32_t bits = mosi[i] >> done;
+                set_dio_output(swd, 1);
+                run = out_edges(swd, bits, length - done, edges, &n_edges);
+                run_edges(swd, edges, n_edges);
+                // Like the AUX SPI, a driven bit reads back as what was driven
+                in |= (bits & ((1u << run) - 1)) << done;
+            }
+            done += run;
+        }
+        swd->bits += length;
+        miso[i] = in;
+    }
+    return 0;
+}
+
+SPITransport gpio_swd_transport(GPIOSWD* swd) {
+    SPITransport transport = {
+        .name = "gpio",
+        .io = gpio_swd_io,
+        .ctx = swd
+    };
+    return transport;
+}
@@ -0,0 +1,53 @@
+#ifndef RASBERRY_PINE_GPIO_SWD_H
+#define RASBERRY_PINE_GPIO_SWD_H
+#include <inttypes.h>
+#include "rbpi.h"
+#include "sim_gpio.h"
+
+// SWD bit-banged on two GPIOs through the GPSET/GPCLR/GPLEV registers, no AUX SPI,
+// FIFO or resistor on SWDIO. It's a SPITransport, so everything above spi_io (perform_swd_io,
+// programs, ...) works unchanged. SWDIO is a real bidirectional pin here, so the transport
+// follows the SWD frames going past to know when to let go of it, see gpio_swd.c.
+// The pins are the Broadcom GPIO numbers, the defaults are what OpenOCD's Pi configs use.
+#define GPIO_SWD_DEFAULT_SWCLK 25
+#define GPIO_SWD_DEFAULT_SWDIO 24
+
+typedef struct GPIORegisters {
+    volatile uint32_t* fsel;    // GPFSEL0, the other five follow it
+    volatile uint32_t* set;     // GPSET0
+    volatile uint32_t* clr;     // GPCLR0
+    volatile uint32_t* lev;     // GPLEV0
+    SimGPIO* sim;               // When this is set all register accesses go to it instead
+} GPIORegisters;
+
+typedef struct GPIOSWD {
+    GPIORegisters regs;
+    uint32_t clk_mask;
+    uint32_t dio_mask;
+    unsigned int fsel_index;    // Which GPFSEL has SWDIO in it
+    uint32_t fsel_input;        // Its value with SWDIO as an input/output
+    uint32_t fsel_output;
+    int dio_output;             // Is the host driving SWDIO right now
+    int dio_level;              // What it's driving it to
+    unsigned int delay;         // Extra spins per half clock, 0 is as fast as the bus goes
+
+    // Where the SWD frame going past is at, a smaller copy of what the target does
+    int state;
+    unsigned int nbits;
+    uint8_t header;
+    uint8_t ack;
+    uint32_t wdata;
+    unsigned int ones;
+    int orundetect;             // Snooped from CTRL/STAT writes, changes what a WAIT/FAULT looks like
+    unsigned int dpbanksel;
+
+    uint64_t bits;
+    uint64_t turnarounds;
+} GPIOSWD;
+
+// The GPIO registers in the peripheral block create_gpio_mmap maps
+GPIORegisters gpio_registers(uint32_t* local_mem);
+GPIORegisters gpio_sim_registers(SimGPIO* sim);
+int gpio_swd_init(GPIOSWD* swd, GPIORegisters regs, unsigned int swclk, unsigned int swdio, unsigned int delay);
+SPITransport gpio_swd_transport(GPIOSWD* swd);
+#endif
@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image.h"
+
+static int add_segment(Image* image, uint32_t addr, const uint8_t* data, uint32_t size) {
+    if(size == 0) {
+        return 0;
+    }
+    if(image->n_segments == IMAGE_MAX_SEGMENTS) {
+        printf("Image has more than %i segments\n", IMAGE_MAX_SEGMENTS);
+        return 1;
+    }
+    ImageSegment* segment = &image->segments[image->n_segments++];
+    segment->addr = addr;
+    segment->size = size;
+    segment->data = data;
+    return 0;
+}
+
+static int parse_elf(Image* image) {
+    const uint8_t* file = image->map;
+    Elf32_Ehdr ehdr;
+    unsigned int i;
+    if(image->map_size < sizeof(ehdr)) {
+        printf("ELF file is truncated\n");
+        return 1;
+    }
+    memcpy(&ehdr, file, sizeof(ehdr));
+    if(ehdr.e_ident[EI_CLASS] != ELFCLASS32 || ehdr.e_ident[EI_DATA] != ELFDATA2LSB) {
+        printf("Only 32-bit little endian ELF files make sense for an nRF52\n");
+        return 1;
+    }
+    image->entry = ehdr.e_entry;
+    for(i = 0; i < ehdr.e_phnum; i++) {
+        Elf32_Phdr phdr;
+        size_t offset = ehdr.e_phoff + (size_t) i*ehdr.e_phentsize;
+        if(offset + sizeof(phdr) > image->map_size) {
+            printf("ELF program header %u is past the end of the file\n", i);
+            return 1;
+        }
+        memcpy(&phdr, file + offset, sizeof(phdr));
+        // Only what actually has bytes in the file goes in the flash, .bss etc. doesn't
+        if(phdr.p_type != PT_LOAD || phdr.p_filesz == 0) {
+            continue;
+        }
+        if((size_t) phdr.p_offset + phdr.p_filesz > image->map_size) {
+            printf("ELF segment %u is past the end of the file\n", i);
+            return 1;
+        }
+        // p_paddr is the load address, e.g. .data's initial values sit in flash but run from RAM
+        if(add_segment(image, phdr.p_paddr, file + phdr.p_offset, phdr.p_filesz)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int hex_byte(const char* text, size_t pos, size_t len, uint8_t* value) {
+    unsigned int i, v = 0;
+    if(pos + 2 > len) {
+        return 1;
+    }
+    for(i = 0; i < 2; i++) {
+        char c = text[pos + i];
+        v <<= 4;
+        if(c >= '0' && c <= '9') v |= c - '0';
+        else if(c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else if(c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else return 1;
+    }
+    *value = v;
+    return 0;
+}
+
+static int parse_hex(Image* image) {
+    /* Each record is ":LLAAAATT<data>CC". Data records that carry on where the previous
+     * one stopped get merged into the same segment. The decoded bytes all go into one
+     * buffer, which can't be bigger than half the text.
+     */
+    const char* text = image->map;
+    size_t len = image->map_size, pos = 0, used = 0;
+    uint32_t base = 0;
+    unsigned int line = 0;
+    ImageSegment* current = NULL;
+
+    image->decoded = malloc(len/2 + 1);
+    if(!image->decoded) {
+        printf("Could not allocate memory for HEX file\n");
+        return 1;
+    }
+    while(pos < len) {
+        uint8_t count, addr_hi, addr_lo, type, byte, sum;
+        unsigned int i;
+        if(text[pos] == '\r' || text[pos] == '\n' || text[pos] == ' ') {
+            line += text[pos] == '\n';
+            pos++;
+            continue;
+        }
+        if(text[pos] != ':' || hex_byte(text, pos+1, len, &count) || hex_byte(text, pos+3, len, &addr_hi) ||
+           hex_byte(text, pos+5, len, &addr_lo) || hex_byte(text, pos+7, len, &type)) {
+            printf("Bad Intel HEX record on line %u\n", line+1);
+            return 1;
+        }
+        sum = count + addr_hi + addr_lo + type;
+        uint8_t* data = image->decoded + used;
+        for(i = 0; i <= count; i++) {
+            if(hex_byte(text, pos + 9 + i*2, len, &byte)) {
+                printf("Bad Intel HEX record on line %u\n", line+1);
+                return 1;
+            }
+            if(i < count) {
+                data[i] = byte;
+            }
+            sum += byte;
+        }
+        if(sum != 0) {
+            printf("Intel HEX checksum error on line %u\n", line+1);
+            return 1;
+        }
+        pos += 9 + (count + 1)*2;
+
+        switch(type) {
+            case 0x00: { // Data
+                uint32_t addr = base + ((addr_hi << 8) | addr_lo);
+                if(current && current->addr + current->size == addr && current->data + current->size == data) {
+                    current->size += count;
+                } else if(count) {
+                    if(add_segment(image, addr, data, count)) {
+                        return 1;
+                    }
+                    current = &image->segments[image->n_segments - 1];
+                }
+                used += count;
+                break;
+            }
+            case 0x01: // End of file
+                return 0;
+            case 0x02: // Extended segment address
+                if(count != 2) {
+                    printf("Bad Intel HEX record on line %u\n", line+1);
+                    return 1;
+                }
+                base = ((data[0] << 8) | data[1]) << 4;
+                break;
+            case 0x04: // Extended linear address
+                if(count != 2) {
+                    printf("Bad Intel HEX record on line %u\n", line+1);
+                    return 1;
+                }
+                base = ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16);
+                break;
+            case 0x05: // Start linear address, only matters for running from RAM
+                if(count != 4) {
+                    printf("Bad Intel HEX record on line %u\n", line+1);
+                    return 1;
+                }
+                image->entry = ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | (data[2] << 8) | data[3];
+                break;
+            default: // Start segment address, doesn't matter for an nRF52
+                break;
+        }
+    }
+    printf("Intel HEX file has no end of file record\n");
+    return 1;
+}
+
+static int compare_segments(const void* a, const void* b) {
+    const ImageSegment* sa = a;
+    const ImageSegment* sb = b;
+    return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+static int has_extension(const char* path, const char* ext) {
+    size_t n = strlen(path), m = strlen(ext);
+    return n >= m && strcasecmp(path + n - m, ext) == 0;
+}
+
+int image_open(const char* path, Image* image) {
+    struct stat st;
+    unsigned int i;
+    int err;
+    memset(image, 0, sizeof(*image));
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        printf("Could not open file '%s'\n", path);
+        return 1;
+    }
+    if(fstat(fd, &st) || st.st_size == 0) {
+        printf("File '%s' is empty\n", path);
+        close(fd);
+        return 1;
+    }
+    image->map_size = st.st_size;
+    image->map = mmap(NULL, image->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image->map == MAP_FAILED) {
+        printf("Could not mmap file '%s'\n", path);
+        image->map = NULL;
+        return 1;
+    }
+
+    if(image->map_size >= SELFMAG && memcmp(image->map, ELFMAG, SELFMAG) == 0) {
+        err = parse_elf(image);
+    } else if(has_extension(path, ".hex") || has_extension(path, ".ihex")) {
+        err = parse_hex(image);
+    } else {
+        err = add_segment(image, 0x0, image->map, image->map_size);
+    }
+    if(err) {
+        image_close(image);
+        return err;
+    }
+
+    qsort(image->segments, image->n_segments, sizeof(image->segments[0]), compare_segments);
+    for(i = 1; i < image->n_segments; i++) {
+        const ImageSegment* prev = &image->segments[i-1];
+        if(prev->addr + prev->size > image->segments[i].addr) {
+            printf("Image segments at 0x%x and 0x%x overlap\n", prev->addr, image->segments[i].addr);
+            image_close(image);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void image_close(Image* image) {
+    if(image->map) {
+        munmap(image->map, image->map_size);
+    }
+    free(image->decoded);
+    memset(image, 0, sizeof(*image));
+}
+
+uint32_t image_end(const Image* image) {
+    if(image->n_segments == 0) {
+        return 0;
+    }
+    const ImageSegment* last = &image->segments[image->n_segments - 1];
+    return last->addr + last->size;
+}
+
+int image_covers(const Image* image, uint32_t addr, uint32_t size) {
+    unsigned int i;
+    for(i = 0; i < image->n_segments; i++) {
+        const ImageSegment* segment = &image->segments[i];
+        if(segment->addr < addr + size && addr < segment->addr + segment->size) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void image_fill(const Image* image, uint32_t addr, uint32_t* words, unsigned int n) {
+    // Segments don't have to start or end on a word, so this goes a byte at a time at the edges
+    uint8_t* out = (uint8_t*) words;
+    uint32_t end = addr + n*4;
+    unsigned int i;
+    memset(words, 0xFF, n*4);
+    for(i = 0; i < image->n_segments; i++) {
+        const ImageSegment* segment = &image->segments[i];
+        uint32_t from = segment->addr > addr ? segment->addr : addr;
+        uint32_t to = segment->addr + segment->size < end ? segment->addr + segment->size : end;
+        if(from < to) {
+            memcpy(out + (from - addr), segment->data + (from - segment->addr), to - from);
+        }
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef RASBERRY_PINE_IMAGE_H
+#define RASBERRY_PINE_IMAGE_H
+#include <inttypes.h>
+#include <stddef.h>
+
+// Firmware images as a sorted list of segments. The file gets mmap'd and for
+// .bin and ELF files the segments point straight into the mapping, nothing is copied.
+// Intel HEX has to be decoded so those segments point into one decoded buffer.
+//   *.hex / *.ihex  Intel HEX records (extended segment/linear addresses supported)
+//   ELF             PT_LOAD program headers, placed at their physical (load) address
+//   anything else   a flat binary starting at address 0x0
+
+typedef struct ImageSegment {
+    uint32_t addr;
+    uint32_t size;
+    const uint8_t* data;
+} ImageSegment;
+
+#define IMAGE_MAX_SEGMENTS 64
+
+typedef struct Image {
+    void* map;
+    size_t map_size;
+    uint8_t* decoded; // Only used for Intel HEX
+    ImageSegment segments[IMAGE_MAX_SEGMENTS];
+    unsigned int n_segments;
+    uint32_t entry;   // ELF e_entry or the HEX start address record, 0 if the file doesn't say
+} Image;
+
+int image_open(const char* path, Image* image);
+void image_close(Image* image);
+// One past the last byte any segment covers
+uint32_t image_end(const Image* image);
+// Does any segment cover part of [addr, addr+size)
+int image_covers(const Image* image, uint32_t addr, uint32_t size);
+// Copies the image words for [addr, addr + n*4) into 'words', 0xFFFFFFFF where there's nothing
+void image_fill(const Image* image, uint32_t addr, uint32_t* words, unsigned int n);
+#endif
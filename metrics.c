@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "rbpi.h"
+#include "swd.h"
+#include "metrics.h"
+
+Metrics metrics;
+int metrics_timing = 0;
+
+static const char* metrics_path = NULL;
+static uint64_t flush_interval_ns = 1000000000ull;
+static uint64_t next_flush_ns = 0;
+
+// Names (and labels) as they show up in the Prometheus file
+static const char* counter_names[N_METRIC_COUNTERS] = {
+    [METRIC_SPI_IO] = "rbpi_spi_io_total",
+    [METRIC_SPI_WORDS] = "rbpi_spi_words_total",
+    [METRIC_SPI_FIFO_FULL] = "rbpi_spi_fifo_full_total",
+    [METRIC_SWD_TRANSFERS] = "rbpi_swd_transfers_total",
+    [METRIC_SWD_ACK_OK] = "rbpi_swd_acks_total{ack=\"ok\"}",
+    [METRIC_SWD_ACK_WAIT] = "rbpi_swd_acks_total{ack=\"wait\"}",
+    [METRIC_SWD_ACK_FAULT] = "rbpi_swd_acks_total{ack=\"fault\"}",
+    [METRIC_SWD_ACK_UNKNOWN] = "rbpi_swd_acks_total{ack=\"unknown\"}",
+    [METRIC_SWD_PARITY_MISMATCH] = "rbpi_swd_parity_mismatches_total",
+    [METRIC_SWD_RESYNC] = "rbpi_swd_resyncs_total",
+    [METRIC_SWD_OVERRUN_CLEAR] = "rbpi_swd_overrun_clears_total",
+    [METRIC_SWD_FAULT_CLEARS] = "rbpi_swd_fault_clears_total",
+    [METRIC_SWD_RECONNECTS] = "rbpi_swd_reconnects_total",
+    [METRIC_SWD_BUDGET_EXHAUSTED] = "rbpi_swd_budget_exhausted_total",
+    [METRIC_SWD_ELIDED] = "rbpi_swd_elided_writes_total",
+    [METRIC_SWD_PROGRAMS] = "rbpi_swd_programs_total",
+    [METRIC_SWD_PROGRAM_REPLAYS] = "rbpi_swd_program_replays_total",
+    [METRIC_SWD_STREAM_BLOCKS] = "rbpi_swd_stream_blocks_total",
+    [METRIC_SWD_STREAM_REPLAYS] = "rbpi_swd_stream_replays_total",
+    [METRIC_SWD_PROGRAM_CACHE_HIT] = "rbpi_swd_program_cache_total{result=\"hit\"}",
+    [METRIC_SWD_PROGRAM_CACHE_MISS] = "rbpi_swd_program_cache_total{result=\"miss\"}",
+    [METRIC_SLEEPS] = "rbpi_sleeps_total",
+};
+
+static const char* histogram_names[N_METRIC_HISTOGRAMS] = {
+    [METRIC_HIST_SPI_IO] = "rbpi_spi_io_seconds",
+    [METRIC_HIST_SWD_TRANSFER] = "rbpi_swd_transfer_seconds",
+    [METRIC_HIST_SLEEP] = "rbpi_sleep_seconds",
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t metric_start() {
+    return metrics_timing ? now_ns() : 0;
+}
+
+void metric_observe(enum MetricHistogram histogram, uint64_t start) {
+    if(!start) {
+        return;
+    }
+    uint64_t now = now_ns();
+    uint64_t ns = now - start;
+    // Bucket is the number of bits in the duration
+    unsigned int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    MetricHistogramData* h = &metrics.histograms[histogram];
+    h->buckets[bucket < METRIC_HIST_BUCKETS ? bucket : METRIC_HIST_BUCKETS - 1]++;
+    h->count++;
+    h->sum_ns += ns;
+    if(now >= next_flush_ns) {
+        metrics_flush(0);
+    }
+}
+
+void metric_count_ack(uint8_t ack) {
+    switch(ack) {
+        case ACK_OK:
+            metric_inc(METRIC_SWD_ACK_OK);
+            break;
+        case ACK_WAIT:
+            metric_inc(METRIC_SWD_ACK_WAIT);
+            break;
+        case ACK_FAULT:
+            metric_inc(METRIC_SWD_ACK_FAULT);
+            break;
+        default:
+            metric_inc(METRIC_SWD_ACK_UNKNOWN);
+            break;
+    }
+}
+
+void metrics_sleep_us(unsigned int us) {
+    uint64_t start = metric_start();
+    metric_inc(METRIC_SLEEPS);
+    usleep(us);
+    metric_observe(METRIC_HIST_SLEEP, start);
+}
+
+void metrics_init() {
+    const char* path = getenv("RBPI_METRICS_FILE");
+    if(!path || !*path) {
+        return;
+    }
+    metrics_path = path;
+    metrics_timing = 1;
+    if(getenv("RBPI_METRICS_INTERVAL_MS")) {
+        flush_interval_ns = strtoull(getenv("RBPI_METRICS_INTERVAL_MS"), NULL, 0) * 1000000ull;
+    }
+    next_flush_ns = now_ns() + flush_interval_ns;
+}
+
+static void write_metrics(FILE* fp) {
+    unsigned int i, b;
+    for(i = 0; i < N_METRIC_COUNTERS; i++) {
+        // Labelled counters share a family (and are next to each other), one TYPE line for them
+        size_t len = strcspn(counter_names[i], "{");
+        int same_family = i > 0 && strcspn(counter_names[i-1], "{") == len &&
+                          strncmp(counter_names[i-1], counter_names[i], len) == 0;
+        if(!same_family) {
+            fprintf(fp, "# TYPE %.*s counter\n", (int) len, counter_names[i]);
+        }
+        fprintf(fp, "%s %" PRIu64 "\n", counter_names[i], metrics.counters[i]);
+    }
+
+    SPIWaitStats wait_stats = spi_get_wait_stats();
+    fprintf(fp, "# TYPE rbpi_spi_waits_total counter\n");
+    fprintf(fp, "rbpi_spi_waits_total{how=\"immediate\"} %" PRIu64 "\n", wait_stats.immediate);
+    fprintf(fp, "rbpi_spi_waits_total{how=\"spun\"} %" PRIu64 "\n", wait_stats.spun);
+    fprintf(fp, "rbpi_spi_waits_total{how=\"yielded\"} %" PRIu64 "\n", wait_stats.yielded);
+
+    for(i = 0; i < N_METRIC_HISTOGRAMS; i++) {
+        const MetricHistogramData* h = &metrics.histograms[i];
+        uint64_t cumulative = 0;
+        fprintf(fp, "# TYPE %s histogram\n", histogram_names[i]);
+        for(b = 0; b < METRIC_HIST_BUCKETS - 1; b++) {
+            cumulative += h->buckets[b];
+            // Nothing useful happens in under 256ns (or takes more than 17s), keep the file short
+            if(b >= 8 && b <= 34) {
+                fprintf(fp, "%s_bucket{le=\"%.9g\"} %" PRIu64 "\n", histogram_names[i], (double) (1ull << b) * 1e-9, cumulative);
+            }
+        }
+        fprintf(fp, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", histogram_names[i], h->count);
+        fprintf(fp, "%s_sum %.9f\n", histogram_names[i], h->sum_ns * 1e-9);
+        fprintf(fp, "%s_count %" PRIu64 "\n", histogram_names[i], h->count);
+    }
+}
+
+void metrics_flush(int force) {
+    /* The file is written next to where it's going and renamed into place,
+     * that way whatever's scraping it never sees half a file.
+     */
+    char tmp_path[1024];
+    if(!metrics_path) {
+        return;
+    }
+    next_flush_ns = now_ns() + flush_interval_ns;
+    if(strcmp(metrics_path, "-") == 0) {
+        if(force) {
+            write_metrics(stdout);
+        }
+        return;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", metrics_path, (int) getpid());
+    FILE* fp = fopen(tmp_path, "w");
+    if(!fp) {
+        return;
+    }
+    write_metrics(fp);
+    if(fclose(fp) == 0) {
+        rename(tmp_path, metrics_path);
+    } else {
+        unlink(tmp_path);
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef RASBERRY_PINE_METRICS_H
+#define RASBERRY_PINE_METRICS_H
+#include <inttypes.h>
+
+// Counters and latency histograms for the hot paths (SPI IO, SWD transfers, sleeping
+// while the target says WAIT). Counting is always on, it's just an increment.
+// Timing only happens when there's somewhere for it to go:
+//   RBPI_METRICS_FILE            Prometheus text file, rewritten (write + rename) every
+//                                RBPI_METRICS_INTERVAL_MS (default 1000) and at clean up,
+//                                meant for node_exporter's textfile collector. "-" just
+//                                prints it at clean up.
+
+enum MetricCounter {
+    METRIC_SPI_IO = 0,          // spi_io/spi_io_stream calls
+    METRIC_SPI_WORDS,           // SPI FIFO entries sent
+    METRIC_SPI_FIFO_FULL,       // spi_io refused, not enough room in the FIFOs
+    METRIC_SWD_TRANSFERS,
+    METRIC_SWD_ACK_OK,
+    METRIC_SWD_ACK_WAIT,
+    METRIC_SWD_ACK_FAULT,
+    METRIC_SWD_ACK_UNKNOWN,     // Anything else, usually the line is out of step
+    METRIC_SWD_PARITY_MISMATCH,
+    METRIC_SWD_RESYNC,          // Line reset + DPIDR to get back in step
+    METRIC_SWD_OVERRUN_CLEAR,   // ABORT.ORUNERRCLR after a WAIT with ORUNDETECT on
+    METRIC_SWD_FAULT_CLEARS,    // Sticky flags cleared after a FAULT, see perform_swd_io_retry
+    METRIC_SWD_RECONNECTS,      // Line reset through to debug power after a garbage ACK
+    METRIC_SWD_BUDGET_EXHAUSTED, // Transfers perform_swd_io_retry ran out of time on
+    METRIC_SWD_ELIDED,          // SELECT/CSW/TAR writes skipped, see dap_cache_hit in dap.c
+    METRIC_SWD_PROGRAMS,        // Compiled programs sent
+    METRIC_SWD_PROGRAM_REPLAYS, // Compiled programs that had to be finished one op at a time
+    METRIC_SWD_STREAM_BLOCKS,   // Blocks sent by mem_ap_write_stream without checking ACKs
+    METRIC_SWD_STREAM_REPLAYS,  // Of those, ones that overran and had to be finished one op at a time
+    METRIC_SWD_PROGRAM_CACHE_HIT,
+    METRIC_SWD_PROGRAM_CACHE_MISS,
+    METRIC_SLEEPS,
+    N_METRIC_COUNTERS
+};
+
+enum MetricHistogram {
+    METRIC_HIST_SPI_IO = 0,     // One spi_io/spi_io_stream call
+    METRIC_HIST_SWD_TRANSFER,   // One perform_swd_io, including any recovery
+    METRIC_HIST_SLEEP,          // Actual time spent in metrics_sleep_us
+    N_METRIC_HISTOGRAMS
+};
+
+// Bucket i counts values in [2^(i-1), 2^i) ns, the last one everything bigger
+#define METRIC_HIST_BUCKETS 40
+
+typedef struct MetricHistogramData {
+    uint64_t buckets[METRIC_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+} MetricHistogramData;
+
+typedef struct Metrics {
+    uint64_t counters[N_METRIC_COUNTERS];
+    MetricHistogramData histograms[N_METRIC_HISTOGRAMS];
+} Metrics;
+
+extern Metrics metrics;
+extern int metrics_timing; // Set when the histograms are going anywhere
+
+static inline void metric_inc(enum MetricCounter counter) {
+    metrics.counters[counter]++;
+}
+
+static inline void metric_add(enum MetricCounter counter, uint64_t n) {
+    metrics.counters[counter] += n;
+}
+
+// Returns 0 when timing is off, so the matching metric_observe can be skipped
+uint64_t metric_start();
+void metric_observe(enum MetricHistogram histogram, uint64_t start);
+void metric_count_ack(uint8_t ack);
+// usleep, but counted and timed
+void metrics_sleep_us(unsigned int us);
+
+void metrics_init();
+// Writes the metrics file if it's due (or right now with 'force')
+void metrics_flush(int force);
+#endif
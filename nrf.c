@@ -0,0 +1,765 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common_utils.h"
+#include "rbpi.h"
+#include "swd.h"
+#include "dap.h"
+#include "metrics.h"
+#include "flash_stub.h"
+#include "nrf.h"
+
+// Compiled once (or loaded from the cache) in nrf_load_programs
+static SWD_Program nvmc_erase_all_program;
+static SWD_Program nvmc_write_enable_program;
+static SWD_Program nvmc_read_only_program;
+
+int nrf_load_programs() {
+    SWD_Op erase_all[] = {
+        swd_op_transfer(0, 0, SWD_SELECT_ADDR, 0x0), // MEM-AP, bank 0
+        swd_op_transfer(1, 0, CSW_OFFSET, 0x23000002), // Same as write_csw(0)
+        swd_op_transfer(1, 0, TAR_OFFSET, NVMC_OFFSET + NVMC_CONFIG_OFFSET),
+        swd_op_transfer(1, 0, DRW_OFFSET, 2),        // Erase enable
+        swd_op_transfer(1, 0, TAR_OFFSET, NVMC_OFFSET + NVMC_ERASEALL),
+        swd_op_transfer(1, 0, DRW_OFFSET, 1)
+    };
+    SWD_Op write_enable[] = {
+        swd_op_transfer(1, 0, TAR_OFFSET, NVMC_OFFSET + NVMC_CONFIG_OFFSET),
+        swd_op_transfer(1, 0, DRW_OFFSET, 1)
+    };
+    SWD_Op read_only[] = {
+        swd_op_transfer(1, 0, TAR_OFFSET, NVMC_OFFSET + NVMC_CONFIG_OFFSET),
+        swd_op_transfer(1, 0, DRW_OFFSET, 0)
+    };
+    int err = swd_program_load_or_compile("nvmc_erase_all", erase_all, sizeof(erase_all)/sizeof(erase_all[0]), &nvmc_erase_all_program);
+    err |= swd_program_load_or_compile("nvmc_write_enable", write_enable, sizeof(write_enable)/sizeof(write_enable[0]), &nvmc_write_enable_program);
+    err |= swd_program_load_or_compile("nvmc_read_only", read_only, sizeof(read_only)/sizeof(read_only[0]), &nvmc_read_only_program);
+    return err;
+}
+
+int nvmc_config(SPIRegisters spi_registers, int write, int erase) {
+    assert(!(write && erase)); // Can't set both at the same time
+    int err = 0;
+
+    uint32_t value = write ? 1 : 0;
+    value = erase ? 2 : value;
+
+    // TODO really need to overhaul the error stuff here
+    err = mem_ap_write(spi_registers, NVMC_OFFSET + NVMC_CONFIG_OFFSET, value);
+    return err;
+}
+
+int nvmc_wait_ready(SPIRegisters spi_registers) {
+    // READY goes back to 1 once an erase/write has finished (an ERASEALL takes a while)
+    unsigned int tries;
+    uint32_t ready;
+    int err;
+    for(tries = 0; tries < 100000; tries++) {
+        if((err = mem_ap_read_block(spi_registers, NVMC_OFFSET + NVMC_READY_OFFSET, &ready, 1))) {
+            return err;
+        }
+        if(ready & 0x1) {
+            return 0;
+        }
+        metrics_sleep_us(100);
+    }
+    return 1;
+}
+
+int nvmc_erase_all(SPIRegisters spi_registers) {
+    int err;
+    if((err = run_swd_program(spi_registers, &nvmc_erase_all_program, NULL))) {
+        return err;
+    }
+    return nvmc_wait_ready(spi_registers);
+}
+
+int nvmc_erase_page(SPIRegisters spi_registers, uint32_t addr) {
+    int err;
+    if((err = nvmc_config(spi_registers, 0, 1))) {
+        return err;
+    }
+    if((err = mem_ap_write(spi_registers, NVMC_OFFSET + NVMC_ERASEPAGE, addr))) {
+        return err;
+    }
+    return nvmc_wait_ready(spi_registers);
+}
+
+uint32_t image_first_page(const Image* image) {
+    return image->n_segments ? image->segments[0].addr & ~(FLASH_PAGE_SIZE - 1) : 0;
+}
+
+int image_fits(const Image* image) {
+    if(image_end(image) > FLASH_SIZE) {
+        printf("Image goes up to 0x%x, past the end of FLASH\n", image_end(image));
+        return 0;
+    }
+    return 1;
+}
+
+static int halt_core(SPIRegisters spi_registers, uint32_t extra_bits) {
+    int err;
+    unsigned int tries;
+    uint32_t dhcsr;
+    if((err = mem_ap_write(spi_registers, DHCSR_ADDR, DHCSR_KEY | DHCSR_C_DEBUGEN | DHCSR_C_HALT | extra_bits))) {
+        return err;
+    }
+    for(tries = 0; tries < 1000; tries++) {
+        if((err = mem_ap_read_block(spi_registers, DHCSR_ADDR, &dhcsr, 1))) {
+            return err;
+        }
+        if(dhcsr & DHCSR_S_HALT) {
+            return 0;
+        }
+    }
+    printf("Core didn't halt, DHCSR = 0x%x\n", dhcsr);
+    return 1;
+}
+
+int core_halt(SPIRegisters spi_registers) {
+    return halt_core(spi_registers, 0);
+}
+
+int core_resume(SPIRegisters spi_registers) {
+    // Keeps C_DEBUGEN set so a BKPT halts the core rather than faulting
+    return mem_ap_write(spi_registers, DHCSR_ADDR, DHCSR_KEY | DHCSR_C_DEBUGEN);
+}
+
+int core_write_reg(SPIRegisters spi_registers, unsigned int reg, uint32_t value) {
+    // Core has to be halted. Value goes in DCRDR, then DCRSR says where it goes.
+    int err;
+    unsigned int tries;
+    uint32_t dhcsr;
+    if((err = mem_ap_write(spi_registers, DCRDR_ADDR, value)) ||
+       (err = mem_ap_write(spi_registers, DCRSR_ADDR, reg | DCRSR_REGWnR))) {
+        return err;
+    }
+    for(tries = 0; tries < 1000; tries++) {
+        if((err = mem_ap_read_block(spi_registers, DHCSR_ADDR, &dhcsr, 1))) {
+            return err;
+        }
+        if(dhcsr & DHCSR_S_REGRDY) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int core_set_entry(SPIRegisters spi_registers, uint32_t pc, uint32_t sp) {
+    int err;
+    if((err = core_write_reg(spi_registers, CORE_REG_SP, sp)) ||
+       (err = core_write_reg(spi_registers, CORE_REG_PC, pc))) {
+        return err;
+    }
+    return core_write_reg(spi_registers, CORE_REG_XPSR, XPSR_THUMB);
+}
+
+int core_run_from(SPIRegisters spi_registers, uint32_t pc, uint32_t sp) {
+    // Points the halted core at some code in RAM and lets it go
+    int err;
+    if((err = core_set_entry(spi_registers, pc, sp))) {
+        return err;
+    }
+    return core_resume(spi_registers);
+}
+
+int core_run_stub(SPIRegisters spi_registers, uint32_t pc, uint32_t sp) {
+    /* core_run_from for the stubs in flash_stub.c. They share the core with whatever
+     * firmware got halted, and have just written over its RAM (or erased its vector
+     * table), so an interrupt it left enabled would go off into garbage. C_MASKINTS
+     * keeps them out, and it can only be set while the core's halted.
+     * core_stop_stub undoes it.
+     */
+    int err;
+    if((err = core_set_entry(spi_registers, pc, sp)) ||
+       (err = mem_ap_write(spi_registers, DHCSR_ADDR, DHCSR_KEY | DHCSR_C_DEBUGEN | DHCSR_C_HALT | DHCSR_C_MASKINTS))) {
+        return err;
+    }
+    return mem_ap_write(spi_registers, DHCSR_ADDR, DHCSR_KEY | DHCSR_C_DEBUGEN | DHCSR_C_MASKINTS);
+}
+
+int core_stop_stub(SPIRegisters spi_registers) {
+    // Halts (leaving C_MASKINTS alone while it's running) then unmasks, ready for a reset
+    int err;
+    if((err = halt_core(spi_registers, DHCSR_C_MASKINTS))) {
+        return err;
+    }
+    return mem_ap_write(spi_registers, DHCSR_ADDR, DHCSR_KEY | DHCSR_C_DEBUGEN | DHCSR_C_HALT);
+}
+
+int nrf_run_in_ram(SPIRegisters spi_registers, const Image* image) {
+    /* For edit-compile-run without erasing and writing flash every time. The core gets
+     * halted, every segment streamed into RAM (mem_ap_write_block) and the core started.
+     * If the image starts with a vector table (an SP in RAM and a Thumb reset handler
+     * inside the image) that's where SP and PC come from and VTOR gets pointed at it so
+     * interrupts work. Otherwise it's the entry point with SP at the top of RAM.
+     * The entry point wins over the reset vector if the file has both.
+     */
+    uint32_t block[TAR_WRAP_SIZE/4];
+    uint32_t vectors[2];
+    uint32_t base = image->n_segments ? image->segments[0].addr : 0;
+    uint32_t addr, end, sp = RAM_BASE + RAM_SIZE, pc = image->entry;
+    int has_vectors;
+    unsigned int i, n;
+    int err;
+
+    for(i = 0; i < image->n_segments; i++) {
+        const ImageSegment* segment = &image->segments[i];
+        if(segment->addr < RAM_BASE || segment->addr + segment->size > RAM_BASE + RAM_SIZE) {
+            printf("Segment at 0x%x isn't in RAM, the image has to be linked to run from 0x%x-0x%x\n",
+                   segment->addr, RAM_BASE, RAM_BASE + RAM_SIZE);
+            return -1;
+        }
+    }
+    image_fill(image, base, vectors, 2);
+    has_vectors = !(base & 0x7F) && vectors[0] > RAM_BASE && vectors[0] <= RAM_BASE + RAM_SIZE &&
+                  !(vectors[0] & 0x3) && (vectors[1] & 1) && image_covers(image, vectors[1] & ~1u, 2);
+    if(has_vectors) {
+        sp = vectors[0];
+        pc = pc ? pc : vectors[1];
+    }
+    if(!pc) {
+        printf("Image has no entry point or vector table, don't know where to start it\n");
+        return -1;
+    }
+
+    if((err = core_halt(spi_registers))) {
+        return err;
+    }
+    for(i = 0; i < image->n_segments; i++) {
+        const ImageSegment* segment = &image->segments[i];
+        // Whole words, a block at a time so image_fill can pad the ends of the segment
+        end = (segment->addr + segment->size + 3) & ~0x3u;
+        for(addr = segment->addr & ~0x3u; addr < end; addr += n*4) {
+            n = (end - addr)/4 < TAR_WRAP_SIZE/4 ? (end - addr)/4 : TAR_WRAP_SIZE/4;
+            image_fill(image, addr, block, n);
+            if((err = mem_ap_write_block(spi_registers, addr, block, n))) {
+                printf("Error(%i) writing RAM at 0x%x\n", err, addr);
+                return err;
+            }
+        }
+    }
+    if(has_vectors && (err = mem_ap_write(spi_registers, SCB_VTOR_ADDR, base))) {
+        return err;
+    }
+    printf("Running from 0x%x, SP = 0x%x\n", pc & ~1u, sp);
+    return core_run_from(spi_registers, pc & ~1u, sp);
+}
+
+static int loader_wait_slot(SPIRegisters spi_registers, uint32_t slot) {
+    // Waits for the loader to be done with a mailbox slot
+    unsigned int tries;
+    uint32_t state, dhcsr;
+    int err;
+    for(tries = 0; tries < 100000; tries++) {
+        if((err = mem_ap_read_block(spi_registers, slot + FLASH_LOADER_SLOT_STATE, &state, 1))) {
+            return err;
+        }
+        if(state == FLASH_LOADER_EMPTY) {
+            return 0;
+        }
+    }
+    mem_ap_read_block(spi_registers, DHCSR_ADDR, &dhcsr, 1);
+    printf("Flash loader stopped responding, DHCSR = 0x%x\n", dhcsr);
+    return 1;
+}
+
+int flash_with_loader(SPIRegisters spi_registers, const Image* image) {
+    /* Programs the (already erased) flash through the RAM loader in flash_stub.c.
+     * The host only ever writes RAM, so there's no waiting on the NVMC over SWD. While
+     * the core is putting one buffer into flash the next one is being filled.
+     * Pages the image doesn't touch are skipped, and so are any 0xFFFFFFFF words at
+     * either end of a page. The loader runs with interrupts masked, since after an
+     * ERASEALL the firmware's vector table is all 0xFFFFFFFF.
+     */
+    uint32_t page[FLASH_LOADER_BUFFER_SIZE/4];
+    uint32_t mailbox[8] = {
+        0, 0, FLASH_LOADER_EMPTY, FLASH_LOADER_BUFFER0,
+        0, 0, FLASH_LOADER_EMPTY, FLASH_LOADER_BUFFER1
+    };
+    uint32_t page_addr;
+    unsigned int slot = 0;
+    int err;
+
+    if((err = core_halt(spi_registers)) ||
+       (err = mem_ap_write_block(spi_registers, FLASH_LOADER_BASE, flash_loader_code, flash_loader_code_words)) ||
+       (err = mem_ap_write_block(spi_registers, FLASH_LOADER_MAILBOX, mailbox, 8)) ||
+       (err = core_run_stub(spi_registers, FLASH_LOADER_BASE, FLASH_LOADER_STACK))) {
+        printf("Error(%i) starting flash loader\n", err);
+        return err;
+    }
+
+    for(page_addr = image_first_page(image); page_addr < image_end(image); page_addr += FLASH_PAGE_SIZE) {
+        uint32_t slot_addr = FLASH_LOADER_MAILBOX + slot*FLASH_LOADER_SLOT_SIZE;
+        uint32_t buffer = slot ? FLASH_LOADER_BUFFER1 : FLASH_LOADER_BUFFER0;
+        unsigned int first = 0, last = FLASH_PAGE_SIZE/4;
+        if(!image_covers(image, page_addr, FLASH_PAGE_SIZE)) {
+            continue;
+        }
+        image_fill(image, page_addr, page, FLASH_PAGE_SIZE/4);
+        while(first < last && page[first] == 0xFFFFFFFF) {
+            first++;
+        }
+        while(last > first && page[last-1] == 0xFFFFFFFF) {
+            last--;
+        }
+        if(first == last) {
+            continue;
+        }
+
+        uint32_t command[3] = { page_addr + first*4, last - first, FLASH_LOADER_FULL };
+        if((err = loader_wait_slot(spi_registers, slot_addr))) {
+            return err;
+        }
+        printf("Writing 0x%x - 0x%x\n", page_addr + first*4, page_addr + last*4 - 4);
+        if((err = mem_ap_write_block(spi_registers, buffer, &page[first], last - first)) ||
+           (err = mem_ap_write_block(spi_registers, slot_addr, command, 3))) {
+            printf("Error(%i) encountered while sending block for addr=0x%x\n", err, page_addr);
+            return err;
+        }
+        slot ^= 1;
+    }
+    if((err = loader_wait_slot(spi_registers, FLASH_LOADER_MAILBOX)) ||
+       (err = loader_wait_slot(spi_registers, FLASH_LOADER_MAILBOX + FLASH_LOADER_SLOT_SIZE))) {
+        return err;
+    }
+    return core_stop_stub(spi_registers);
+}
+
+int crc_stub_start(SPIRegisters spi_registers, uint32_t start, unsigned int npages) {
+    // Gets the CRC32 stub going on the target, crc_stub_finish collects the results
+    uint32_t params[4] = { start, FLASH_PAGE_SIZE/4, npages, FLASH_CRC_RESULTS };
+    int err;
+    if(npages > FLASH_CRC_MAX_PAGES) {
+        return 1;
+    }
+    if((err = core_halt(spi_registers)) ||
+       (err = mem_ap_write_block(spi_registers, FLASH_CRC_BASE, flash_crc_code, flash_crc_code_words)) ||
+       (err = mem_ap_write_block(spi_registers, FLASH_CRC_PARAMS, params, 4))) {
+        return err;
+    }
+    return core_run_stub(spi_registers, FLASH_CRC_BASE, FLASH_LOADER_STACK);
+}
+
+int crc_stub_finish(SPIRegisters spi_registers, unsigned int npages, uint32_t* crcs) {
+    // The stub halts on a BKPT when it's done. It does about 200 instructions per word,
+    // so for the whole flash that's a good fraction of a second.
+    unsigned int tries;
+    uint32_t dhcsr = 0;
+    int err;
+    for(tries = 0; tries < 100000; tries++) {
+        if((err = mem_ap_read_block(spi_registers, DHCSR_ADDR, &dhcsr, 1))) {
+            return err;
+        }
+        if(dhcsr & DHCSR_S_HALT) {
+            if((err = mem_ap_read_block(spi_registers, FLASH_CRC_RESULTS, crcs, npages))) {
+                return err;
+            }
+            return core_stop_stub(spi_registers);
+        }
+        metrics_sleep_us(100);
+    }
+    printf("CRC stub didn't finish, DHCSR = 0x%x\n", dhcsr);
+    core_stop_stub(spi_registers);
+    return 1;
+}
+
+int verify_with_crc(SPIRegisters spi_registers, const Image* image) {
+    /* Checks the flash against the image by having the target CRC every page while the
+     * host does the same, then only reads back the pages that came out different so the
+     * mismatches can be reported. Gaps in the image are expected to be 0xFF, which is
+     * what's left in the flash after an erase. Pages the image doesn't touch at all
+     * get a CRC too (the stub just does a range) but aren't looked at.
+     */
+    uint32_t page[FLASH_PAGE_SIZE/4];
+    uint32_t readback[FLASH_PAGE_SIZE/4];
+    uint32_t target_crcs[FLASH_CRC_MAX_PAGES];
+    uint32_t host_crcs[FLASH_CRC_MAX_PAGES];
+    uint32_t first_page = image_first_page(image);
+    unsigned int npages = (image_end(image) - first_page + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+    unsigned int p, i;
+    int err, err_count = 0;
+
+    if((err = crc_stub_start(spi_registers, first_page, npages))) {
+        printf("Error(%i) starting CRC stub\n", err);
+        return err;
+    }
+    for(p = 0; p < npages; p++) {
+        image_fill(image, first_page + p*FLASH_PAGE_SIZE, page, FLASH_PAGE_SIZE/4);
+        host_crcs[p] = crc32_words(page, FLASH_PAGE_SIZE/4);
+    }
+    if((err = crc_stub_finish(spi_registers, npages, target_crcs))) {
+        printf("Error(%i) getting checksums from CRC stub\n", err);
+        return err;
+    }
+
+    for(p = 0; p < npages && err_count <= 100; p++) {
+        uint32_t page_addr = first_page + p*FLASH_PAGE_SIZE;
+        if(host_crcs[p] == target_crcs[p] || !image_covers(image, page_addr, FLASH_PAGE_SIZE)) {
+            continue;
+        }
+        printf("CRC mismatch for page 0x%x: target = 0x%x, expected = 0x%x\n", page_addr, target_crcs[p], host_crcs[p]);
+        image_fill(image, page_addr, page, FLASH_PAGE_SIZE/4);
+        if((err = mem_ap_read_block(spi_registers, page_addr, readback, FLASH_PAGE_SIZE/4))) {
+            printf("Error encountered reading back block at addr=0x%x\n", page_addr);
+            return err;
+        }
+        for(i = 0; i < FLASH_PAGE_SIZE/4; i++) {
+            if(readback[i] != page[i]) {
+                printf("Flash data mismatch at address 0x%x: Readback = 0x%x, Expected = 0x%x\n",
+                       page_addr + i*4, readback[i], page[i]);
+                if(++err_count > 100) {
+                    printf("Too many errors found quitting readback check\n");
+                    break;
+                }
+            }
+        }
+    }
+    return err_count ? 1 : 0;
+}
+
+int verify_readback(SPIRegisters spi_registers, const Image* image) {
+    // Reads back what each segment covers (and nothing in between) and compares it
+    uint32_t block[TAR_WRAP_SIZE/4];
+    uint32_t readback[TAR_WRAP_SIZE/4];
+    unsigned int s_i;
+    int err_count = 0;
+
+    for(s_i = 0; s_i < image->n_segments && err_count <= 100; s_i++) {
+        const ImageSegment* segment = &image->segments[s_i];
+        uint32_t addr = segment->addr & ~0x3u;
+        uint32_t end = segment->addr + segment->size;
+        while(addr < end && err_count <= 100) {
+            // Up to the next 1KB boundary or the end of the segment
+            uint32_t chunk_end = (addr | (TAR_WRAP_SIZE - 1)) + 1;
+            unsigned int nwords, i;
+            if(chunk_end > end) {
+                chunk_end = end;
+            }
+            nwords = (chunk_end - addr + 3) / 4;
+            image_fill(image, addr, block, nwords);
+            if(mem_ap_read_block(spi_registers, addr, readback, nwords)) {
+                printf("Error encountered reading back block at addr=0x%x\n", addr);
+                return 1;
+            }
+            for(i = 0; i < nwords; i++) {
+                if(block[i] != readback[i]) {
+                    printf("Flash data mismatch at address 0x%x: Readback = 0x%x, Expected = 0x%x\n",
+                           addr + i*4, readback[i], block[i]);
+                    if(++err_count > 100) {
+                        printf("Too many errors found quitting readback check\n");
+                        break;
+                    }
+                }
+            }
+            addr += nwords*4;
+        }
+    }
+    return err_count ? 1 : 0;
+}
+
+int flash_diff(SPIRegisters spi_registers, const Image* image, int use_crc) {
+    /* Only touches the flash pages that are different from the image.
+     * Each 4KB page gets read back (pipelined, so about one SWD read per word) and compared
+     * with the image, which is a lot quicker than erasing and writing it. Pages that differ
+     * get an ERASEPAGE (unless they're already blank), get written and then get checked.
+     * Pages the image doesn't touch are left alone, and the parts of a page the image
+     * doesn't cover are expected to be erased.
+     * With 'use_crc' the pages are fingerprinted by the CRC stub on the target instead
+     * of being read back, a blank page is just one with the CRC of a blank page.
+     */
+    uint32_t page[FLASH_PAGE_SIZE/4];
+    uint32_t current[FLASH_PAGE_SIZE/4];
+    uint32_t target_crcs[FLASH_CRC_MAX_PAGES];
+    uint32_t blank_crc = 0;
+    uint32_t first_page = image_first_page(image);
+    uint32_t page_addr;
+    unsigned int n_pages = 0, n_written = 0;
+    int err, ren_err;
+
+    if(use_crc) {
+        // Fingerprint every page the image covers on the target in one go
+        unsigned int image_pages = (image_end(image) - first_page + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+        if((err = crc_stub_start(spi_registers, first_page, image_pages)) ||
+           (err = crc_stub_finish(spi_registers, image_pages, target_crcs))) {
+            printf("Error(%i) getting page checksums from the target\n", err);
+            return err;
+        }
+        memset(page, 0xFF, sizeof(page));
+        blank_crc = crc32_words(page, FLASH_PAGE_SIZE/4);
+    }
+
+    for(page_addr = first_page; page_addr < image_end(image); page_addr += FLASH_PAGE_SIZE) {
+        unsigned int i;
+        int blank = 1;
+        if(!image_covers(image, page_addr, FLASH_PAGE_SIZE)) {
+            continue;
+        }
+        image_fill(image, page_addr, page, FLASH_PAGE_SIZE/4);
+        n_pages++;
+
+        if(use_crc) {
+            uint32_t target_crc = target_crcs[(page_addr - first_page) / FLASH_PAGE_SIZE];
+            if(crc32_words(page, FLASH_PAGE_SIZE/4) == target_crc) {
+                continue;
+            }
+            blank = target_crc == blank_crc;
+        } else {
+            if((err = mem_ap_read_block(spi_registers, page_addr, current, FLASH_PAGE_SIZE/4))) {
+                printf("Error(%i) encountered while reading page at addr=0x%x\n", err, page_addr);
+                return err;
+            }
+            if(memcmp(page, current, sizeof(page)) == 0) {
+                continue;
+            }
+            for(i = 0; i < FLASH_PAGE_SIZE/4 && blank; i++) {
+                blank = current[i] == 0xFFFFFFFF;
+            }
+        }
+
+        printf("Page 0x%x changed, %s\n", page_addr, blank ? "writing" : "erasing and writing");
+        if(!blank && (err = nvmc_erase_page(spi_registers, page_addr))) {
+            printf("Error(%i) encountered while erasing page at addr=0x%x\n", err, page_addr);
+            return err;
+        }
+        if((err = run_swd_program(spi_registers, &nvmc_write_enable_program, NULL))) {
+            printf("Error(%i) encountered while enabling NVMC writes\n", err);
+            return err;
+        }
+        err = mem_ap_write_block_sparse(spi_registers, page_addr, page, FLASH_PAGE_SIZE/4);
+        ren_err = run_swd_program(spi_registers, &nvmc_read_only_program, NULL);
+        if(err) {
+            printf("Error(%i) encountered while writing page at addr=0x%x\n", err, page_addr);
+            return err;
+        }
+        if(ren_err) {
+            printf("Error(%i) encountered while setting the NVMC back to read only\n", ren_err);
+            return ren_err;
+        }
+
+        if((err = mem_ap_read_block(spi_registers, page_addr, current, FLASH_PAGE_SIZE/4))) {
+            printf("Error(%i) encountered reading back page at addr=0x%x\n", err, page_addr);
+            return err;
+        }
+        for(i = 0; i < FLASH_PAGE_SIZE/4; i++) {
+            if(page[i] != current[i]) {
+                printf("Flash data mismatch at address 0x%x: Readback = 0x%x, Expected = 0x%x\n",
+                       page_addr + i*4, current[i], page[i]);
+                err = 1;
+            }
+        }
+        if(err) {
+            return err;
+        }
+        n_written++;
+    }
+    printf("%u of %u pages changed\n", n_written, n_pages);
+    return 0;
+}
+
+int reset_nrf(SPIRegisters spi_registers) {
+    SWD_SELECT_Reg select_reg = { .APSEL = 0x1, .APBANKSEL = 0x0, .DPBANKSEL = 0x0 };
+    SWD_Packet write_select_packet = swd_write_select_reg(select_reg);
+    perform_swd_io(spi_registers, &write_select_packet);
+
+    SWD_Packet write_reset = swd_write_ap_addr(0x0, 0x1);
+    perform_swd_io_retry(spi_registers, &write_reset);
+    write_reset = swd_write_ap_addr(0x0, 0x0);
+    return  perform_swd_io_retry(spi_registers, &write_reset);
+}
+
+
+// The DPIDR the last connect saw, kept in the cache dir as text. 0 (never a valid DPIDR) if there isn't one
+static uint32_t load_expected_dpidr() {
+    char path[512];
+    unsigned int idcode = 0;
+    FILE* file;
+    if(swd_cache_path("dpidr", path, sizeof(path)) || !(file = fopen(path, "r"))) {
+        return 0;
+    }
+    if(fscanf(file, "%x", &idcode) != 1) {
+        idcode = 0;
+    }
+    fclose(file);
+    return idcode;
+}
+
+static void save_expected_dpidr(uint32_t idcode) {
+    char path[512];
+    FILE* file;
+    if(swd_cache_path("dpidr", path, sizeof(path)) || !(file = fopen(path, "w"))) {
+        return;
+    }
+    fprintf(file, "0x%x\n", idcode);
+    fclose(file);
+}
+
+int nrf_connect(SPIRegisters spi_registers, uint32_t* dpidr) {
+    // Once here we're ready to start doing SPI stuff with the PineTime
+    // Here's the basic steps needed to get code into the NRF's flash memory
+    // SWD_RESET, JTAG_TO_SWD, SWD_RESET
+    // Read the DP-ID b/c you have to do that I guess
+    // Power up the debug bits inthe CTRL/STAT and wait for the ACKs (swd_connect does these)
+    // Read the CTRL-AP to make sure no protection is turned on
+    // Maybe perform a reset in the CTRL-AP (idk yet)
+    // (Any other checks in the CTRL AP?)
+    // Go the MEM-AP (APSEL=0)
+    // Read the CSW make sure the size field is 0b010 (32-bit transfers)
+    // (nrf_flash_image does the rest)
+    int err;
+    uint32_t idcode;
+
+    printf("performing reset\n");
+    if(swd_connect(spi_registers, &idcode)) {
+        printf("SWD protocol error encountered, quitting\n");
+        return -1;
+    }
+
+    // Same watch (or the same kind) as last time, no need to go through what it is again
+    printf("IDCode = 0x%x\n", idcode);
+    if(idcode != load_expected_dpidr()) {
+        struct SWD_DPIDR_Reg idr_reg = interpret_dp_idr_reg(idcode);
+        printf("revision = 0x%x\n", idr_reg.revision);
+        printf("part_number = 0x%x\n", idr_reg.part_number);
+        printf("min = 0x%x\n", idr_reg.min);
+        printf("version = 0x%x\n", idr_reg.version);
+        printf("designer = 0x%x\n", idr_reg.designer);
+        printf("\n");
+        save_expected_dpidr(idcode);
+    }
+    if(dpidr) {
+        *dpidr = idcode;
+    }
+
+    // Speculative bursts and compiled programs rely on the target expecting a data phase
+    // even when it says WAIT/FAULT, otherwise a non-OK ACK in the middle of a burst has the
+    // target decoding the rest of it as headers until the line gets reset.
+    if(set_overrun_detect(spi_registers, 1)) {
+        printf("Could not enable overrun detection\n");
+        return -1;
+    }
+
+    // AP_SEL=1 is the CTRL_AP
+    // AP_SEL=0 is the AHB MEM_AP
+    // Right now want to read the CTRL_AP PROT_STATUS (Addr=0xC)
+    SWD_SELECT_Reg select_reg = { .APSEL = 0x1, .APBANKSEL = 0x0, .DPBANKSEL = 0x0 };
+    SWD_Packet write_select_packet = swd_write_select_reg(select_reg);
+    perform_swd_io(spi_registers, &write_select_packet);
+
+    // Now read protect status (reminder, need to do two reads b/c idk thats the way it works)
+    SWD_Packet read_protect_status_reg = swd_read_protect_status_reg();
+    int protect_tries = 0;
+    perform_swd_io_retry(spi_registers, &read_protect_status_reg);
+    while(perform_swd_io_retry(spi_registers, &read_protect_status_reg) == SWD_PARITY_MISMATCH && protect_tries++ < 8);
+    if(read_protect_status_reg.data != 0x1) {
+        printf("NRF data protection is ON. Must do an ERASE ALL to fix this. Aborting\n");
+        return -1;
+        // TODO do the below instead of quitting?
+        // Perform an "eraseall" to remove firmware lock
+        //SWD_Packet write_eraseall_reg = swd_ap_write_eraseall();
+        //perform_swd_io(spi_registers, &write_eraseall_reg);
+    }
+
+    // TODO could maybe check the erase status here...make sure an erase isn't going on
+    // that'd be good eventually maybe
+
+    if(reset_nrf(spi_registers)) {
+        printf("Error doing reset\n");
+        return -1;
+    }
+
+    // Now done with the CTRL-AP, lets move to the MEM-AP/AHB-AP
+    if((err = nrf_select_mem_ap(spi_registers))) {
+        printf("Error writing to MEM AP CSW reg\n");
+        return -1;
+    }
+    return 0;
+}
+
+int nrf_select_mem_ap(SPIRegisters spi_registers) {
+    // MEM-AP selected and CSW set for 32-bit transfers, no auto-increment
+    int err;
+    SWD_SELECT_Reg select_reg = { .APSEL = 0x0, .APBANKSEL = 0x0, .DPBANKSEL = 0x0 };
+    SWD_Packet write_select_packet = swd_write_select_reg(select_reg);
+    if((err = perform_swd_io_retry(spi_registers, &write_select_packet))) {
+        return err;
+    }
+    return write_csw(spi_registers, 0);
+}
+
+int nrf_flash_image(SPIRegisters spi_registers, const Image* image, int flags) {
+    /* Everything after nrf_connect: erase, write, verify and reset the nRF.
+     * Prints a "Writing ..." line per page, flash --targets counts those for its progress.
+     */
+    int use_crc = flags & NRF_FLASH_CRC;
+    int err;
+    if(flags & NRF_FLASH_DIFF) {
+        if(flash_diff(spi_registers, image, use_crc)) {
+            return -1;
+        }
+        goto reset;
+    }
+
+    // Next erase all the NVMC memory
+    if(nvmc_erase_all(spi_registers)) {
+        printf("Error encountered while doing NVMC ERASE ALL\n");
+        return -1;
+    }
+    printf("Beginning WRITE!\n");
+    if(flags & NRF_FLASH_LOADER) {
+        if(flash_with_loader(spi_registers, image)) {
+            return -1;
+        }
+        goto verify;
+    }
+
+    // Set NVMC CONFIG to write_enable
+    if((err = run_swd_program(spi_registers, &nvmc_write_enable_program, NULL))) {
+        printf("Error(%i) encountered while enabling NVMC writes\n", err);
+        return -1;
+    }
+
+    // Now start writing data, a page at a time. Pages the image doesn't touch
+    // and words that would just be 0xFFFFFFFF don't get sent at all.
+    uint32_t page[FLASH_PAGE_SIZE/4];
+    uint32_t page_addr;
+    for(page_addr = image_first_page(image); page_addr < image_end(image); page_addr += FLASH_PAGE_SIZE) {
+        if(!image_covers(image, page_addr, FLASH_PAGE_SIZE)) {
+            continue;
+        }
+        image_fill(image, page_addr, page, FLASH_PAGE_SIZE/4);
+
+        // TODO. should perhaps check the transfer in progress bit in the CSW register
+        // (I think thats where it is) to make sure things don't go too fast
+        printf("Writing 0x%x - 0x%x\n", page_addr, page_addr + FLASH_PAGE_SIZE - 4);
+        int write_err = mem_ap_write_block_sparse(spi_registers, page_addr, page, FLASH_PAGE_SIZE/4);
+        if(write_err) {
+            printf("Error(%i) encountered while writing block at addr=0x%x\n", write_err, page_addr);
+            // Don't leave the NVMC write enabled
+            run_swd_program(spi_registers, &nvmc_read_only_program, NULL);
+            return -1;
+        }
+    }
+
+verify:
+    printf("Writing done, doing check now\n");
+    // Now that writing has finished, set the NVMC back to read only
+    // then go through all the data and confirm that it's right
+    if((err = run_swd_program(spi_registers, &nvmc_read_only_program, NULL))) {
+        printf("Error(%i) encountered while setting the NVMC back to read only\n", err);
+        return -1;
+    }
+    if(use_crc ? verify_with_crc(spi_registers, image) : verify_readback(spi_registers, image)) {
+        return -1;
+    }
+
+    // And finally do a system reset I guess
+reset:
+    if(reset_nrf(spi_registers)) {
+        printf("Error doing reset\n");
+        return -1;
+    }
+    return 0;
+}
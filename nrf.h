@@ -0,0 +1,54 @@
+#ifndef RASBERRY_PINE_NRF_H
+#define RASBERRY_PINE_NRF_H
+#include <inttypes.h>
+#include "rbpi.h"
+#include "swd.h"
+#include "image.h"
+
+// The nRF52 itself on top of dap.c: connecting, the NVMC, halting/running the core,
+// the RAM stubs in flash_stub.c and the whole erase/write/verify flow.
+// Shared by flash and swdd.
+
+#define FLASH_SIZE 0x80000
+#define FLASH_PAGE_SIZE 0x1000
+#define RAM_BASE 0x20000000
+#define RAM_SIZE 0x10000
+#define FICR_DEVICEID 0x10000060 // Two words, different on every chip
+
+// nrf_flash_image flags, same as flash's --diff, --loader and --crc
+#define NRF_FLASH_DIFF   0x1
+#define NRF_FLASH_LOADER 0x2
+#define NRF_FLASH_CRC    0x4
+
+// Has to be called once before anything that runs the NVMC programs
+int nrf_load_programs();
+// Line reset through to the MEM-AP being selected, dpidr can be NULL
+int nrf_connect(SPIRegisters spi_registers, uint32_t* dpidr);
+int nrf_select_mem_ap(SPIRegisters spi_registers);
+int nrf_flash_image(SPIRegisters spi_registers, const Image* image, int flags);
+// Halts the core, writes an image linked for RAM into RAM and starts it, flash isn't touched
+int nrf_run_in_ram(SPIRegisters spi_registers, const Image* image);
+
+uint32_t image_first_page(const Image* image);
+// Prints why if it doesn't
+int image_fits(const Image* image);
+
+int nvmc_config(SPIRegisters spi_registers, int write, int erase);
+int nvmc_wait_ready(SPIRegisters spi_registers);
+int nvmc_erase_all(SPIRegisters spi_registers);
+int nvmc_erase_page(SPIRegisters spi_registers, uint32_t addr);
+int core_halt(SPIRegisters spi_registers);
+int core_resume(SPIRegisters spi_registers);
+int core_write_reg(SPIRegisters spi_registers, unsigned int reg, uint32_t value);
+int core_run_from(SPIRegisters spi_registers, uint32_t pc, uint32_t sp);
+int core_run_stub(SPIRegisters spi_registers, uint32_t pc, uint32_t sp);
+int core_stop_stub(SPIRegisters spi_registers);
+int flash_with_loader(SPIRegisters spi_registers, const Image* image);
+int crc_stub_start(SPIRegisters spi_registers, uint32_t start, unsigned int npages);
+int crc_stub_finish(SPIRegisters spi_registers, unsigned int npages, uint32_t* crcs);
+int verify_with_crc(SPIRegisters spi_registers, const Image* image);
+int verify_readback(SPIRegisters spi_registers, const Image* image);
+int flash_diff(SPIRegisters spi_registers, const Image* image, int use_crc);
+// System reset through the CTRL-AP, leaves the CTRL-AP selected
+int reset_nrf(SPIRegisters spi_registers);
+#endif
@@ -1,11 +1,15 @@
 #include <unistd.h>
 #include <inttypes.h>
+#include <sched.h>
+#include <time.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/mman.h>
 #include <assert.h>
+#include <string.h>
 
 #include "rbpi.h"
+#include "metrics.h"
 
 
 /*
@@ -17,6 +21,12 @@ static uint32_t* _mem = NULL;
 static int mem_fd;
 static uint32_t peri_size;
 
+static SPIWaitConfig wait_config = {
+    .core_clock_hz = AUX_SPI_DEFAULT_CORE_CLOCK_HZ,
+    .spin_budget_ns = 50000
+};
+static SPIWaitStats wait_stats;
+
 void write_control_reg(SPIRegisters spi_registers, ControlReg values) {
     // All bit positions here come from the BCM2835 datasheet page 22-25 and the errata
     // https://elinux.org/BCM2835_datasheet_errata
@@ -85,7 +95,7 @@ StatReg interpret_stat_word(uint32_t word) {
     return ret;
 }
 
-static SPIRegisters create_aux_spi_registers(uint32_t* local_mem) {
+static SPIRegisters create_aux_spi_registers(uint32_t* local_mem, unsigned int spi) {
     /*
      Page 8 of the BCM2835 peripherals data sheet  (also pages 6, sec 1.2.3)
      https://www.raspberrypi.org/app/uploads/2012/02/BCM2835-ARM-Peripherals.pdf
@@ -98,6 +108,8 @@ static SPIRegisters create_aux_spi_registers(uint32_t* local_mem) {
 
      Further note, the table on page 8 is riddle with errors...see errata here
      https://elinux.org/BCM2835_datasheet_errata
+
+     SPI2's registers are the same as SPI1's, just 0x40 further along.
     */
     SPIRegisters spi_registers;
 
@@ -109,27 +121,30 @@ static SPIRegisters create_aux_spi_registers(uint32_t* local_mem) {
     const uint32_t aux_spi1_stat_offset = 0x88;
     const uint32_t aux_spi1_io_offset = 0xA0; // Note this address is WRONG(!) on page 8 of datasheet
     const uint32_t aux_spi1_peek_offset = 0x94;
+    const uint32_t spi_offset = spi == AUX_SPI2 ? 0x40 : 0x0;
 
     // The div by 4 is b/c "mem" is uint32*, aka 4 bytes
     // I could just be using uint8_t but this is how the BCM2835 lib does it
     // so I'll just keep things like them for now.
     spi_registers.base = local_mem + bcm_aux_offset/4;;
     spi_registers.enable = spi_registers.base + aux_enable_offset/4;
-    spi_registers.control1 = spi_registers.base + aux_spi1_cntrl0_offset/4;;
-    spi_registers.control2 = spi_registers.base + aux_spi1_cntrl1_offset/4;;
-    spi_registers.stat = spi_registers.base + aux_spi1_stat_offset/4;;
-    spi_registers.peek = spi_registers.base + aux_spi1_peek_offset/4;;
-    spi_registers.io = spi_registers.base + aux_spi1_io_offset/4;;
+    spi_registers.control1 = spi_registers.base + (aux_spi1_cntrl0_offset + spi_offset)/4;
+    spi_registers.control2 = spi_registers.base + (aux_spi1_cntrl1_offset + spi_offset)/4;
+    spi_registers.stat = spi_registers.base + (aux_spi1_stat_offset + spi_offset)/4;
+    spi_registers.peek = spi_registers.base + (aux_spi1_peek_offset + spi_offset)/4;
+    spi_registers.io = spi_registers.base + (aux_spi1_io_offset + spi_offset)/4;
+    spi_registers.transport = NULL;
 
     return spi_registers;
 
 }
 
-SPIRegisters init_aux_spi(uint32_t* local_mem) {
+SPIRegisters init_aux_spi(uint32_t* local_mem, unsigned int spi) {
     /*
       First thing is to set GPIOs for the SPI1 AUX interface to their ALT4 function
       (see table 6.2 of BCM2835 datasheet).
-      The relevant GPIO outputs are 16-21 (inclusive)
+      The relevant GPIO outputs are 16-21 (inclusive), for SPI2 they're 40-45
+      (GPIO_FSEL4{17:0}, also ALT4, only brought out on the compute modules)
       Pin 16 = GPIO_FSEL1{20:18}
       Pin 17 = GPIO_FSEL1{23:21}
       Pin 18 = GPIO_FSEL1{26:24}
@@ -157,10 +172,23 @@ SPIRegisters init_aux_spi(uint32_t* local_mem) {
     const uint32_t gpio_fsel_bank_offset = 0x200000;
     const uint32_t gpio_fsel1_offset = 0x4;
     const uint32_t gpio_fsel2_offset = 0x8;
+    const uint32_t gpio_fsel4_offset = 0x10;
 
     uint32_t current_val = 0;
     uint32_t *fsel_base = local_mem + gpio_fsel_bank_offset/4;
     uint32_t *p;
+    unsigned int pin;
+    if(spi == AUX_SPI2) {
+        p = fsel_base + gpio_fsel4_offset/4;
+        current_val = *p;
+        for(pin = 40; pin <= 45; pin++) {
+            current_val &= ~(0b111 << (pin - 40)*3);
+            current_val |= 0b011 << (pin - 40)*3;
+        }
+        *p = current_val;
+        return create_aux_spi_registers(local_mem, spi);
+    }
+
     p = fsel_base + gpio_fsel1_offset/4;
     current_val = *p;
     current_val |= (0b011 << 18); // Pin 16
@@ -175,9 +203,17 @@ SPIRegisters init_aux_spi(uint32_t* local_mem) {
     current_val |= (0b011 << 3); // Pin 21
     *p = current_val;
 
-    return create_aux_spi_registers(local_mem);
+    return create_aux_spi_registers(local_mem, spi);
+
 
+}
 
+SPIRegisters init_transport_spi(SPITransport* transport) {
+    // No registers at all here, everything goes through the transport
+    SPIRegisters spi_registers;
+    memset(&spi_registers, 0, sizeof(spi_registers));
+    spi_registers.transport = transport;
+    return spi_registers;
 }
 
 void clean_up_mmap() {
@@ -237,12 +273,74 @@ uint32_t* create_gpio_mmap() {
     return _mem;
 }
 
-void wait_for_spi_transaction_to_finish(SPIRegisters spi_registers) {
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+SPIWaitConfig spi_default_wait_config() {
+    SPIWaitConfig config = {
+        .core_clock_hz = AUX_SPI_DEFAULT_CORE_CLOCK_HZ,
+        .spin_budget_ns = 50000
+    };
+    return config;
+}
+
+void spi_configure_wait(SPIWaitConfig config) {
+    wait_config = config;
+}
+
+SPIWaitStats spi_get_wait_stats() {
+    return wait_stats;
+}
+
+uint32_t spi_bit_time_ns(SPIRegisters spi_registers) {
+    // The AUX SPI clock is core_clock / (2*(speed+1)), see page 21 of the BCM2835 datasheet
+    uint32_t speed = (*spi_registers.control1 >> 20) & 0xFFF;
+    return (uint32_t) ((2ull * (speed + 1) * 1000000000ull) / wait_config.core_clock_hz);
+}
+
+uint32_t spi_clock_hz(uint32_t speed) {
+    return wait_config.core_clock_hz / (2 * (speed + 1));
+}
+
+void wait_for_spi_bits(SPIRegisters spi_registers, unsigned int bits) {
+    /* Sleeping costs way more than an SWD frame takes on the wire (the scheduler
+     * easily adds 60-100us), so instead spin on the STAT register for as long as
+     * the queued bits should take, plus the spin budget. Only once that's used up
+     * does this give the CPU away.
+     */
     StatReg status = interpret_stat_word(*spi_registers.stat);
+    if(!status.busy) {
+        wait_stats.immediate++;
+        return;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t deadline = start + (uint64_t) bits * spi_bit_time_ns(spi_registers) + wait_config.spin_budget_ns;
+    uint64_t now = start;
+    while(status.busy && now < deadline) {
+        status = interpret_stat_word(*spi_registers.stat);
+        now = now_ns();
+    }
+    wait_stats.spin_ns += now - start;
+    if(!status.busy) {
+        wait_stats.spun++;
+        return;
+    }
+
+    wait_stats.yielded++;
     while(status.busy) {
-        usleep(10);
+        sched_yield();
         status = interpret_stat_word(*spi_registers.stat);
     }
+    wait_stats.yield_ns += now_ns() - now;
+}
+
+void wait_for_spi_transaction_to_finish(SPIRegisters spi_registers) {
+    // Nothing known about what's queued, so it all comes out of the spin budget
+    wait_for_spi_bits(spi_registers, 0);
 }
 
 void spi_write(SPIRegisters spi_registers, uint32_t data, unsigned int n) {
@@ -266,19 +364,15 @@ uint32_t spi_read(SPIRegisters spi_registers) {
 }
 
 void clear_rx_reg(SPIRegisters spi_registers) {
+    wait_for_spi_transaction_to_finish(spi_registers);
     StatReg stat = interpret_stat_word(*spi_registers.stat);
-    while(stat.busy) {
-        usleep(100);
-        stat = interpret_stat_word(*spi_registers.stat);
-
-    }
     while(!stat.rx_empty) {
         *spi_registers.io;
         stat = interpret_stat_word(*spi_registers.stat);
     }
 }
 
-int spi_io(SPIRegisters spi_registers, SPI_Data* data){
+static int aux_spi_io(SPIRegisters spi_registers, SPI_Data* data) {
     // First check to make sure the TX & RX fifo have enough space
     int i;
     StatReg stat = interpret_stat_word(*spi_registers.stat);
@@ -292,16 +386,19 @@ int spi_io(SPIRegisters spi_registers, SPI_Data* data){
     int tx_fifo_space = AUX_SPI_FIFO_DEPTH - stat.tx_fifo_level;
 
     if( tx_fifo_space < data->n_writes || rx_fifo_space < data->n_writes) {
+        metric_inc(METRIC_SPI_FIFO_FULL);
         printf("Can't do IO. Not enough space in FIFO currently\n");
         return 1;
     }
     if(stat.busy) {
         wait_for_spi_transaction_to_finish(spi_registers);
     }
+    unsigned int bits = 0;
     for(i=0; i<data->n_writes; i++) {
         spi_write(spi_registers, data->mosi[i], data->lengths[i]);
+        bits += data->lengths[i];
     }
-    wait_for_spi_transaction_to_finish(spi_registers);
+    wait_for_spi_bits(spi_registers, bits);
     for(i=0; i<data->n_writes; i++) {
         data->miso[i] = spi_read(spi_registers);
         if(!msb_in_first) {
@@ -310,3 +407,90 @@ int spi_io(SPIRegisters spi_registers, SPI_Data* data){
     }
     return 0;
 }
+
+int spi_io(SPIRegisters spi_registers, SPI_Data* data){
+    uint64_t start = metric_start();
+    int err;
+    metric_inc(METRIC_SPI_IO);
+    metric_add(METRIC_SPI_WORDS, data->n_writes);
+    if(spi_registers.transport) {
+        SPITransport* transport = spi_registers.transport;
+        err = transport->io(transport->ctx, data->mosi, data->miso, data->lengths, data->n_writes);
+    } else {
+        err = aux_spi_io(spi_registers, data);
+    }
+    metric_observe(METRIC_HIST_SPI_IO, start);
+    return err;
+}
+
+static int aux_spi_io_stream(SPIRegisters spi_registers, const uint32_t* mosi, uint32_t* miso, const unsigned int* lengths, unsigned int n) {
+    unsigned int tx = 0;
+    unsigned int rx = 0;
+    int msb_in_first = interpret_control_reg(0, *spi_registers.control2).msb_in_first;
+
+    while(rx < n) {
+        while(tx < n && tx - rx < AUX_SPI_FIFO_DEPTH) {
+            spi_write(spi_registers, mosi[tx], lengths[tx]);
+            tx++;
+        }
+        StatReg stat = interpret_stat_word(*spi_registers.stat);
+        if(stat.rx_empty) {
+            continue;
+        }
+        miso[rx] = *spi_registers.io;
+        if(!msb_in_first) {
+            miso[rx] = miso[rx] >> (32-lengths[rx]);
+        }
+        rx++;
+    }
+    return 0;
+}
+
+int spi_io_stream(SPIRegisters spi_registers, const uint32_t* mosi, uint32_t* miso, const unsigned int* lengths, unsigned int n) {
+    /* Same as spi_io but for any number of words. Rather than waiting for the
+     * whole FIFO to drain between bursts of 4 this keeps topping up the TX FIFO
+     * while it empties the RX FIFO, so the wire doesn't go idle between words.
+     * Never more than AUX_SPI_FIFO_DEPTH words are in flight, that way the RX FIFO
+     * can't overflow.
+     */
+    uint64_t start = metric_start();
+    int err;
+    metric_inc(METRIC_SPI_IO);
+    metric_add(METRIC_SPI_WORDS, n);
+    if(spi_registers.transport) {
+        SPITransport* transport = spi_registers.transport;
+        err = transport->io(transport->ctx, mosi, miso, lengths, n);
+    } else {
+        err = aux_spi_io_stream(spi_registers, mosi, miso, lengths, n);
+    }
+    metric_observe(METRIC_HIST_SPI_IO, start);
+    return err;
+}
+
+int spi_io_chain(SPIRegisters spi_registers, SPI_Data* data, unsigned int n) {
+    // Runs several SPI_Data bursts back to back as a single stream
+    uint32_t mosi[4*n];
+    uint32_t miso[4*n];
+    unsigned int lengths[4*n];
+    unsigned int i, j;
+    unsigned int nwords = 0;
+    int err;
+
+    for(i = 0; i < n; i++) {
+        for(j = 0; j < data[i].n_writes; j++) {
+            mosi[nwords] = data[i].mosi[j];
+            lengths[nwords] = data[i].lengths[j];
+            nwords++;
+        }
+    }
+    if((err = spi_io_stream(spi_registers, mosi, miso, lengths, nwords))) {
+        return err;
+    }
+    nwords = 0;
+    for(i = 0; i < n; i++) {
+        for(j = 0; j < data[i].n_writes; j++) {
+            data[i].miso[j] = miso[nwords++];
+        }
+    }
+    return 0;
+}
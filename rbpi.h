@@ -3,6 +3,11 @@
 #include <inttypes.h> // For uint32_t
 #include "common_utils.h"
 #define AUX_SPI_FIFO_DEPTH 4
+// The AUX SPI clock is derived from the VPU core clock, 250MHz unless it's been overclocked
+#define AUX_SPI_DEFAULT_CORE_CLOCK_HZ 250000000
+// The two AUX SPI masters, the value is also their bit in the AUX enable register
+#define AUX_SPI1 0x2
+#define AUX_SPI2 0x4
 
 typedef struct ControlReg {
     uint32_t speed;
@@ -37,6 +42,16 @@ typedef struct StatReg {
 } StatReg;
 
 
+// A transport is anything that can take a list of variable width SPI words,
+// clock them out on the SWD line and hand back what was on the line.
+// mosi, miso and lengths each hold n entries of at most 24 bits. miso comes
+// back "wire order", i.e. bit i of each word is the i-th bit that was clocked.
+typedef struct SPITransport {
+    const char* name;
+    int (*io)(void* ctx, const uint32_t* mosi, uint32_t* miso, const unsigned int* lengths, unsigned int n);
+    void* ctx;
+} SPITransport;
+
 // I'm only like 75% sure volatile is useful/recommendable here
 typedef struct SPIRegisters {
     volatile uint32_t* base;
@@ -46,10 +61,30 @@ typedef struct SPIRegisters {
     volatile uint32_t* stat;
     volatile uint32_t* io;
     volatile uint32_t* peek;
+    // NULL means use the AUX SPI registers above, otherwise all IO goes here
+    SPITransport* transport;
 } SPIRegisters;
 
+// How waiting for a transfer to finish behaves.
+// It spins for as long as the queued bits should take plus spin_budget_ns,
+// and only after that starts yielding the CPU.
+typedef struct SPIWaitConfig {
+    uint32_t core_clock_hz;
+    uint32_t spin_budget_ns;
+} SPIWaitConfig;
+
+// How often each path in the wait was taken
+typedef struct SPIWaitStats {
+    uint64_t immediate; // Already finished on the first look at STAT
+    uint64_t spun;      // Finished while spinning
+    uint64_t yielded;   // Spin budget ran out, had to give the CPU away
+    uint64_t spin_ns;
+    uint64_t yield_ns;
+} SPIWaitStats;
+
 uint32_t* create_gpio_mmap();
-SPIRegisters init_aux_spi(uint32_t* local_mem);
+SPIRegisters init_aux_spi(uint32_t* local_mem, unsigned int spi);
+SPIRegisters init_transport_spi(SPITransport* transport);
 StatReg interpret_stat_word(uint32_t word);
 void write_control_reg(SPIRegisters spi_registers, ControlReg values) ;
 ControlReg interpret_control_reg(uint32_t control1, uint32_t control2);
@@ -58,6 +93,14 @@ uint32_t spi_read(SPIRegisters spi_registers);
 void spi_write(SPIRegisters spi_registers, uint32_t data, unsigned int n);
 void clear_rx_reg(SPIRegisters spi_registers);
 int spi_io(SPIRegisters spi_registers, SPI_Data* data);
+int spi_io_stream(SPIRegisters spi_registers, const uint32_t* mosi, uint32_t* miso, const unsigned int* lengths, unsigned int n);
+int spi_io_chain(SPIRegisters spi_registers, SPI_Data* data, unsigned int n);
 void wait_for_spi_transaction_to_finish(SPIRegisters spi_registers);
+void wait_for_spi_bits(SPIRegisters spi_registers, unsigned int bits);
+uint32_t spi_bit_time_ns(SPIRegisters spi_registers);
+uint32_t spi_clock_hz(uint32_t speed);
+SPIWaitConfig spi_default_wait_config();
+void spi_configure_wait(SPIWaitConfig config);
+SPIWaitStats spi_get_wait_stats();
 void clean_up_mmap();
 #endif
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "sim_nrf.h"
+
+// A tiny Thumb interpreter for the sim's Cortex-M4. It only knows the 16-bit
+// instructions the stubs in flash_stub.c use (plus a few obvious neighbours),
+// anything else locks the core up so it's easy to spot.
+
+#define APSR_N (1u << 31)
+#define APSR_Z (1u << 30)
+#define APSR_C (1u << 29)
+#define APSR_V (1u << 28)
+
+static void set_nz(SimCore* core, uint32_t result) {
+    core->regs[16] &= ~(APSR_N | APSR_Z);
+    core->regs[16] |= (result & 0x80000000) ? APSR_N : 0;
+    core->regs[16] |= result == 0 ? APSR_Z : 0;
+}
+
+static uint32_t add_with_flags(SimCore* core, uint32_t a, uint32_t b, int carry) {
+    uint64_t wide = (uint64_t) a + b + carry;
+    uint32_t result = (uint32_t) wide;
+    set_nz(core, result);
+    core->regs[16] &= ~(APSR_C | APSR_V);
+    core->regs[16] |= (wide >> 32) ? APSR_C : 0;
+    core->regs[16] |= (~(a ^ b) & (a ^ result) & 0x80000000) ? APSR_V : 0;
+    return result;
+}
+
+static uint32_t sub_with_flags(SimCore* core, uint32_t a, uint32_t b) {
+    return add_with_flags(core, a, ~b, 1);
+}
+
+static int condition_passed(SimCore* core, unsigned int cond) {
+    uint32_t apsr = core->regs[16];
+    int n = !!(apsr & APSR_N), z = !!(apsr & APSR_Z), c = !!(apsr & APSR_C), v = !!(apsr & APSR_V);
+    int result;
+    switch(cond >> 1) {
+        case 0: result = z; break;
+        case 1: result = c; break;
+        case 2: result = n; break;
+        case 3: result = v; break;
+        case 4: result = c && !z; break;
+        case 5: result = n == v; break;
+        case 6: result = !z && n == v; break;
+        default: return 1;
+    }
+    return (cond & 1) ? !result : result;
+}
+
+static int load(SimNRF52* sim, uint32_t addr, uint32_t* value) {
+    if(sim_nrf_bus_read(sim, addr & ~0x3u, value)) {
+        return 1;
+    }
+    return 0;
+}
+
+static void lockup(SimNRF52* sim, const char* why, uint32_t what) {
+    printf("sim: core locked up at pc=0x%08x, %s 0x%08x\n", sim->core.regs[15], why, what);
+    sim->core.state = SIM_CORE_LOCKUP;
+}
+
+static int step(SimNRF52* sim) {
+    SimCore* core = &sim->core;
+    uint32_t* r = core->regs;
+    uint32_t pc = r[15];
+    uint32_t word, value;
+    if(load(sim, pc, &word)) {
+        lockup(sim, "can't fetch from", pc);
+        return 1;
+    }
+    uint16_t op = (pc & 2) ? word >> 16 : word & 0xFFFF;
+    unsigned int rd = op & 0x7, rn = (op >> 3) & 0x7, rm = (op >> 6) & 0x7;
+    unsigned int imm5 = (op >> 6) & 0x1F, imm8 = op & 0xFF, rdn = (op >> 8) & 0x7;
+    uint32_t next = pc + 2;
+
+    if((op & 0xF800) == 0x0000) {          // LSLS rd, rm, #imm5
+        value = r[rn];
+        if(imm5) {
+            r[16] = (r[16] & ~APSR_C) | (((value >> (32 - imm5)) & 1) ? APSR_C : 0);
+            value <<= imm5;
+        }
+        r[rd] = value;
+        set_nz(core, value);
+    } else if((op & 0xF800) == 0x0800) {   // LSRS rd, rm, #imm5
+        unsigned int shift = imm5 ? imm5 : 32;
+        value = r[rn];
+        r[16] = (r[16] & ~APSR_C) | (((value >> (shift - 1)) & 1) ? APSR_C : 0);
+        value = shift == 32 ? 0 : value >> shift;
+        r[rd] = value;
+        set_nz(core, value);
+    } else if((op & 0xFE00) == 0x1800) {   // ADDS rd, rn, rm
+        r[rd] = add_with_flags(core, r[rn], r[rm], 0);
+    } else if((op & 0xFE00) == 0x1A00) {   // SUBS rd, rn, rm
+        r[rd] = sub_with_flags(core, r[rn], r[rm]);
+    } else if((op & 0xFE00) == 0x1C00) {   // ADDS rd, rn, #imm3
+        r[rd] = add_with_flags(core, r[rn], rm, 0);
+    } else if((op & 0xFE00) == 0x1E00) {   // SUBS rd, rn, #imm3
+        r[rd] = sub_with_flags(core, r[rn], rm);
+    } else if((op & 0xF800) == 0x2000) {   // MOVS rdn, #imm8
+        r[rdn] = imm8;
+        set_nz(core, imm8);
+    } else if((op & 0xF800) == 0x2800) {   // CMP rdn, #imm8
+        sub_with_flags(core, r[rdn], imm8);
+    } else if((op & 0xF800) == 0x3000) {   // ADDS rdn, #imm8
+        r[rdn] = add_with_flags(core, r[rdn], imm8, 0);
+    } else if((op & 0xF800) == 0x3800) {   // SUBS rdn, #imm8
+        r[rdn] = sub_with_flags(core, r[rdn], imm8);
+    } else if((op & 0xFC00) == 0x4000) {   // Data processing, rdn = rdn op rm
+        unsigned int rs = (op >> 3) & 0x7;
+        switch((op >> 6) & 0xF) {
+            case 0x0: r[rd] &= r[rs]; set_nz(core, r[rd]); break;           // ANDS
+            case 0x1: r[rd] ^= r[rs]; set_nz(core, r[rd]); break;           // EORS
+            case 0xA: sub_with_flags(core, r[rd], r[rs]); break;            // CMP
+            case 0xC: r[rd] |= r[rs]; set_nz(core, r[rd]); break;           // ORRS
+            case 0xE: r[rd] &= ~r[rs]; set_nz(core, r[rd]); break;          // BICS
+            case 0xF: r[rd] = ~r[rs]; set_nz(core, r[rd]); break;           // MVNS
+            default:
+                lockup(sim, "unsupported instruction", op);
+                return 1;
+        }
+    } else if((op & 0xFF00) == 0x4600) {   // MOV rd, rm (any registers)
+        unsigned int d = (op & 0x7) | ((op >> 4) & 0x8);
+        unsigned int m = (op >> 3) & 0xF;
+        value = m == 15 ? pc + 4 : r[m];
+        if(d == 15) {
+            next = value & ~1u;
+        } else {
+            r[d] = value;
+        }
+    } else if((op & 0xF800) == 0x4800) {   // LDR rdn, [pc, #imm8*4]
+        if(load(sim, ((pc + 4) & ~3u) + imm8*4, &r[rdn])) {
+            lockup(sim, "bus error reading", ((pc + 4) & ~3u) + imm8*4);
+            return 1;
+        }
+    } else if((op & 0xF000) == 0x6000) {   // STR/LDR rd, [rn, #imm5*4]
+        uint32_t addr = r[rn] + imm5*4;
+        int err = (op & 0x0800) ? load(sim, addr, &r[rd]) : sim_nrf_bus_write(sim, addr, r[rd]);
+        if(err) {
+            lockup(sim, "bus error at", addr);
+            return 1;
+        }
+    } else if((op & 0xF000) == 0x7000) {   // STRB/LDRB rd, [rn, #imm5]
+        uint32_t addr = r[rn] + imm5;
+        unsigned int shift = (addr & 3) * 8;
+        int err = load(sim, addr, &value);
+        if(!err && (op & 0x0800)) {
+            r[rd] = (value >> shift) & 0xFF;
+        } else if(!err) {
+            value = (value & ~(0xFFu << shift)) | ((r[rd] & 0xFF) << shift);
+            err = sim_nrf_bus_write(sim, addr & ~0x3u, value);
+        }
+        if(err) {
+            lockup(sim, "bus error at", addr);
+            return 1;
+        }
+    } else if(op == 0xBF00) {              // NOP
+    } else if((op & 0xFF00) == 0xBE00) {   // BKPT, the stubs use it to say they're done
+        core->state = SIM_CORE_HALTED;
+        return 1;
+    } else if((op & 0xF000) == 0xD000 && (op & 0x0F00) < 0x0E00) { // B<cond>
+        if(condition_passed(core, (op >> 8) & 0xF)) {
+            next = pc + 4 + (int8_t) imm8 * 2;
+        }
+    } else if((op & 0xF800) == 0xE000) {   // B
+        int32_t offset = op & 0x7FF;
+        if(offset & 0x400) {
+            offset -= 0x800;
+        }
+        next = pc + 4 + offset*2;
+    } else {
+        lockup(sim, "unsupported instruction", op);
+        return 1;
+    }
+    r[15] = next;
+    return 0;
+}
+
+void sim_core_run(SimNRF52* sim, unsigned int steps) {
+    while(steps-- && sim->core.state == SIM_CORE_RUNNING) {
+        sim->stats.core_steps++;
+        if(step(sim)) {
+            break;
+        }
+    }
+}
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "sim_gpio.h"
+
+static int pin_is_output(SimGPIO* gpio, unsigned int pin) {
+    return ((gpio->fsel[pin/10] >> (pin%10)*3) & 0x7) == GPIO_FSEL_OUTPUT;
+}
+
+static int swdio_level(SimGPIO* gpio) {
+    /* sim_nrf_clock_bit works out what the target drives and takes what the host
+     * drives in the same call, so when the host looks at the line before the rising
+     * edge the target gets clocked early. The host can't be driving anything then.
+     */
+    if(pin_is_output(gpio, gpio->swdio)) {
+        return (gpio->latch >> gpio->swdio) & 1;
+    }
+    if(gpio->target_bit < 0) {
+        gpio->target_bit = sim_nrf_clock_bit(gpio->target, 1); // Pull-up
+    }
+    return gpio->target_bit;
+}
+
+void sim_gpio_init(SimGPIO* gpio, SimNRF52* target, unsigned int swclk, unsigned int swdio) {
+    memset(gpio, 0, sizeof(*gpio));
+    gpio->target = target;
+    gpio->swclk = swclk;
+    gpio->swdio = swdio;
+    gpio->target_bit = -1;
+}
+
+void sim_gpio_write(SimGPIO* gpio, unsigned int offset, uint32_t value) {
+    uint32_t old = gpio->latch;
+    gpio->writes++;
+    if(offset < GPIO_GPFSEL0 + 6*4) {
+        gpio->fsel[offset/4] = value;
+        return;
+    }
+    if(offset == GPIO_GPSET0) {
+        gpio->latch |= value;
+    } else if(offset == GPIO_GPCLR0) {
+        gpio->latch &= ~value;
+    } else {
+        return;
+    }
+    uint32_t clk = 1u << gpio->swclk;
+    if(pin_is_output(gpio, gpio->swclk) && !(old & clk) && (gpio->latch & clk)) {
+        // Rising edge, the target samples SWDIO
+        if(gpio->target_bit < 0) {
+            int driven = pin_is_output(gpio, gpio->swdio);
+            sim_nrf_clock_bit(gpio->target, driven ? (gpio->latch >> gpio->swdio) & 1 : 1);
+        }
+        gpio->target_bit = -1;
+        gpio->clocks++;
+    }
+}
+
+uint32_t sim_gpio_read(SimGPIO* gpio, unsigned int offset) {
+    gpio->reads++;
+    if(offset < GPIO_GPFSEL0 + 6*4) {
+        return gpio->fsel[offset/4];
+    }
+    if(offset == GPIO_GPLEV0) {
+        uint32_t level = gpio->latch & ~(1u << gpio->swdio);
+        return level | ((uint32_t) swdio_level(gpio) << gpio->swdio);
+    }
+    return 0;
+}
+
+void sim_gpio_print_stats(SimGPIO* gpio) {
+    printf("sim gpio: %" PRIu64 " register writes, %" PRIu64 " reads, %" PRIu64 " clocks\n",
+           gpio->writes, gpio->reads, gpio->clocks);
+}
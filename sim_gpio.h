@@ -0,0 +1,35 @@
+#ifndef RASBERRY_PINE_SIM_GPIO_H
+#define RASBERRY_PINE_SIM_GPIO_H
+#include <inttypes.h>
+#include "sim_nrf.h"
+
+// The BCM2835 GPIO registers the bit-bang backend uses (GPFSELn, GPSET0, GPCLR0, GPLEV0),
+// with a simulated nRF52 hooked up to the SWCLK and SWDIO pins. The target gets clocked
+// on every rising SWCLK edge. When the host isn't driving SWDIO the pin reads whatever
+// the target drives for the current clock, or the pull-up when it isn't driving either.
+
+// Byte offsets from the start of the GPIO registers, see section 6.1 of the BCM2835 datasheet
+#define GPIO_GPFSEL0 0x00
+#define GPIO_GPSET0  0x1C
+#define GPIO_GPCLR0  0x28
+#define GPIO_GPLEV0  0x34
+#define GPIO_FSEL_INPUT  0x0
+#define GPIO_FSEL_OUTPUT 0x1
+
+typedef struct SimGPIO {
+    uint32_t fsel[6];
+    uint32_t latch;         // What GPSET/GPCLR have set the outputs to
+    unsigned int swclk;
+    unsigned int swdio;
+    int target_bit;         // What the target drives this clock, -1 if it hasn't been clocked yet
+    SimNRF52* target;
+    uint64_t writes;
+    uint64_t reads;
+    uint64_t clocks;
+} SimGPIO;
+
+void sim_gpio_init(SimGPIO* gpio, SimNRF52* target, unsigned int swclk, unsigned int swdio);
+void sim_gpio_write(SimGPIO* gpio, unsigned int offset, uint32_t value);
+uint32_t sim_gpio_read(SimGPIO* gpio, unsigned int offset);
+void sim_gpio_print_stats(SimGPIO* gpio);
+#endif
@@ -0,0 +1,651 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "common_utils.h"
+#include "swd.h"
+#include "sim_nrf.h"
+#include "flash_stub.h"
+
+// Where on the wire the model currently thinks it is.
+// See chapter 4 of the ADIv5 spec for the packet layout this follows.
+enum SimLineState {
+    SIM_LINE_IDLE = 0,
+    SIM_LINE_HEADER,
+    SIM_LINE_TRN_ACK,   // Turnaround between header and ACK
+    SIM_LINE_ACK,
+    SIM_LINE_READ_DATA, // 32 data bits + parity, driven by the target
+    SIM_LINE_TRN_WRITE, // Turnaround between ACK and write data
+    SIM_LINE_WRITE_DATA,
+    SIM_LINE_TRN_IDLE,  // Turnaround after a read (or a WAIT/FAULT)
+    SIM_LINE_SKIP,      // Data phase after WAIT/FAULT with ORUNDETECT set
+    SIM_LINE_LOCKOUT    // Protocol error, ignore everything until a line reset
+};
+
+// Not really an ACK, but it's what the host sees when nobody drives the line
+#define SIM_NO_ACK 0xFF
+
+// CTRL/STAT bits
+#define CS_ORUNDETECT   (1u << 0)
+#define CS_STICKYORUN   (1u << 1)
+#define CS_STICKYCMP    (1u << 4)
+#define CS_STICKYERR    (1u << 5)
+#define CS_READOK       (1u << 6)
+#define CS_WDATAERR     (1u << 7)
+#define CS_CDBGRSTREQ   (1u << 26)
+#define CS_CDBGRSTACK   (1u << 27)
+#define CS_CDBGPWRUPREQ (1u << 28)
+#define CS_CDBGPWRUPACK (1u << 29)
+#define CS_CSYSPWRUPREQ (1u << 30)
+#define CS_CSYSPWRUPACK (1u << 31)
+#define CS_STICKY_FAULT (CS_STICKYORUN | CS_STICKYERR | CS_WDATAERR)
+
+#define NVMC_ERASEUICR_OFFSET 0x514
+#define FICR_BASE 0x10000000
+
+static uint32_t sim_rand(SimNRF52* sim) {
+    // xorshift32, good enough for picking which transactions to mess with
+    uint32_t x = sim->rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim->rng_state = x;
+    return x;
+}
+
+static int sim_chance(SimNRF52* sim, double rate) {
+    if(rate <= 0) {
+        return 0;
+    }
+    return (sim_rand(sim) / 4294967296.0) < rate;
+}
+
+SimNRF52* sim_nrf_create() {
+    SimNRF52* sim = calloc(1, sizeof(SimNRF52));
+    if(!sim) {
+        return NULL;
+    }
+    sim->flash = malloc(SIM_NRF_FLASH_SIZE);
+    sim->uicr = malloc(SIM_NRF_UICR_SIZE);
+    sim->ram = calloc(1, SIM_NRF_RAM_SIZE);
+    if(!sim->flash || !sim->uicr || !sim->ram) {
+        sim_nrf_destroy(sim);
+        return NULL;
+    }
+    memset(sim->flash, 0xFF, SIM_NRF_FLASH_SIZE);
+    memset(sim->uicr, 0xFF, SIM_NRF_UICR_SIZE);
+    sim->rng_state = 0x1234567;
+    sim->deviceid[0] = 0x6a8e3f21;
+    sim->deviceid[1] = 0xc4d1570b;
+    sim->line_state = SIM_LINE_LOCKOUT; // Needs a line reset before it'll talk
+    sim->reset_state = 1;
+    sim->csw = 0x23000042; // 32-bit transfers, device enabled, no auto-increment
+    sim->core_steps = 1000; // A 64MHz M4 gets through about this many in one ~50 bit transaction
+    sim->core.state = SIM_CORE_FIRMWARE;
+    sim->spi_speed = 0x28;
+    sim->spi_in_rising = 1;
+    sim->spi_out_rising = 1;
+    return sim;
+}
+
+void sim_nrf_destroy(SimNRF52* sim) {
+    if(!sim) {
+        return;
+    }
+    free(sim->flash);
+    free(sim->uicr);
+    free(sim->ram);
+    free(sim);
+}
+
+static void nvmc_erase_all(SimNRF52* sim) {
+    memset(sim->flash, 0xFF, SIM_NRF_FLASH_SIZE);
+    memset(sim->uicr, 0xFF, SIM_NRF_UICR_SIZE);
+    sim->stats.full_erases++;
+}
+
+int sim_nrf_bus_read(SimNRF52* sim, uint32_t addr, uint32_t* value) {
+    addr &= ~0x3;
+    if(addr < SIM_NRF_FLASH_SIZE) {
+        *value = sim->flash[addr/4];
+        return 0;
+    }
+    if(addr >= SIM_NRF_UICR_BASE && addr < SIM_NRF_UICR_BASE + SIM_NRF_UICR_SIZE) {
+        *value = sim->uicr[(addr - SIM_NRF_UICR_BASE)/4];
+        return 0;
+    }
+    if(addr >= SIM_NRF_RAM_BASE && addr < SIM_NRF_RAM_BASE + SIM_NRF_RAM_SIZE) {
+        *value = sim->ram[(addr - SIM_NRF_RAM_BASE)/4];
+        return 0;
+    }
+    switch(addr) {
+        case FICR_BASE + 0x10: // CODEPAGESIZE
+            *value = SIM_NRF_PAGE_SIZE;
+            return 0;
+        case FICR_BASE + 0x14: // CODESIZE
+            *value = SIM_NRF_FLASH_SIZE / SIM_NRF_PAGE_SIZE;
+            return 0;
+        case FICR_BASE + 0x60: // DEVICEID[0]
+        case FICR_BASE + 0x64: // DEVICEID[1]
+            *value = sim->deviceid[(addr - FICR_BASE - 0x60)/4];
+            return 0;
+        case NVMC_OFFSET + NVMC_READY_OFFSET:
+            *value = sim->nvmc_busy ? 0 : 1;
+            return 0;
+        case NVMC_OFFSET + NVMC_CONFIG_OFFSET:
+            *value = sim->nvmc_config;
+            return 0;
+        case DHCSR_ADDR:
+            *value = sim->core.dhcsr | DHCSR_S_REGRDY;
+            *value |= sim->core.state == SIM_CORE_HALTED ? DHCSR_S_HALT : 0;
+            *value |= sim->core.state == SIM_CORE_LOCKUP ? (1 << 19) : 0; // S_LOCKUP
+            return 0;
+        case DCRDR_ADDR:
+            *value = sim->core.dcrdr;
+            return 0;
+        case SCB_VTOR_ADDR:
+            *value = sim->core.vtor;
+            return 0;
+    }
+    return 1;
+}
+
+static void core_debug_write(SimNRF52* sim, uint32_t addr, uint32_t value) {
+    SimCore* core = &sim->core;
+    if(addr == DHCSR_ADDR) {
+        // Writes without the key are ignored
+        if((value & 0xFFFF0000) != DHCSR_KEY) {
+            return;
+        }
+        // C_MASKINTS only takes while the core's halted, otherwise it keeps its old value
+        uint32_t maskints = core->state == SIM_CORE_HALTED ? value : core->dhcsr;
+        core->dhcsr = (value & (DHCSR_C_DEBUGEN | DHCSR_C_HALT)) | (maskints & DHCSR_C_MASKINTS);
+        if((value & DHCSR_C_DEBUGEN) && (value & DHCSR_C_HALT)) {
+            core->state = SIM_CORE_HALTED;
+        } else if(core->state == SIM_CORE_HALTED) {
+            core->state = SIM_CORE_RUNNING;
+        }
+    } else if(addr == DCRSR_ADDR) {
+        // Register transfers only work while halted, and finish straight away
+        unsigned int reg = value & 0x7F;
+        if(core->state != SIM_CORE_HALTED || reg > 16) {
+            return;
+        }
+        if(value & DCRSR_REGWnR) {
+            core->regs[reg] = core->dcrdr;
+        } else {
+            core->dcrdr = core->regs[reg];
+        }
+    } else if(addr == DCRDR_ADDR) {
+        core->dcrdr = value;
+    }
+}
+
+int sim_nrf_bus_write(SimNRF52* sim, uint32_t addr, uint32_t value) {
+    addr &= ~0x3;
+    if(addr < SIM_NRF_FLASH_SIZE) {
+        // Flash can only go from 1 -> 0, and only when the NVMC allows it
+        if(sim->nvmc_config == 1) {
+            sim->flash[addr/4] &= value;
+            sim->nvmc_busy = sim->nvmc_write_time;
+            sim->stats.flash_writes++;
+        }
+        return 0;
+    }
+    if(addr >= SIM_NRF_UICR_BASE && addr < SIM_NRF_UICR_BASE + SIM_NRF_UICR_SIZE) {
+        if(sim->nvmc_config == 1) {
+            sim->uicr[(addr - SIM_NRF_UICR_BASE)/4] &= value;
+        }
+        return 0;
+    }
+    if(addr >= SIM_NRF_RAM_BASE && addr < SIM_NRF_RAM_BASE + SIM_NRF_RAM_SIZE) {
+        sim->ram[(addr - SIM_NRF_RAM_BASE)/4] = value;
+        return 0;
+    }
+    switch(addr) {
+        case DHCSR_ADDR:
+        case DCRSR_ADDR:
+        case DCRDR_ADDR:
+            core_debug_write(sim, addr, value);
+            return 0;
+        case SCB_VTOR_ADDR:
+            sim->core.vtor = value & 0xFFFFFF80;
+            return 0;
+        case NVMC_OFFSET + NVMC_CONFIG_OFFSET:
+            sim->nvmc_config = value & 0x3;
+            return 0;
+        case NVMC_OFFSET + NVMC_ERASEPAGE:
+            if(sim->nvmc_config == 2 && value < SIM_NRF_FLASH_SIZE) {
+                value &= ~(SIM_NRF_PAGE_SIZE - 1);
+                memset(&sim->flash[value/4], 0xFF, SIM_NRF_PAGE_SIZE);
+                sim->stats.page_erases++;
+            }
+            return 0;
+        case NVMC_OFFSET + NVMC_ERASEALL:
+            if(sim->nvmc_config == 2 && (value & 1)) {
+                nvmc_erase_all(sim);
+            }
+            return 0;
+        case NVMC_OFFSET + NVMC_ERASEUICR_OFFSET:
+            if(sim->nvmc_config == 2 && (value & 1)) {
+                memset(sim->uicr, 0xFF, SIM_NRF_UICR_SIZE);
+            }
+            return 0;
+    }
+    return 1;
+}
+
+static void mem_ap_increment_tar(SimNRF52* sim) {
+    // Single auto-increment only has to work inside a 1KB block,
+    // real hardware wraps there so do the same.
+    if(((sim->csw >> 4) & 0x3) == 1) {
+        sim->tar = (sim->tar & ~0x3FFu) | ((sim->tar + 4) & 0x3FF);
+    }
+}
+
+static uint32_t ap_read(SimNRF52* sim, uint32_t addr) {
+    uint32_t apsel = sim->select >> 24;
+    uint32_t value = 0;
+    if(apsel == 0) {
+        switch(addr) {
+            case CSW_OFFSET:
+                return sim->csw;
+            case TAR_OFFSET:
+                return sim->tar;
+            case DRW_OFFSET:
+                if(sim_nrf_bus_read(sim, sim->tar, &value)) {
+                    sim->ctrlstat |= CS_STICKYERR;
+                }
+                mem_ap_increment_tar(sim);
+                return value;
+            case 0x10: case 0x14: case 0x18: case 0x1C: // Banked data registers
+                if(sim_nrf_bus_read(sim, (sim->tar & ~0xFu) | (addr & 0xC), &value)) {
+                    sim->ctrlstat |= CS_STICKYERR;
+                }
+                return value;
+            case 0xF8: // BASE
+                return 0xE00FF003;
+            case 0xFC:
+                return SIM_NRF_MEM_AP_IDR;
+        }
+    } else if(apsel == 1) {
+        switch(addr) {
+            case 0x0:
+                return sim->ctrl_ap_reset;
+            case 0x8: // ERASEALLSTATUS, erasing is instant
+                return 0;
+            case 0xC: // APPROTECTSTATUS, 1 means not protected
+                return sim->approtect ? 0 : 1;
+            case 0xFC:
+                return SIM_NRF_CTRL_AP_IDR;
+        }
+    }
+    return 0;
+}
+
+static void ap_write(SimNRF52* sim, uint32_t addr, uint32_t value) {
+    uint32_t apsel = sim->select >> 24;
+    if(apsel == 0) {
+        switch(addr) {
+            case CSW_OFFSET:
+                // Only prot, mode, addr_increment and size are writeable.
+                // DeviceEn always reads back as set.
+                sim->csw = (value & 0x3F000F37) | (1 << 6);
+                return;
+            case TAR_OFFSET:
+                sim->tar = value;
+                return;
+            case DRW_OFFSET:
+                if(sim_nrf_bus_write(sim, sim->tar, value)) {
+                    sim->ctrlstat |= CS_STICKYERR;
+                }
+                mem_ap_increment_tar(sim);
+                return;
+            case 0x10: case 0x14: case 0x18: case 0x1C:
+                if(sim_nrf_bus_write(sim, (sim->tar & ~0xFu) | (addr & 0xC), value)) {
+                    sim->ctrlstat |= CS_STICKYERR;
+                }
+                return;
+        }
+    } else if(apsel == 1) {
+        switch(addr) {
+            case 0x0:
+                // Letting go of reset starts the firmware again, debug halt or not
+                if(sim->ctrl_ap_reset && !(value & 1)) {
+                    sim->core.state = SIM_CORE_FIRMWARE;
+                    sim->core.dhcsr = 0;
+                }
+                sim->ctrl_ap_reset = value & 1;
+                return;
+            case 0x4:
+                if(value & 1) {
+                    nvmc_erase_all(sim);
+                    sim->approtect = 0;
+                }
+                return;
+        }
+    }
+}
+
+static void dp_write(SimNRF52* sim, uint32_t addr, uint32_t value) {
+    switch(addr) {
+        case SWD_ABORT_ADDR:
+            if(value & (1 << 1)) sim->ctrlstat &= ~CS_STICKYCMP;
+            if(value & (1 << 2)) sim->ctrlstat &= ~CS_STICKYERR;
+            if(value & (1 << 3)) sim->ctrlstat &= ~CS_WDATAERR;
+            if(value & (1 << 4)) sim->ctrlstat &= ~CS_STICKYORUN;
+            break;
+        case SWD_CTRLSTAT_ADDR: {
+            // Sticky bits and ACKs are read-only. The power-up ACKs just follow the requests.
+            uint32_t writeable = CS_CSYSPWRUPREQ | CS_CDBGPWRUPREQ | CS_CDBGRSTREQ | CS_ORUNDETECT | (0xFFF << 12) | (0xF << 8) | (0x3 << 2);
+            uint32_t cs = (sim->ctrlstat & ~writeable) | (value & writeable);
+            cs &= ~(CS_CSYSPWRUPACK | CS_CDBGPWRUPACK | CS_CDBGRSTACK);
+            cs |= (cs & CS_CSYSPWRUPREQ) ? CS_CSYSPWRUPACK : 0;
+            cs |= (cs & CS_CDBGPWRUPREQ) ? CS_CDBGPWRUPACK : 0;
+            cs |= (cs & CS_CDBGRSTREQ) ? CS_CDBGRSTACK : 0;
+            sim->ctrlstat = cs;
+            break;
+        }
+        case SWD_SELECT_ADDR:
+            sim->select = value;
+            break;
+    }
+}
+
+// Called once all 8 header bits are in. Decides the ACK and, for reads,
+// what data goes back out.
+static void begin_transaction(SimNRF52* sim) {
+    uint8_t h = sim->header;
+    int start = h & 1;
+    int APnDP = (h >> 1) & 1;
+    int RnW = (h >> 2) & 1;
+    uint32_t addr = ((h >> 3) & 0x3) << 2;
+    int parity = (h >> 5) & 1;
+    int stop = (h >> 6) & 1;
+    int park = (h >> 7) & 1;
+
+    if(!start || stop || !park || has_even_parity((h >> 1) & 0xF, 4) == parity) {
+        sim->stats.protocol_errors++;
+        sim->line_state = SIM_LINE_LOCKOUT;
+        return;
+    }
+    // Straight after a line reset the only thing the DP will answer is a DPIDR read
+    if(sim->reset_state && !(!APnDP && RnW && addr == SWD_DPIDR_ADDR)) {
+        sim->stats.protocol_errors++;
+        sim->line_state = SIM_LINE_LOCKOUT;
+        return;
+    }
+
+    sim->stats.transactions++;
+    if(sim->nvmc_busy) {
+        sim->nvmc_busy--;
+    }
+    sim_core_run(sim, sim->core_steps);
+    sim->ack = ACK_OK;
+    int sticky = (sim->ctrlstat & CS_STICKY_FAULT) != 0;
+    if(APnDP) {
+        int powered = (sim->ctrlstat & (CS_CDBGPWRUPACK | CS_CSYSPWRUPACK)) == (CS_CDBGPWRUPACK | CS_CSYSPWRUPACK);
+        if(!powered) {
+            sim->ctrlstat |= CS_STICKYERR;
+            sim->ack = ACK_FAULT;
+        } else if(sticky || (sim->approtect && (sim->select >> 24) == 0)) {
+            sim->ack = ACK_FAULT;
+        } else if(sim_chance(sim, sim->wait_rate)) {
+            sim->ack = ACK_WAIT;
+        } else if(sim->nvmc_busy && (sim->select >> 24) == 0 && addr == DRW_OFFSET &&
+                  (sim->tar < SIM_NRF_FLASH_SIZE || (sim->tar & ~0xFFFu) == NVMC_OFFSET)) {
+            // The AHB stalls on flash/NVMC accesses while a write is going on
+            sim->ack = ACK_WAIT;
+        }
+    } else {
+        // Only DPIDR reads, CTRL/STAT reads and ABORT writes get through a sticky error
+        int always_ok = RnW ? (addr == SWD_DPIDR_ADDR || addr == SWD_CTRLSTAT_ADDR) : (addr == SWD_ABORT_ADDR);
+        if(sticky && !always_ok) {
+            sim->ack = ACK_FAULT;
+        } else if(RnW && addr == SWD_RDBUFF_ADDR && sim_chance(sim, sim->wait_rate)) {
+            sim->ack = ACK_WAIT;
+        }
+    }
+
+    if(sim->ack == ACK_WAIT) {
+        sim->stats.ack_wait++;
+        if(sim->ctrlstat & CS_ORUNDETECT) {
+            sim->ctrlstat |= CS_STICKYORUN;
+        }
+    } else if(sim->ack == ACK_FAULT) {
+        sim->stats.ack_fault++;
+    }
+    if(sim->ack != ACK_OK || !RnW) {
+        return;
+    }
+
+    if(APnDP) {
+        // AP reads are posted, you get the result of the previous one
+        uint32_t ap_addr = (sim->select & 0xF0) | addr;
+        sim->rdata = sim->rdbuff;
+        sim->rdbuff = ap_read(sim, ap_addr);
+    } else {
+        switch(addr) {
+            case SWD_DPIDR_ADDR:
+                sim->rdata = SIM_NRF_DPIDR;
+                sim->reset_state = 0;
+                break;
+            case SWD_CTRLSTAT_ADDR:
+                sim->rdata = sim->ctrlstat | CS_READOK;
+                break;
+            case SWD_SELECT_ADDR: // RESEND
+                sim->rdata = sim->last_read;
+                break;
+            case SWD_RDBUFF_ADDR:
+                sim->rdata = sim->rdbuff;
+                break;
+        }
+    }
+    sim->last_read = sim->rdata;
+    sim->rparity = !has_even_parity(sim->rdata, 32);
+    if(sim_chance(sim, sim->parity_error_rate)) {
+        sim->rparity = !sim->rparity;
+        sim->stats.parity_errors_injected++;
+    }
+}
+
+static void finish_write(SimNRF52* sim) {
+    uint8_t h = sim->header;
+    int APnDP = (h >> 1) & 1;
+    uint32_t addr = ((h >> 3) & 0x3) << 2;
+
+    if(sim->wparity == has_even_parity(sim->wdata, 32)) {
+        sim->stats.write_parity_errors++;
+        sim->ctrlstat |= CS_WDATAERR;
+        return;
+    }
+    if(APnDP) {
+        ap_write(sim, (sim->select & 0xF0) | addr, sim->wdata);
+    } else {
+        dp_write(sim, addr, sim->wdata);
+    }
+}
+
+static void line_reset(SimNRF52* sim) {
+    sim->stats.line_resets++;
+    sim->line_state = SIM_LINE_IDLE;
+    sim->reset_state = 1;
+}
+
+int sim_nrf_clock_bit(SimNRF52* sim, int mosi) {
+    int driven = 0;
+    int line = mosi;
+    mosi = mosi ? 1 : 0;
+
+    // At least 50 high bits followed by a low one is a line reset, no matter what state we're in
+    if(!mosi && sim->ones >= 50) {
+        line_reset(sim);
+    }
+
+    switch(sim->line_state) {
+        case SIM_LINE_IDLE:
+            if(mosi) {
+                sim->header = 1;
+                sim->nbits = 1;
+                sim->line_state = SIM_LINE_HEADER;
+            }
+            break;
+        case SIM_LINE_HEADER:
+            sim->header |= mosi << sim->nbits;
+            if(++sim->nbits == 8) {
+                sim->line_state = SIM_LINE_TRN_ACK;
+                begin_transaction(sim);
+            }
+            break;
+        case SIM_LINE_TRN_ACK:
+            sim->nbits = 0;
+            sim->line_state = SIM_LINE_ACK;
+            break;
+        case SIM_LINE_ACK:
+            driven = 1;
+            line = (sim->ack >> sim->nbits) & 1;
+            if(++sim->nbits < 3) {
+                break;
+            }
+            sim->nbits = 0;
+            if(sim->ack == ACK_OK) {
+                sim->line_state = (sim->header & (1 << 2)) ? SIM_LINE_READ_DATA : SIM_LINE_TRN_WRITE;
+            } else if(sim->ctrlstat & CS_ORUNDETECT) {
+                // Turnaround + data phase still happen, the target just ignores them
+                sim->line_state = SIM_LINE_SKIP;
+            } else {
+                sim->line_state = SIM_LINE_TRN_IDLE;
+            }
+            break;
+        case SIM_LINE_READ_DATA:
+            driven = 1;
+            line = sim->nbits < 32 ? (int) ((sim->rdata >> sim->nbits) & 1) : sim->rparity;
+            if(++sim->nbits == 33) {
+                sim->line_state = SIM_LINE_TRN_IDLE;
+            }
+            break;
+        case SIM_LINE_TRN_WRITE:
+            sim->nbits = 0;
+            sim->wdata = 0;
+            sim->line_state = SIM_LINE_WRITE_DATA;
+            break;
+        case SIM_LINE_WRITE_DATA:
+            if(sim->nbits < 32) {
+                sim->wdata |= (uint32_t) mosi << sim->nbits;
+            } else {
+                sim->wparity = mosi;
+            }
+            if(++sim->nbits == 33) {
+                sim->line_state = SIM_LINE_IDLE;
+                finish_write(sim);
+            }
+            break;
+        case SIM_LINE_TRN_IDLE:
+            sim->line_state = SIM_LINE_IDLE;
+            break;
+        case SIM_LINE_SKIP:
+            if(++sim->nbits == 34) {
+                sim->line_state = SIM_LINE_IDLE;
+            }
+            break;
+        case SIM_LINE_LOCKOUT:
+            break;
+    }
+
+    if(driven || !mosi) {
+        sim->ones = 0;
+    } else {
+        sim->ones++;
+    }
+    sim->stats.bits++;
+    return line;
+}
+
+void sim_nrf_set_clock(SimNRF52* sim, unsigned int speed, int in_rising, int out_rising) {
+    sim->spi_speed = speed;
+    sim->spi_in_rising = in_rising;
+    sim->spi_out_rising = out_rising;
+}
+
+static double bit_error_rate(SimNRF52* sim) {
+    unsigned int limit = sim->min_speed << (!sim->spi_in_rising + !sim->spi_out_rising);
+    if(sim->spi_speed >= limit) {
+        return 0;
+    }
+    // 1% per bit at a divisor of 0, a lot less just under the limit
+    return 0.01 * (limit - sim->spi_speed) / (limit + 1);
+}
+
+static int sim_transport_io(void* ctx, const uint32_t* mosi, uint32_t* miso, const unsigned int* lengths, unsigned int n) {
+    SimNRF52* sim = ctx;
+    unsigned int i, j;
+    double error_rate = bit_error_rate(sim);
+    sim->stats.bursts++;
+    for(i = 0; i < n; i++) {
+        uint32_t in = 0;
+        if(lengths[i] == 0 || lengths[i] > 24) {
+            printf("sim: invalid SPI word length %u\n", lengths[i]);
+            return 1;
+        }
+        for(j = 0; j < lengths[i]; j++) {
+            int out = (mosi[i] >> j) & 1;
+            int bit;
+            if(sim_chance(sim, error_rate)) {
+                out = !out;
+            }
+            bit = sim_nrf_clock_bit(sim, out);
+            if(sim_chance(sim, error_rate)) {
+                bit = !bit;
+            }
+            in |= (uint32_t) bit << j;
+        }
+        miso[i] = in;
+        sim->stats.words++;
+    }
+    return 0;
+}
+
+SPITransport sim_nrf_transport(SimNRF52* sim) {
+    SPITransport transport = {
+        .name = "sim",
+        .io = sim_transport_io,
+        .ctx = sim
+    };
+    return transport;
+}
+
+void sim_nrf_print_stats(SimNRF52* sim) {
+    SimNRF52Stats* s = &sim->stats;
+    printf("sim: %" PRIu64 " bursts, %" PRIu64 " words, %" PRIu64 " bits, %" PRIu64 " transactions\n",
+           s->bursts, s->words, s->bits, s->transactions);
+    printf("sim: %" PRIu64 " WAIT, %" PRIu64 " FAULT, %" PRIu64 " injected parity errors, "
+           "%" PRIu64 " write parity errors, %" PRIu64 " protocol errors, %" PRIu64 " line resets\n",
+           s->ack_wait, s->ack_fault, s->parity_errors_injected, s->write_parity_errors,
+           s->protocol_errors, s->line_resets);
+    printf("sim: %" PRIu64 " flash word writes, %" PRIu64 " page erases, %" PRIu64 " full erases\n",
+           s->flash_writes, s->page_erases, s->full_erases);
+    printf("sim: %" PRIu64 " core instructions\n", s->core_steps);
+}
+
+int sim_nrf_load_flash(SimNRF52* sim, const char* path) {
+    // Missing file is fine, the flash just stays blank
+    FILE* fp = fopen(path, "rb");
+    if(!fp) {
+        return 0;
+    }
+    size_t n = fread(sim->flash, 1, SIM_NRF_FLASH_SIZE, fp);
+    int err = ferror(fp);
+    fclose(fp);
+    return err || n != SIM_NRF_FLASH_SIZE;
+}
+
+int sim_nrf_save_flash(SimNRF52* sim, const char* path) {
+    FILE* fp = fopen(path, "wb");
+    if(!fp) {
+        return 1;
+    }
+    int err = fwrite(sim->flash, SIM_NRF_FLASH_SIZE, 1, fp) != 1;
+    err |= fclose(fp) != 0;
+    return err;
+}
@@ -0,0 +1,122 @@
+#ifndef RASBERRY_PINE_SIM_NRF_H
+#define RASBERRY_PINE_SIM_NRF_H
+#include <inttypes.h>
+#include "rbpi.h"
+
+// Software model of an nRF52832 as seen from the SWD line.
+// It's fed the bits that go out on the wire one at a time so it doesn't care
+// how the host chops its frames into SPI words. It knows about the DP,
+// the CTRL-AP (APSEL=1), the AHB MEM-AP (APSEL=0), flash, RAM and the NVMC.
+
+#define SIM_NRF_DPIDR 0x2BA01477
+#define SIM_NRF_MEM_AP_IDR 0x24770011
+#define SIM_NRF_CTRL_AP_IDR 0x02880000
+#define SIM_NRF_FLASH_SIZE 0x80000
+#define SIM_NRF_PAGE_SIZE 0x1000
+#define SIM_NRF_UICR_BASE 0x10001000
+#define SIM_NRF_UICR_SIZE 0x400
+#define SIM_NRF_RAM_BASE 0x20000000
+#define SIM_NRF_RAM_SIZE 0x10000
+
+typedef struct SimNRF52Stats {
+    uint64_t bursts; // Number of times the transport was asked to do IO
+    uint64_t words;  // Number of SPI FIFO entries
+    uint64_t bits;   // Number of bits clocked
+    uint64_t transactions;
+    uint64_t ack_wait;
+    uint64_t ack_fault;
+    uint64_t parity_errors_injected;
+    uint64_t write_parity_errors;
+    uint64_t protocol_errors;
+    uint64_t line_resets;
+    uint64_t flash_writes;
+    uint64_t page_erases;
+    uint64_t full_erases;
+    uint64_t core_steps;
+} SimNRF52Stats;
+
+// Just enough of a Cortex-M4 to run the little RAM stubs in flash_stub.c,
+// see sim_core.c. Real firmware isn't emulated, after a reset the core counts as
+// "running firmware" and does nothing.
+enum SimCoreState {
+    SIM_CORE_FIRMWARE = 0,
+    SIM_CORE_HALTED,
+    SIM_CORE_RUNNING,
+    SIM_CORE_LOCKUP     // Hit something sim_core.c doesn't know how to run
+};
+
+typedef struct SimCore {
+    int state;
+    uint32_t regs[17];  // r0-r12, sp, lr, pc, xPSR (DCRSR numbering)
+    uint32_t dhcsr;     // Control bits only, status is worked out when read
+    uint32_t dcrdr;
+    uint32_t vtor;      // Only kept so it reads back, exceptions aren't modelled
+} SimCore;
+
+typedef struct SimNRF52 {
+    // Knobs, both are probabilities per transaction in [0, 1]
+    double wait_rate;           // AP accesses and RDBUFF reads answered with ACK_WAIT
+    double parity_error_rate;   // Read data sent back with the wrong parity bit
+    uint32_t rng_state;
+    int approtect;
+    unsigned int core_steps;    // Instructions the core runs per SWD transaction
+    unsigned int nvmc_write_time; // Transactions a flash word write keeps the NVMC busy for
+    uint32_t deviceid[2];       // FICR DEVICEID, set it to something else to swap the watch
+    // A stand-in for the cable. SPI clock divisors below min_speed start flipping bits,
+    // more so the further below it they are. Sampling on the other edge (either
+    // direction) halves how fast the line can go. 0 means the line is perfect.
+    unsigned int min_speed;
+    unsigned int spi_speed;
+    int spi_in_rising;
+    int spi_out_rising;
+
+    // Line state
+    int line_state;
+    unsigned int nbits;
+    unsigned int ones;
+    uint8_t header;
+    uint8_t ack;
+    uint32_t rdata;
+    int rparity;
+    uint32_t wdata;
+    int wparity;
+    int reset_state; // Set after a line reset until the DPIDR is read
+
+    // DP
+    uint32_t ctrlstat;
+    uint32_t select;
+    uint32_t rdbuff;
+    uint32_t last_read;
+
+    // CTRL-AP
+    uint32_t ctrl_ap_reset;
+
+    // MEM-AP
+    uint32_t csw;
+    uint32_t tar;
+
+    // NVMC and memories
+    uint32_t nvmc_config;
+    unsigned int nvmc_busy;     // Transactions until the current write is done
+    uint32_t* flash;
+    uint32_t* uicr;
+    uint32_t* ram;
+
+    SimCore core;
+    SimNRF52Stats stats;
+} SimNRF52;
+
+SimNRF52* sim_nrf_create();
+void sim_nrf_destroy(SimNRF52* sim);
+int sim_nrf_clock_bit(SimNRF52* sim, int mosi);
+int sim_nrf_bus_read(SimNRF52* sim, uint32_t addr, uint32_t* value);
+int sim_nrf_bus_write(SimNRF52* sim, uint32_t addr, uint32_t value);
+SPITransport sim_nrf_transport(SimNRF52* sim);
+// What the AUX SPI clock would be set to, only matters with min_speed set
+void sim_nrf_set_clock(SimNRF52* sim, unsigned int speed, int in_rising, int out_rising);
+void sim_core_run(SimNRF52* sim, unsigned int steps);
+void sim_nrf_print_stats(SimNRF52* sim);
+// Raw dump of the whole flash, so a "watch" can outlive one run
+int sim_nrf_load_flash(SimNRF52* sim, const char* path);
+int sim_nrf_save_flash(SimNRF52* sim, const char* path);
+#endif
@@ -1,17 +1,52 @@
 #include "swd.h"
+#include "metrics.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "common_utils.h"
 
+// Every possible header, indexed by APnDP | RnW<<1 | A[3:2]<<2.
+// Start bit, APnDP, RnW, A[3:2], parity, stop bit and park bit, LSB first.
+static const uint8_t header_table[16] = {
+    0x81, 0xA3, 0xA5, 0x87, 0xA9, 0x8B, 0x8D, 0xAF,
+    0xB1, 0x93, 0x95, 0xB7, 0x99, 0xBB, 0xBD, 0x9F
+};
+
+// 1 if the byte has an odd number of bits set
+static const uint8_t odd_parity_table[256] = {
+    0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+    1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+    1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+    0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+    1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+    0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+    0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+    1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+    1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+    0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+    0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+    1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+    0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+    1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+    1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
+    0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+};
+
+int swd_parity32(uint32_t word) {
+    // The SWD parity bit, i.e. 1 if the word has an odd number of bits set
+    word ^= word >> 16;
+    word ^= word >> 8;
+    return odd_parity_table[word & 0xFF];
+}
+
 uint8_t create_header_word(SWD_Header header_values) {
-    uint8_t word = 0x81; // Start bit and park bit
-    int parity_bit;
-    word |= header_values.APnDP ? (1<<1) : 0;
-    word |= header_values.RnW ? (1<<2) : 0;
-    word |= ((header_values.addr>>2) & 0x3) << 3;
-
-    // Parity bit is determined from the APnDP, RnW and addr bits.
-    parity_bit = has_even_parity(word & 0x1E, 8);
-    word |= parity_bit ? 0 :  1<<5;
-    return word;
+    unsigned int index = header_values.APnDP ? 1 : 0;
+    index |= header_values.RnW ? 2 : 0;
+    index |= ((header_values.addr >> 2) & 0x3) << 2;
+    return header_table[index];
 }
 
 DPIDR_Reg interpret_dp_idr_reg(uint32_t word) {
@@ -280,3 +315,287 @@ SWD_Packet swd_read_ap_idcode() {
     ret.debug_string = "READ AP ID Code Reg\n";
     return ret;
 }
+
+void swd_stream_init(SWD_Bitstream* stream) {
+    stream->nbits = 0;
+    stream->bits[0] = 0;
+}
+
+void swd_stream_append(SWD_Bitstream* stream, uint32_t value, unsigned int n) {
+    // Appends the low 'n' bits of value, LSB first
+    assert(n <= 32);
+    assert(stream->nbits + n <= SWD_STREAM_MAX_BITS);
+    if(n == 0) {
+        return;
+    }
+    if(n < 32) {
+        value &= (1u << n) - 1;
+    }
+    unsigned int word = stream->nbits / 32;
+    unsigned int shift = stream->nbits % 32;
+    if(shift == 0) {
+        stream->bits[word] = 0;
+    }
+    stream->bits[word] |= value << shift;
+    if(shift + n > 32) {
+        stream->bits[word+1] = value >> (32 - shift);
+    }
+    stream->nbits += n;
+}
+
+uint32_t swd_stream_extract(const SWD_Bitstream* stream, unsigned int offset, unsigned int n) {
+    assert(n <= 32);
+    assert(offset + n <= stream->nbits);
+    if(n == 0) {
+        return 0;
+    }
+    unsigned int word = offset / 32;
+    unsigned int shift = offset % 32;
+    uint64_t bits = stream->bits[word] >> shift;
+    if(shift + n > 32) {
+        bits |= (uint64_t) stream->bits[word+1] << (32 - shift);
+    }
+    return n < 32 ? (uint32_t) bits & ((1u << n) - 1) : (uint32_t) bits;
+}
+
+void swd_stream_append_request(SWD_Bitstream* stream, SWD_Header header, SWD_FrameOffsets* offsets) {
+    // Header, turnaround and the 3 ACK bits (+ the turnaround back for a write).
+    // The host drives 1s where the target is expected to be driving.
+    swd_stream_append(stream, create_header_word(header), 8);
+    swd_stream_append(stream, 0x1, 1);
+    offsets->ack = stream->nbits;
+    swd_stream_append(stream, 0x7, 3);
+    if(!header.RnW) {
+        swd_stream_append(stream, 0x1, 1);
+    }
+    offsets->end = stream->nbits;
+}
+
+void swd_stream_append_data(SWD_Bitstream* stream, const SWD_Packet* packet, SWD_FrameOffsets* offsets) {
+    // The 32 data bits and parity. For a read it's all 1s as a pull-up, the target
+    // does the actual work.
+    offsets->data = stream->nbits;
+    if(packet->header.RnW) {
+        swd_stream_append(stream, 0xFFFFFFFF, 32);
+        swd_stream_append(stream, 0x1, 1);
+    } else {
+        swd_stream_append(stream, packet->data, 32);
+        swd_stream_append(stream, swd_parity32(packet->data), 1);
+    }
+    offsets->end = stream->nbits;
+}
+
+void swd_stream_append_packet(SWD_Bitstream* stream, const SWD_Packet* packet, SWD_FrameOffsets* offsets) {
+    swd_stream_append_request(stream, packet->header, offsets);
+    swd_stream_append_data(stream, packet, offsets);
+}
+
+unsigned int swd_stream_slice(const SWD_Bitstream* stream, uint32_t* mosi, unsigned int* lengths) {
+    // Fewest FIFO entries is just full 24 bit words with whatever's left over at the end
+    unsigned int n = 0;
+    unsigned int offset = 0;
+    while(offset < stream->nbits) {
+        unsigned int len = stream->nbits - offset;
+        if(len > SWD_SPI_WORD_BITS) {
+            len = SWD_SPI_WORD_BITS;
+        }
+        mosi[n] = swd_stream_extract(stream, offset, len);
+        lengths[n] = len;
+        offset += len;
+        n++;
+    }
+    return n;
+}
+
+void swd_stream_gather(SWD_Bitstream* stream, const uint32_t* miso, const unsigned int* lengths, unsigned int n) {
+    // Puts the words read back from the SPI RX FIFO back into one bitstream
+    unsigned int i;
+    swd_stream_init(stream);
+    for(i = 0; i < n; i++) {
+        swd_stream_append(stream, miso[i], lengths[i]);
+    }
+}
+
+SWD_Op swd_op_transfer(int APnDP, int RnW, uint8_t addr, uint32_t data) {
+    SWD_Op op = { .kind = SWD_OP_TRANSFER, .APnDP = APnDP ? 1 : 0, .RnW = RnW ? 1 : 0, .addr = addr, .data = data };
+    return op;
+}
+
+SWD_Op swd_op_line_reset() {
+    SWD_Op op = { .kind = SWD_OP_LINE_RESET };
+    return op;
+}
+
+SWD_Op swd_op_jtag_to_swd() {
+    SWD_Op op = { .kind = SWD_OP_JTAG_TO_SWD };
+    return op;
+}
+
+static uint32_t ops_fingerprint(const SWD_Op* ops, unsigned int n_ops) {
+    // FNV-1a over the fields (not the struct, that has padding in it)
+    uint32_t hash = 2166136261u;
+    unsigned int i, j;
+    for(i = 0; i < n_ops; i++) {
+        uint8_t bytes[8] = {
+            ops[i].kind, ops[i].APnDP, ops[i].RnW, ops[i].addr,
+            ops[i].data & 0xFF, (ops[i].data >> 8) & 0xFF, (ops[i].data >> 16) & 0xFF, ops[i].data >> 24
+        };
+        for(j = 0; j < sizeof(bytes); j++) {
+            hash = (hash ^ bytes[j]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+int swd_compile_program(const SWD_Op* ops, unsigned int n_ops, SWD_Program* program) {
+    /* Lays the ops out back to back in one bitstream, the same way perform_swd_io
+     * does a speculative transaction (request, ACK, data, 8 idles), and slices it into
+     * SPI words. Returns 1 if the ops don't fit in a program.
+     */
+    SWD_Bitstream stream;
+    unsigned int i;
+    if(n_ops > SWD_PROGRAM_MAX_OPS) {
+        return 1;
+    }
+    swd_stream_init(&stream);
+    for(i = 0; i < n_ops; i++) {
+        const SWD_Op* op = &ops[i];
+        SWD_FrameOffsets* offsets = &program->offsets[i];
+        unsigned int needed = op->kind == SWD_OP_TRANSFER ? 8 + 5 + 33 + SWD_IDLE_BITS : 72 + 16 + 8;
+        if(stream.nbits + needed > SWD_STREAM_MAX_BITS) {
+            return 1;
+        }
+        memset(offsets, 0, sizeof(*offsets));
+        switch(op->kind) {
+            case SWD_OP_LINE_RESET:
+                // Same as swd_protocol_reset, >50 high then some idles
+                swd_stream_append(&stream, 0xFFFFFFFF, 32);
+                swd_stream_append(&stream, 0xFFFFFFFF, 32);
+                swd_stream_append(&stream, 0xFF, 8);
+                swd_stream_append(&stream, 0x0, 8);
+                break;
+            case SWD_OP_JTAG_TO_SWD:
+                swd_stream_append(&stream, 0xFFFFFFFF, 32);
+                swd_stream_append(&stream, 0xFFFFFFFF, 32);
+                swd_stream_append(&stream, 0xFF, 8);
+                swd_stream_append(&stream, SWD_JTAG_TO_SWD_SEQ, SWD_JTAG_TO_SWD_SEQ_LEN);
+                break;
+            default: {
+                unsigned int index = op->APnDP | (op->RnW << 1) | (((op->addr >> 2) & 0x3) << 2);
+                swd_stream_append(&stream, header_table[index], 8);
+                swd_stream_append(&stream, 0x1, 1); // Turnaround
+                offsets->ack = stream.nbits;
+                swd_stream_append(&stream, 0x7, 3);
+                if(op->RnW) {
+                    offsets->data = stream.nbits;
+                    swd_stream_append(&stream, 0xFFFFFFFF, 32);
+                    swd_stream_append(&stream, 0x1, 1);
+                } else {
+                    swd_stream_append(&stream, 0x1, 1); // Turnaround
+                    offsets->data = stream.nbits;
+                    swd_stream_append(&stream, op->data, 32);
+                    swd_stream_append(&stream, swd_parity32(op->data), 1);
+                }
+                swd_stream_append(&stream, 0x0, SWD_IDLE_BITS);
+                break;
+            }
+        }
+        offsets->end = stream.nbits;
+        program->ops[i] = *op;
+    }
+    program->n_ops = n_ops;
+    program->n_words = swd_stream_slice(&stream, program->mosi, program->lengths);
+    program->fingerprint = ops_fingerprint(ops, n_ops);
+    return 0;
+}
+
+#define SWD_PROGRAM_MAGIC 0x50445753 // "SWDP"
+#define SWD_PROGRAM_VERSION 1
+
+int swd_program_save(const SWD_Program* program, const char* path) {
+    // The file is just a small header followed by the program struct itself,
+    // it's only a cache so it doesn't need to survive moving between machines.
+    uint32_t header[3] = { SWD_PROGRAM_MAGIC, SWD_PROGRAM_VERSION, sizeof(SWD_Program) };
+    FILE* fp = fopen(path, "wb");
+    if(!fp) {
+        return 1;
+    }
+    int err = fwrite(header, sizeof(header), 1, fp) != 1 || fwrite(program, sizeof(*program), 1, fp) != 1;
+    err |= fclose(fp) != 0;
+    return err;
+}
+
+int swd_program_load(SWD_Program* program, const char* path, const SWD_Op* ops, unsigned int n_ops) {
+    // Returns 0 only if the file exists and was compiled from exactly these ops
+    uint32_t header[3];
+    FILE* fp = fopen(path, "rb");
+    if(!fp) {
+        return 1;
+    }
+    int err = fread(header, sizeof(header), 1, fp) != 1 || fread(program, sizeof(*program), 1, fp) != 1;
+    fclose(fp);
+    if(err || header[0] != SWD_PROGRAM_MAGIC || header[1] != SWD_PROGRAM_VERSION || header[2] != sizeof(SWD_Program)) {
+        return 1;
+    }
+    if(program->n_ops != n_ops || program->fingerprint != ops_fingerprint(ops, n_ops) || program->n_words > SWD_STREAM_MAX_WORDS) {
+        return 1;
+    }
+    return 0;
+}
+
+int swd_cache_path(const char* file, char* path, size_t size) {
+    // $RBPI_CACHE_DIR, or $XDG_CACHE_HOME/raspberry_pine, or ~/.cache/raspberry_pine.
+    // A path that doesn't fit means no cache rather than one somewhere else.
+    const char* dir = getenv("RBPI_CACHE_DIR");
+    char dir_buf[PATH_MAX];
+    if(!dir) {
+        if(getenv("XDG_CACHE_HOME")) {
+            if(snprintf(dir_buf, sizeof(dir_buf), "%s/raspberry_pine", getenv("XDG_CACHE_HOME")) >= (int) sizeof(dir_buf)) {
+                return 1;
+            }
+        } else if(getenv("HOME")) {
+            char parent[PATH_MAX];
+            if(snprintf(parent, sizeof(parent), "%s/.cache", getenv("HOME")) >= (int) sizeof(parent)) {
+                return 1;
+            }
+            mkdir(parent, 0755);
+            if(snprintf(dir_buf, sizeof(dir_buf), "%s/raspberry_pine", parent) >= (int) sizeof(dir_buf)) {
+                return 1;
+            }
+        } else {
+            return 1;
+        }
+        dir = dir_buf;
+    }
+    mkdir(dir, 0755); // Fine if it's already there
+    return snprintf(path, size, "%s/%s", dir, file) >= (int) size;
+}
+
+static int program_cache_path(const char* name, char* path, size_t size) {
+    char file[256];
+    if(snprintf(file, sizeof(file), "%s.swdp", name) >= (int) sizeof(file)) {
+        return 1;
+    }
+    return swd_cache_path(file, path, size);
+}
+
+int swd_program_load_or_compile(const char* name, const SWD_Op* ops, unsigned int n_ops, SWD_Program* program) {
+    /* Uses the cached copy of the program if there is one that matches the ops,
+     * otherwise compiles it and tries to cache the result. Not being able to write
+     * the cache isn't an error.
+     */
+    char path[PATH_MAX];
+    int have_path = !program_cache_path(name, path, sizeof(path));
+    if(have_path && !swd_program_load(program, path, ops, n_ops)) {
+        metric_inc(METRIC_SWD_PROGRAM_CACHE_HIT);
+        return 0;
+    }
+    metric_inc(METRIC_SWD_PROGRAM_CACHE_MISS);
+    if(swd_compile_program(ops, n_ops, program)) {
+        return 1;
+    }
+    if(have_path) {
+        swd_program_save(program, path);
+    }
+    return 0;
+}
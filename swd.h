@@ -1,6 +1,7 @@
 #ifndef RASBERRY_PINE_SWD_H
 #define RASBERRY_PINE_SWD_H
 #include <inttypes.h>
+#include <stddef.h>
 #include "common_utils.h"
 
 #define ACK_OK 0b001
@@ -12,7 +13,8 @@ enum SWD_ERROR {
     SWD_ACK_WAIT,
     SWD_ACK_FAULT,
     SWD_ACK_UNKNOWN,
-    SWD_PARITY_MISMATCH
+    SWD_PARITY_MISMATCH,
+    SWD_NOT_RUN // Queued but never sent because something before it failed, see swd_flush
 };
 
 #define SWD_DPIDR_ADDR 0x0
@@ -31,7 +33,9 @@ enum SWD_ERROR {
 #define DRW_OFFSET 0xC
 #define NVMC_OFFSET 0x4001E000
 #define NVMC_CONFIG_OFFSET 0x504
+#define NVMC_ERASEPAGE 0x508
 #define NVMC_ERASEALL 0x50C
+#define NVMC_READY_OFFSET 0x400
 
 typedef struct SWD_DPIDR_Reg {
     uint32_t revision;
@@ -108,6 +112,75 @@ typedef struct SWD_Packet {
     uint32_t parity;
 } SWD_Packet;
 
+// Bitstream for packing any number of SWD frames back to back and slicing them
+// into as few variable width (<= 24 bit) AUX SPI FIFO entries as possible.
+// Bits are kept in wire order, bit 0 of bits[0] goes out first.
+#define SWD_IDLE_BITS 8
+#define SWD_SPI_WORD_BITS 24
+#define SWD_STREAM_MAX_BITS 4096
+#define SWD_STREAM_MAX_WORDS ((SWD_STREAM_MAX_BITS + SWD_SPI_WORD_BITS - 1) / SWD_SPI_WORD_BITS)
+
+typedef struct SWD_Bitstream {
+    uint32_t bits[SWD_STREAM_MAX_BITS/32];
+    unsigned int nbits;
+} SWD_Bitstream;
+
+// Where the interesting parts of a frame ended up in a bitstream
+typedef struct SWD_FrameOffsets {
+    unsigned int ack;  // 3 ACK bits
+    unsigned int data; // 32 data bits followed by the parity bit
+    unsigned int end;  // First bit after the frame
+} SWD_FrameOffsets;
+
+void swd_stream_init(SWD_Bitstream* stream);
+void swd_stream_append(SWD_Bitstream* stream, uint32_t value, unsigned int n);
+void swd_stream_append_request(SWD_Bitstream* stream, SWD_Header header, SWD_FrameOffsets* offsets);
+void swd_stream_append_data(SWD_Bitstream* stream, const SWD_Packet* packet, SWD_FrameOffsets* offsets);
+void swd_stream_append_packet(SWD_Bitstream* stream, const SWD_Packet* packet, SWD_FrameOffsets* offsets);
+unsigned int swd_stream_slice(const SWD_Bitstream* stream, uint32_t* mosi, unsigned int* lengths);
+void swd_stream_gather(SWD_Bitstream* stream, const uint32_t* miso, const unsigned int* lengths, unsigned int n);
+uint32_t swd_stream_extract(const SWD_Bitstream* stream, unsigned int offset, unsigned int n);
+
+// Compiled sequences. A list of operations gets turned into a ready to send array of
+// SPI words once, and can then be replayed as many times as needed (or saved to disk)
+// without any encoding work. Transfers are laid out assuming every ACK is OK.
+enum SWD_OP_KIND {
+    SWD_OP_TRANSFER = 0,
+    SWD_OP_LINE_RESET,
+    SWD_OP_JTAG_TO_SWD
+};
+
+typedef struct SWD_Op {
+    uint8_t kind;
+    uint8_t APnDP;
+    uint8_t RnW;
+    uint8_t addr;
+    uint32_t data;
+} SWD_Op;
+
+#define SWD_PROGRAM_MAX_OPS 64
+
+typedef struct SWD_Program {
+    uint32_t mosi[SWD_STREAM_MAX_WORDS];
+    unsigned int lengths[SWD_STREAM_MAX_WORDS];
+    unsigned int n_words;
+    unsigned int n_ops;
+    SWD_Op ops[SWD_PROGRAM_MAX_OPS];
+    SWD_FrameOffsets offsets[SWD_PROGRAM_MAX_OPS];
+    uint32_t fingerprint; // Hash of the ops, used to spot stale cache files
+} SWD_Program;
+
+SWD_Op swd_op_transfer(int APnDP, int RnW, uint8_t addr, uint32_t data);
+SWD_Op swd_op_line_reset();
+SWD_Op swd_op_jtag_to_swd();
+int swd_compile_program(const SWD_Op* ops, unsigned int n_ops, SWD_Program* program);
+int swd_program_save(const SWD_Program* program, const char* path);
+int swd_program_load(SWD_Program* program, const char* path, const SWD_Op* ops, unsigned int n_ops);
+int swd_program_load_or_compile(const char* name, const SWD_Op* ops, unsigned int n_ops, SWD_Program* program);
+// Where 'file' goes in the cache directory (made if it isn't there), 1 if there's nowhere
+int swd_cache_path(const char* file, char* path, size_t size);
+int swd_parity32(uint32_t word);
+
 SWD_Packet swd_read_dpidr_reg();
 SWD_Packet swd_read_cntrl_stat_reg();
 SWD_Packet swd_write_cntrl_stat_reg(SWD_CNTRL_STAT_Reg reg);
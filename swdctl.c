@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "nrf.h"
+#include "swdd.h"
+
+// Sends one job to swdd, see swdd.h
+//   swdctl status
+//   swdctl flash [--diff] [--loader] [--crc] image
+//   swdctl read addr [nwords]
+//   swdctl write addr word...
+//   swdctl reset
+//   swdctl run image
+
+static int connect_to(const char* path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if(fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        printf("Could not connect to swdd on '%s'\n", path);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const void* buf, size_t n) {
+    const char* p = buf;
+    while(n) {
+        ssize_t put = write(fd, p, n);
+        if(put <= 0) {
+            return 1;
+        }
+        p += put;
+        n -= put;
+    }
+    return 0;
+}
+
+static int receive_all(int fd, void* buf, size_t n) {
+    char* p = buf;
+    while(n) {
+        ssize_t got = read(fd, p, n);
+        if(got <= 0) {
+            return 1;
+        }
+        p += got;
+        n -= got;
+    }
+    return 0;
+}
+
+static int usage(const char* name) {
+    printf("Usage: %s [--socket path] status|reset\n", name);
+    printf("       %s flash [--diff] [--loader] [--crc] image\n", name);
+    printf("       %s run image\n", name);
+    printf("       %s read addr [nwords]\n", name);
+    printf("       %s write addr word...\n", name);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    static struct option long_options[] = {
+        {"socket", required_argument, NULL, 's'},
+        {"diff", no_argument, NULL, 'd'},
+        {"loader", no_argument, NULL, 'l'},
+        {"crc", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* path = swdd_socket_path();
+    SWDDRequest request;
+    uint32_t* payload = NULL;
+    size_t payload_size = 0;
+    char image_path[PATH_MAX];
+    int opt, i;
+    memset(&request, 0, sizeof(request));
+    while((opt = getopt_long(argc, argv, "s:dlc", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 's': path = optarg; break;
+            case 'd': request.flags |= NRF_FLASH_DIFF; break;
+            case 'l': request.flags |= NRF_FLASH_LOADER; break;
+            case 'c': request.flags |= NRF_FLASH_CRC; break;
+            default: return usage(argv[0]);
+        }
+    }
+    if(optind >= argc) {
+        return usage(argv[0]);
+    }
+    const char* command = argv[optind];
+    int nargs = argc - optind - 1;
+    char** args = argv + optind + 1;
+
+    if(strcmp(command, "status") == 0 && nargs == 0) {
+        request.op = SWDD_OP_STATUS;
+    } else if(strcmp(command, "reset") == 0 && nargs == 0) {
+        request.op = SWDD_OP_RESET;
+    } else if((strcmp(command, "flash") == 0 || strcmp(command, "run") == 0) && nargs == 1) {
+        // swdd has a different working directory
+        if(!realpath(args[0], image_path)) {
+            printf("Could not find '%s'\n", args[0]);
+            return 1;
+        }
+        request.op = strcmp(command, "run") == 0 ? SWDD_OP_RUN : SWDD_OP_FLASH;
+        request.count = strlen(image_path);
+        payload = (uint32_t*) image_path;
+        payload_size = request.count;
+    } else if(strcmp(command, "read") == 0 && (nargs == 1 || nargs == 2)) {
+        request.op = SWDD_OP_READ;
+        request.addr = strtoul(args[0], NULL, 0);
+        request.count = nargs == 2 ? strtoul(args[1], NULL, 0) : 1;
+    } else if(strcmp(command, "write") == 0 && nargs >= 2 && nargs - 1 <= SWDD_MAX_WORDS) {
+        request.op = SWDD_OP_WRITE;
+        request.addr = strtoul(args[0], NULL, 0);
+        request.count = nargs - 1;
+        payload = malloc(request.count * 4);
+        for(i = 0; i < nargs - 1; i++) {
+            payload[i] = strtoul(args[i + 1], NULL, 0);
+        }
+        payload_size = request.count * 4;
+    } else {
+        return usage(argv[0]);
+    }
+
+    int fd = connect_to(path);
+    SWDDResponse response;
+    if(fd < 0) {
+        return 1;
+    }
+    if(send_all(fd, &request, sizeof(request)) || (payload_size && send_all(fd, payload, payload_size)) ||
+       receive_all(fd, &response, sizeof(response))) {
+        printf("Lost the connection to swdd\n");
+        return 1;
+    }
+    if(response.count > SWDD_MAX_WORDS) {
+        printf("swdd sent back %u words, more than a job can have\n", response.count);
+        return 1;
+    }
+    uint32_t* words = malloc(response.count * 4 + 4);
+    if(!words || receive_all(fd, words, response.count * 4)) {
+        printf("Lost the connection to swdd\n");
+        return 1;
+    }
+    close(fd);
+
+    if(response.status != SWDD_OK) {
+        printf("%s: %s (%.3f s)\n", command, swdd_status_name(response.status), response.elapsed_us * 1e-6);
+        return 1;
+    }
+    if(request.op == SWDD_OP_STATUS) {
+        printf("connected, DPIDR = 0x%08x, %u jobs, %u reconnects\n", words[0], words[1], words[2]);
+    } else if(request.op == SWDD_OP_READ) {
+        for(i = 0; i < (int) response.count; i++) {
+            if(i % 4 == 0) {
+                printf("%s0x%08x:", i ? "\n" : "", request.addr + i*4);
+            }
+            printf(" %08x", words[i]);
+        }
+        printf("\n");
+    } else {
+        printf("%s: ok (%.3f s)\n", command, response.elapsed_us * 1e-6);
+    }
+    return 0;
+}
@@ -0,0 +1,326 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "common_utils.h"
+#include "rbpi.h"
+#include "swd.h"
+#include "dap.h"
+#include "transport.h"
+#include "metrics.h"
+#include "image.h"
+#include "nrf.h"
+#include "swdd.h"
+
+// The SWD daemon, see swdd.h for the protocol. Jobs run one at a time in the order
+// they come in, so there's only ever one thing talking to the watch. Before each job
+// the DPIDR and FICR DEVICEID are read back to check the watch is still the one it
+// connected to, if it isn't (unplugged, swapped for the next one on the fixture, ...)
+// it does the full connect again.
+
+typedef struct Session {
+    SPIRegisters spi_registers;
+    int connected;
+    uint32_t dpidr;
+    uint32_t deviceid[2];
+    uint64_t jobs;
+    uint64_t reconnects;
+} Session;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig) {
+    (void) sig;
+    stopping = 1;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int read_full(int fd, void* buf, size_t n) {
+    uint8_t* p = buf;
+    while(n) {
+        ssize_t got = read(fd, p, n);
+        if(got < 0 && errno == EINTR) {
+            continue;
+        }
+        if(got <= 0) {
+            return 1;
+        }
+        p += got;
+        n -= got;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void* buf, size_t n) {
+    const uint8_t* p = buf;
+    while(n) {
+        ssize_t put = write(fd, p, n);
+        if(put < 0 && errno == EINTR) {
+            continue;
+        }
+        if(put <= 0) {
+            return 1;
+        }
+        p += put;
+        n -= put;
+    }
+    return 0;
+}
+
+static int link_ok(Session* session) {
+    // Every nRF52832 has the same DPIDR, so that only says some watch answers. DEVICEID
+    // says it's the same one. A handful of transactions, cheap enough to do before every job.
+    SWD_Packet read_idr_packet = swd_read_dpidr_reg();
+    uint32_t deviceid[2];
+    int err, tries = 0;
+    while((err = perform_swd_io(session->spi_registers, &read_idr_packet)) == SWD_PARITY_MISMATCH && tries++ < 8);
+    if(err || read_idr_packet.data != session->dpidr || nrf_select_mem_ap(session->spi_registers) ||
+       mem_ap_read_block(session->spi_registers, FICR_DEVICEID, deviceid, 2)) {
+        return 0;
+    }
+    return deviceid[0] == session->deviceid[0] && deviceid[1] == session->deviceid[1];
+}
+
+static int connect_target(Session* session) {
+    // Remembers what link_ok checks against
+    return nrf_connect(session->spi_registers, &session->dpidr) ||
+           mem_ap_read_block(session->spi_registers, FICR_DEVICEID, session->deviceid, 2);
+}
+
+static int ensure_connected(Session* session) {
+    if(session->connected && link_ok(session)) {
+        return 0;
+    }
+    if(session->connected) {
+        printf("Lost the target, reconnecting\n");
+        session->reconnects++;
+    }
+    session->connected = !connect_target(session);
+    return !session->connected;
+}
+
+static int32_t image_job(Session* session, int fd, const SWDDRequest* request) {
+    // Flash jobs and run jobs, both just have a path for a payload
+    char path[SWDD_MAX_PATH + 1];
+    Image image;
+    int32_t status = SWDD_OK;
+    if(request->count == 0 || request->count > SWDD_MAX_PATH || read_full(fd, path, request->count)) {
+        return SWDD_BAD_REQUEST;
+    }
+    path[request->count] = 0;
+    printf("%s '%s'\n", request->op == SWDD_OP_RUN ? "run" : "flash", path);
+    if(image_open(path, &image)) {
+        return SWDD_BAD_IMAGE;
+    }
+    if(request->op != SWDD_OP_RUN && !image_fits(&image)) {
+        status = SWDD_BAD_IMAGE;
+    } else if(ensure_connected(session)) {
+        status = SWDD_NO_TARGET;
+    } else if(request->op == SWDD_OP_RUN) {
+        status = nrf_run_in_ram(session->spi_registers, &image) ? SWDD_JOB_FAILED : SWDD_OK;
+    } else if(nrf_flash_image(session->spi_registers, &image, request->flags & (NRF_FLASH_DIFF | NRF_FLASH_LOADER | NRF_FLASH_CRC))) {
+        status = SWDD_JOB_FAILED;
+    }
+    image_close(&image);
+    return status;
+}
+
+static int32_t run_job(Session* session, int fd, const SWDDRequest* request, uint32_t* words, uint32_t* n_words) {
+    *n_words = 0;
+    switch(request->op) {
+        case SWDD_OP_STATUS:
+            if(ensure_connected(session)) {
+                return SWDD_NO_TARGET;
+            }
+            words[0] = session->dpidr;
+            words[1] = session->jobs;
+            words[2] = session->reconnects;
+            *n_words = 3;
+            return SWDD_OK;
+        case SWDD_OP_FLASH:
+        case SWDD_OP_RUN:
+            return image_job(session, fd, request);
+        case SWDD_OP_READ:
+            if(request->count == 0 || request->count > SWDD_MAX_WORDS || (request->addr & 0x3)) {
+                return SWDD_BAD_REQUEST;
+            }
+            printf("read %u words at 0x%x\n", request->count, request->addr);
+            if(ensure_connected(session)) {
+                return SWDD_NO_TARGET;
+            }
+            if(mem_ap_read_block(session->spi_registers, request->addr, words, request->count)) {
+                return SWDD_JOB_FAILED;
+            }
+            *n_words = request->count;
+            return SWDD_OK;
+        case SWDD_OP_WRITE:
+            if(request->count == 0 || request->count > SWDD_MAX_WORDS || (request->addr & 0x3) ||
+               read_full(fd, words, request->count * 4)) {
+                return SWDD_BAD_REQUEST;
+            }
+            printf("write %u words at 0x%x\n", request->count, request->addr);
+            if(ensure_connected(session)) {
+                return SWDD_NO_TARGET;
+            }
+            return mem_ap_write_block(session->spi_registers, request->addr, words, request->count) ? SWDD_JOB_FAILED : SWDD_OK;
+        case SWDD_OP_RESET:
+            printf("reset\n");
+            if(ensure_connected(session)) {
+                return SWDD_NO_TARGET;
+            }
+            return reset_nrf(session->spi_registers) ? SWDD_JOB_FAILED : SWDD_OK;
+        default:
+            return SWDD_BAD_REQUEST;
+    }
+}
+
+// How long a client can keep swdd waiting on a read or write before it gets dropped
+#define CLIENT_TIMEOUT_S 5
+
+static void serve_client(Session* session, int fd, uint32_t* words) {
+    // Any number of jobs per connection, until the client hangs up. Jobs are served one
+    // at a time, so a client that stalls (or sends less than it said it would) would hold
+    // everyone else up, hence the timeouts.
+    struct timeval timeout = { .tv_sec = CLIENT_TIMEOUT_S, .tv_usec = 0 };
+    SWDDRequest request;
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+       setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))) {
+        printf("Could not set client timeouts\n");
+        close(fd);
+        return;
+    }
+    while(!stopping && !read_full(fd, &request, sizeof(request))) {
+        SWDDResponse response;
+        uint32_t n_words;
+        uint64_t start = now_ns();
+        response.status = run_job(session, fd, &request, words, &n_words);
+        response.count = n_words;
+        response.elapsed_us = (now_ns() - start) / 1000;
+        session->jobs++;
+        printf("job %llu: %s (%.3f s)\n", (unsigned long long) session->jobs, swdd_status_name(response.status),
+               response.elapsed_us * 1e-6);
+        if(write_full(fd, &response, sizeof(response)) || write_full(fd, words, n_words * 4)) {
+            break;
+        }
+        if(response.status == SWDD_BAD_REQUEST) {
+            // Can't tell where the next request starts any more
+            break;
+        }
+        metrics_flush(0);
+    }
+    close(fd);
+}
+
+static int listen_on(const char* path, mode_t mode) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        printf("Could not create socket\n");
+        return -1;
+    }
+    // Something still answering means another swdd, otherwise it's left over from one that died
+    if(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+        printf("swdd is already running on '%s'\n", path);
+        close(fd);
+        return -1;
+    }
+    unlink(path);
+    if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || chmod(path, mode) || listen(fd, 16)) {
+        printf("Could not listen on '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char** argv) {
+    static struct option long_options[] = {
+        {"socket", required_argument, NULL, 's'},
+        {"mode", required_argument, NULL, 'm'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* path = swdd_socket_path();
+    mode_t mode = 0660;
+    int opt;
+    while((opt = getopt_long(argc, argv, "s:m:", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 's':
+                path = optarg;
+                break;
+            case 'm':
+                // Who besides root gets to send jobs, e.g. 0666 for a CI user
+                mode = strtoul(optarg, NULL, 8);
+                break;
+            default:
+                printf("Usage: %s [--socket path] [--mode 0660]\n", argv[0]);
+                return 1;
+        }
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop; // No SA_RESTART, poll/accept need to give up on a signal
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if(nrf_load_programs()) {
+        printf("Could not compile SWD programs\n");
+        return 1;
+    }
+    uint32_t* words = malloc(SWDD_MAX_WORDS * sizeof(uint32_t));
+    int listen_fd = listen_on(path, mode);
+    if(!words || listen_fd < 0) {
+        return 1;
+    }
+
+    Session session;
+    memset(&session, 0, sizeof(session));
+    session.spi_registers = init_spi_or_die();
+    // No watch yet is fine, the first job tries again
+    session.connected = !connect_target(&session);
+    printf("swdd listening on '%s'%s\n", path, session.connected ? "" : ", no target connected yet");
+
+    while(!stopping) {
+        struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+        if(poll(&pfd, 1, 1000) <= 0) {
+            metrics_flush(0);
+            continue;
+        }
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd >= 0) {
+            serve_client(&session, fd, words);
+        }
+    }
+
+    printf("swdd stopping after %llu jobs\n", (unsigned long long) session.jobs);
+    close(listen_fd);
+    unlink(path);
+    free(words);
+    clean_up_spi();
+    return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef RASBERRY_PINE_SWDD_H
+#define RASBERRY_PINE_SWDD_H
+#include <inttypes.h>
+#include <stdlib.h>
+
+// swdd keeps one SWD session open and runs jobs for swdctl (or anything else)
+// sent over a Unix socket. Connecting to a watch costs a reset and a check of the
+// CTRL-AP, a job on an open session costs only what the job itself takes.
+//
+// Each job is one request, optionally followed by a payload, and gets one response:
+//   SWDD_OP_STATUS  -                             -> { dpidr, jobs done, reconnects }
+//   SWDD_OP_FLASH   flags, count path bytes       -> -
+//   SWDD_OP_READ    addr, count words             -> count words
+//   SWDD_OP_WRITE   addr, count words + the words -> -
+//   SWDD_OP_RESET   -                             -> -
+//   SWDD_OP_RUN     count path bytes              -> -
+// A client that keeps swdd waiting for more than a few seconds gets disconnected.
+// The image for a flash or run job is opened by swdd, so the path has to make sense to it.
+// Everything is in host byte order, it never leaves the machine.
+
+#define SWDD_DEFAULT_SOCKET "/tmp/rbpi-swdd.sock"
+#define SWDD_MAX_WORDS 0x10000  // 256KB per read/write job
+#define SWDD_MAX_PATH 4096
+
+enum SWDD_OP {
+    SWDD_OP_STATUS = 0,
+    SWDD_OP_FLASH,
+    SWDD_OP_READ,
+    SWDD_OP_WRITE,
+    SWDD_OP_RESET,
+    SWDD_OP_RUN         // Load into RAM and run, see nrf_run_in_ram
+};
+
+typedef struct SWDDRequest {
+    uint8_t op;
+    uint8_t flags;      // NRF_FLASH_* for flash jobs
+    uint16_t reserved;
+    uint32_t addr;
+    uint32_t count;
+} SWDDRequest;
+
+typedef struct SWDDResponse {
+    int32_t status;     // 0 or what went wrong, see swdd_status_name
+    uint32_t count;     // Words of payload that follow
+    uint32_t elapsed_us;
+} SWDDResponse;
+
+enum SWDD_STATUS {
+    SWDD_OK = 0,
+    SWDD_BAD_REQUEST = -1,
+    SWDD_NO_TARGET = -2,    // Couldn't (re)connect
+    SWDD_JOB_FAILED = -3,   // Anything else, swdd's log says more
+    SWDD_BAD_IMAGE = -4
+};
+
+static inline const char* swdd_socket_path() {
+    const char* path = getenv("RBPI_SWDD_SOCKET");
+    return path && *path ? path : SWDD_DEFAULT_SOCKET;
+}
+
+static inline const char* swdd_status_name(int32_t status) {
+    switch(status) {
+        case SWDD_OK: return "ok";
+        case SWDD_BAD_REQUEST: return "bad request";
+        case SWDD_NO_TARGET: return "no target";
+        case SWDD_JOB_FAILED: return "failed";
+        case SWDD_BAD_IMAGE: return "bad image";
+        default: return "?";
+    }
+}
+#endif
@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#include "common_utils.h"
+#include "rbpi.h"
+#include "swd.h"
+#include "dap.h"
+#include "transport.h"
+#include "trace.h"
+
+// Looks at the traces RBPI_TRACE=file leaves behind, see trace.h
+//   dump    one line per record, filtered by the options
+//   stats   counts and transfer time percentiles
+//   replay  runs the transfers again against the sim (or whatever RBPI_TRANSPORT says)
+//           and reports where the target answered differently and how long it all took.
+//           Transfers the target answered with WAIT/FAULT/garbage the first time never
+//           happened on the target, so they're left out.
+
+typedef struct Trace {
+    SWDTraceFileHeader header;
+    SWDTraceRecord* records;
+} Trace;
+
+typedef struct Filter {
+    int errors_only;
+    int ack;            // -1 for any
+    int port;           // -1 for any, otherwise APnDP
+    int rnw;            // -1 for any
+    int addr;           // -1 for any
+    uint32_t from, to;  // Record indices, inclusive
+} Filter;
+
+static int load_trace(const char* path, Trace* trace) {
+    FILE* fp = fopen(path, "rb");
+    if(!fp) {
+        printf("Could not open '%s'\n", path);
+        return 1;
+    }
+    if(fread(&trace->header, sizeof(trace->header), 1, fp) != 1 || trace->header.magic != SWD_TRACE_MAGIC ||
+       trace->header.version != SWD_TRACE_VERSION || trace->header.record_size != sizeof(SWDTraceRecord)) {
+        printf("'%s' isn't an SWD trace this version of swdtrace understands\n", path);
+        fclose(fp);
+        return 1;
+    }
+    trace->records = malloc((size_t) trace->header.n_records * sizeof(SWDTraceRecord) + 1);
+    if(!trace->records || fread(trace->records, sizeof(SWDTraceRecord), trace->header.n_records, fp) != trace->header.n_records) {
+        printf("'%s' is truncated\n", path);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static const char* ack_name(uint8_t ack) {
+    switch(ack) {
+        case ACK_OK: return "OK";
+        case ACK_WAIT: return "WAIT";
+        case ACK_FAULT: return "FAULT";
+        default: return "???";
+    }
+}
+
+static const char* register_name(SWD_Header header, uint32_t select) {
+    // AP register names depend on which AP SELECT points at, only the MEM-AP's are known
+    static const char* dp_read[4] = {"DPIDR", "CTRL/STAT", "RESEND", "RDBUFF"};
+    static const char* dp_write[4] = {"ABORT", "CTRL/STAT", "SELECT", "?"};
+    static const char* mem_ap[4] = {"CSW", "TAR", "?", "DRW"};
+    unsigned int a = (header.addr >> 2) & 0x3;
+    if(!header.APnDP) {
+        return header.RnW ? dp_read[a] : dp_write[a];
+    }
+    if((select >> 24) == 0 && ((select >> 4) & 0xF) == 0) {
+        return mem_ap[a];
+    }
+    return "AP";
+}
+
+static int filter_matches(const Filter* filter, const SWDTraceRecord* record, uint32_t index) {
+    SWD_Header header = swd_trace_header(record->request);
+    if(index < filter->from || index > filter->to) {
+        return 0;
+    }
+    if(record->kind != SWD_TRACE_TRANSFER && record->kind != SWD_TRACE_PROGRAM_OP) {
+        // Resets only get shown when nothing is being picked out
+        return !filter->errors_only && filter->ack < 0 && filter->port < 0 && filter->rnw < 0 && filter->addr < 0;
+    }
+    if(filter->errors_only && (record->result & 0x7F) == SWD_OK) {
+        return 0;
+    }
+    if(filter->ack >= 0 && record->ack != filter->ack) {
+        return 0;
+    }
+    if(filter->port >= 0 && header.APnDP != filter->port) {
+        return 0;
+    }
+    if(filter->rnw >= 0 && header.RnW != filter->rnw) {
+        return 0;
+    }
+    if(filter->addr >= 0 && header.addr != filter->addr) {
+        return 0;
+    }
+    return 1;
+}
+
+static void dump(const Trace* trace, const Filter* filter) {
+    uint32_t select = 0;
+    uint32_t i;
+    for(i = 0; i < trace->header.n_records; i++) {
+        const SWDTraceRecord* r = &trace->records[i];
+        SWD_Header header = swd_trace_header(r->request);
+        int is_transfer = r->kind == SWD_TRACE_TRANSFER || r->kind == SWD_TRACE_PROGRAM_OP;
+        if(filter_matches(filter, r, i)) {
+            printf("%8u %12.6f ", i, r->time_us * 1e-6);
+            if(r->kind == SWD_TRACE_LINE_RESET) {
+                printf("LINE RESET\n");
+            } else if(r->kind == SWD_TRACE_JTAG_TO_SWD) {
+                printf("JTAG-TO-SWD\n");
+            } else {
+                printf("%s %s %-9s 0x%08x %-5s", header.APnDP ? "AP" : "DP", header.RnW ? "R" : "W",
+                       register_name(header, select), r->data, ack_name(r->ack));
+                if((r->result & 0x7F) == SWD_PARITY_MISMATCH) {
+                    printf(" PARITY");
+                }
+                if(r->kind == SWD_TRACE_PROGRAM_OP) {
+                    printf(" (program)");
+                } else {
+                    printf(" %8.1f us", r->duration_ns / 1000.0);
+                }
+                printf("\n");
+            }
+        }
+        if(is_transfer && !header.APnDP && !header.RnW && header.addr == SWD_SELECT_ADDR && r->ack == ACK_OK) {
+            select = r->data;
+        }
+    }
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void stats(const Trace* trace) {
+    uint64_t acks[8] = {0};
+    uint64_t parity = 0, resets = 0, program_ops = 0;
+    uint32_t* durations = malloc((size_t) trace->header.n_records * sizeof(uint32_t) + 1);
+    uint32_t i, n = 0;
+    for(i = 0; i < trace->header.n_records; i++) {
+        const SWDTraceRecord* r = &trace->records[i];
+        if(r->kind == SWD_TRACE_LINE_RESET || r->kind == SWD_TRACE_JTAG_TO_SWD) {
+            resets++;
+            continue;
+        }
+        acks[r->ack & 0x7]++;
+        parity += (r->result & 0x7F) == SWD_PARITY_MISMATCH;
+        if(r->kind == SWD_TRACE_PROGRAM_OP) {
+            program_ops++;
+        } else if(durations) {
+            durations[n++] = r->duration_ns;
+        }
+    }
+    time_t start = trace->header.start_time_ns / 1000000000ull;
+    double span = trace->header.n_records ? trace->records[trace->header.n_records - 1].time_us * 1e-6 : 0;
+    printf("started %s", ctime(&start));
+    printf("%u records (%" PRIu64 " dropped off the ring before this), %.3f s\n", trace->header.n_records, trace->header.dropped, span);
+    printf("ACK: %" PRIu64 " OK, %" PRIu64 " WAIT, %" PRIu64 " FAULT, %" PRIu64 " other\n",
+           acks[ACK_OK], acks[ACK_WAIT], acks[ACK_FAULT],
+           acks[0] + acks[3] + acks[5] + acks[6] + acks[7]);
+    printf("%" PRIu64 " parity mismatches, %" PRIu64 " line resets/JTAG-to-SWD, %" PRIu64 " transfers from compiled programs\n",
+           parity, resets, program_ops);
+    if(n) {
+        uint64_t total = 0;
+        for(i = 0; i < n; i++) {
+            total += durations[i];
+        }
+        qsort(durations, n, sizeof(durations[0]), compare_u32);
+        printf("transfer: mean %.1f us, p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+               total / 1000.0 / n, durations[(n-1)/2] / 1000.0, durations[(n-1)*90/100] / 1000.0,
+               durations[(n-1)*99/100] / 1000.0, durations[n-1] / 1000.0);
+    }
+    free(durations);
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int replay(const Trace* trace, const Filter* filter) {
+    /* Only the range picked by --from/--to is replayed, the other filters don't make
+     * sense here (leaving transfers out would change what the target does).
+     */
+    uint64_t replayed = 0, skipped = 0, ack_diffs = 0, data_diffs = 0;
+    uint64_t recorded_ns = 0, start;
+    uint32_t i;
+    SPIRegisters spi_registers = init_spi_or_die();
+
+    start = now_ns();
+    for(i = filter->from; i < trace->header.n_records && i <= filter->to; i++) {
+        const SWDTraceRecord* r = &trace->records[i];
+        if(r->kind == SWD_TRACE_LINE_RESET || r->kind == SWD_TRACE_JTAG_TO_SWD) {
+            SPI_Data seq = r->kind == SWD_TRACE_LINE_RESET ? swd_protocol_reset() : swd_jtag_to_swd();
+            spi_io(spi_registers, &seq);
+            continue;
+        }
+        if(r->ack != ACK_OK) {
+            skipped++;
+            continue;
+        }
+        SWD_Packet packet = { .header = swd_trace_header(r->request), .data = r->data };
+        int err = perform_swd_io_retry(spi_registers, &packet);
+        replayed++;
+        recorded_ns += r->duration_ns;
+        if(err && err != SWD_PARITY_MISMATCH) {
+            if(ack_diffs++ < 20) {
+                printf("%8u: recorded ACK OK, replay got %s\n", i, ack_name(packet.ack));
+            }
+            continue;
+        }
+        // A read the first time round had bad parity for can't be compared
+        if(packet.header.RnW && (r->result & 0x7F) == SWD_OK && packet.data != r->data) {
+            if(data_diffs++ < 20) {
+                printf("%8u: %s read 0x%08x, recorded 0x%08x\n", i, packet.header.APnDP ? "AP" : "DP", packet.data, r->data);
+            }
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    clean_up_spi();
+
+    printf("replayed %" PRIu64 " transfers, skipped %" PRIu64 " that weren't OK the first time\n", replayed, skipped);
+    printf("%" PRIu64 " ACK differences, %" PRIu64 " read data differences\n", ack_diffs, data_diffs);
+    if(replayed) {
+        printf("transfer: recorded mean %.1f us, replay mean %.1f us\n",
+               recorded_ns / 1000.0 / replayed, elapsed / 1000.0 / replayed);
+    }
+    return ack_diffs || data_diffs;
+}
+
+int main(int argc, char** argv) {
+    static struct option long_options[] = {
+        {"errors", no_argument, NULL, 'e'},
+        {"ack", required_argument, NULL, 'a'},
+        {"dp", no_argument, NULL, 'D'},
+        {"ap", no_argument, NULL, 'A'},
+        {"read", no_argument, NULL, 'r'},
+        {"write", no_argument, NULL, 'w'},
+        {"addr", required_argument, NULL, 'x'},
+        {"from", required_argument, NULL, 'f'},
+        {"to", required_argument, NULL, 't'},
+        {"speculative", no_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+    };
+    Filter filter = { .errors_only = 0, .ack = -1, .port = -1, .rnw = -1, .addr = -1, .from = 0, .to = 0xFFFFFFFF };
+    Trace trace;
+    int opt;
+    while((opt = getopt_long(argc, argv, "ea:DArwx:f:t:s", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 'e': filter.errors_only = 1; break;
+            case 'a':
+                filter.ack = strcasecmp(optarg, "ok") == 0 ? ACK_OK : strcasecmp(optarg, "wait") == 0 ? ACK_WAIT :
+                             strcasecmp(optarg, "fault") == 0 ? ACK_FAULT : strtol(optarg, NULL, 0);
+                break;
+            case 'D': filter.port = 0; break;
+            case 'A': filter.port = 1; break;
+            case 'r': filter.rnw = 1; break;
+            case 'w': filter.rnw = 0; break;
+            case 'x': filter.addr = strtol(optarg, NULL, 0) & 0xC; break;
+            case 'f': filter.from = strtoul(optarg, NULL, 0); break;
+            case 't': filter.to = strtoul(optarg, NULL, 0); break;
+            case 's': swd_speculative = 1; break;
+            default: goto usage;
+        }
+    }
+    if(optind != argc - 2) {
+        goto usage;
+    }
+    const char* command = argv[optind];
+    if(load_trace(argv[optind + 1], &trace)) {
+        return 1;
+    }
+    if(strcmp(command, "dump") == 0) {
+        dump(&trace, &filter);
+        return 0;
+    }
+    if(strcmp(command, "stats") == 0) {
+        stats(&trace);
+        return 0;
+    }
+    if(strcmp(command, "replay") == 0) {
+        // Replaying is meant for a desk, not the PineTime that just failed
+        setenv("RBPI_TRANSPORT", "sim", 0);
+        return replay(&trace, &filter);
+    }
+
+usage:
+    printf("Usage: %s [options] dump|stats|replay trace_file\n", argv[0]);
+    printf("  --errors              only transfers that didn't come back OK\n");
+    printf("  --ack ok|wait|fault   only transfers with that ACK\n");
+    printf("  --dp, --ap            only DP or AP transfers\n");
+    printf("  --read, --write       only reads or writes\n");
+    printf("  --addr 0x0-0xC        only that register address\n");
+    printf("  --from n, --to n      only records n to n (replay too)\n");
+    printf("  --speculative         replay with single burst transfers\n");
+    return 1;
+}
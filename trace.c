@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "swd.h"
+#include "trace.h"
+
+int swd_trace_enabled = 0;
+
+static const char* trace_path = NULL;
+static SWDTraceRecord* ring = NULL;
+static uint32_t ring_size = 0;
+static uint64_t n_recorded = 0;
+static uint64_t start_ns = 0;
+static uint64_t start_realtime_ns = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void swd_trace_init() {
+    const char* path = getenv("RBPI_TRACE");
+    struct timespec ts;
+    if(!path || !*path || ring) {
+        return;
+    }
+    ring_size = getenv("RBPI_TRACE_RECORDS") ? strtoul(getenv("RBPI_TRACE_RECORDS"), NULL, 0) : 65536;
+    if(ring_size == 0) {
+        return;
+    }
+    ring = malloc((size_t) ring_size * sizeof(SWDTraceRecord));
+    if(!ring) {
+        printf("Could not allocate SWD trace buffer, not tracing\n");
+        return;
+    }
+    trace_path = path;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    start_realtime_ns = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    start_ns = now_ns();
+    swd_trace_enabled = 1;
+}
+
+uint64_t swd_trace_start() {
+    return swd_trace_enabled ? now_ns() : 0;
+}
+
+static SWDTraceRecord* next_record(uint64_t now) {
+    SWDTraceRecord* record = &ring[n_recorded++ % ring_size];
+    record->time_us = (uint32_t) ((now - start_ns) / 1000);
+    return record;
+}
+
+uint8_t swd_trace_request(SWD_Header header) {
+    return (header.APnDP ? 1 : 0) | (header.RnW ? 2 : 0) | (((header.addr >> 2) & 0x3) << 2);
+}
+
+SWD_Header swd_trace_header(uint8_t request) {
+    SWD_Header header = { .APnDP = request & 1, .RnW = (request >> 1) & 1, .addr = ((request >> 2) & 0x3) << 2 };
+    return header;
+}
+
+void swd_trace_packet(uint8_t kind, const SWD_Packet* packet, int err, uint64_t start) {
+    if(!swd_trace_enabled) {
+        return;
+    }
+    uint64_t now = now_ns();
+    if(!start) {
+        start = now;
+    }
+    SWDTraceRecord* record = next_record(start);
+    uint64_t duration = now - start;
+    record->duration_ns = duration > 0xFFFFFFFFull ? 0xFFFFFFFF : (uint32_t) duration;
+    record->data = packet->data;
+    record->kind = kind;
+    record->request = swd_trace_request(packet->header);
+    record->ack = packet->ack;
+    record->result = (err & 0x7F) | (packet->header.RnW && packet->parity ? SWD_TRACE_PARITY_BIT : 0);
+}
+
+void swd_trace_event(uint8_t kind) {
+    if(!swd_trace_enabled) {
+        return;
+    }
+    SWDTraceRecord* record = next_record(now_ns());
+    record->duration_ns = 0;
+    record->data = 0;
+    record->kind = kind;
+    record->request = 0;
+    record->ack = 0;
+    record->result = 0;
+}
+
+int swd_trace_save() {
+    if(!swd_trace_enabled) {
+        return 0;
+    }
+    uint32_t n = n_recorded < ring_size ? (uint32_t) n_recorded : ring_size;
+    uint32_t first = n_recorded < ring_size ? 0 : (uint32_t) (n_recorded % ring_size);
+    SWDTraceFileHeader header = {
+        .magic = SWD_TRACE_MAGIC,
+        .version = SWD_TRACE_VERSION,
+        .record_size = sizeof(SWDTraceRecord),
+        .n_records = n,
+        .start_time_ns = start_realtime_ns,
+        .dropped = n_recorded - n
+    };
+    FILE* fp = fopen(trace_path, "wb");
+    if(!fp) {
+        printf("Could not write SWD trace to '%s'\n", trace_path);
+        return 1;
+    }
+    // Oldest first, so from 'first' to the end of the ring and then the start of it
+    int err = fwrite(&header, sizeof(header), 1, fp) != 1 ||
+              fwrite(ring + first, sizeof(SWDTraceRecord), n - first, fp) != n - first ||
+              fwrite(ring, sizeof(SWDTraceRecord), first, fp) != first;
+    if(fclose(fp) || err) {
+        printf("Could not write SWD trace to '%s'\n", trace_path);
+        return 1;
+    }
+    printf("Saved %u SWD trace records to '%s'\n", n, trace_path);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef RASBERRY_PINE_TRACE_H
+#define RASBERRY_PINE_TRACE_H
+#include <inttypes.h>
+#include "swd.h"
+
+// Flight recorder for the SWD layer. Every transfer (and line reset) goes into
+// a ring buffer of fixed size records, so only the last RBPI_TRACE_RECORDS
+// (default 65536, 1MB) are kept and recording is just a 16 byte copy.
+// Turned on with RBPI_TRACE=file, the ring gets written to the file at clean up.
+// swdtrace decodes, filters and replays them.
+//
+// File: SWDTraceFileHeader, then n_records SWDTraceRecords, oldest first.
+// Everything little endian (it's only ever written and read on a Pi or a PC).
+
+#define SWD_TRACE_MAGIC 0x54445753 // "SWDT"
+#define SWD_TRACE_VERSION 1
+
+enum SWD_TRACE_KIND {
+    SWD_TRACE_TRANSFER = 0,   // perform_swd_io
+    SWD_TRACE_PROGRAM_OP,     // One transfer out of a compiled program burst
+    SWD_TRACE_LINE_RESET,
+    SWD_TRACE_JTAG_TO_SWD
+};
+
+typedef struct SWDTraceRecord {
+    uint32_t time_us;       // Since the trace started
+    uint32_t duration_ns;   // Whole transfer including any recovery, saturates. 0 for program ops
+    uint32_t data;          // What was written, or what was read back
+    uint8_t kind;
+    uint8_t request;        // APnDP | RnW<<1 | A[3:2]<<2
+    uint8_t ack;            // The three ACK bits as they came back
+    uint8_t result;         // SWD_ERROR in the low bits, the read parity bit in bit 7
+} SWDTraceRecord;
+
+typedef struct SWDTraceFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t n_records;
+    uint64_t start_time_ns; // CLOCK_REALTIME when the trace started
+    uint64_t dropped;       // Records that fell out of the ring
+} SWDTraceFileHeader;
+
+#define SWD_TRACE_PARITY_BIT 0x80
+
+extern int swd_trace_enabled;
+
+void swd_trace_init();
+// Call with the time from swd_trace_start() (0 if tracing is off, then it does nothing)
+uint64_t swd_trace_start();
+void swd_trace_packet(uint8_t kind, const SWD_Packet* packet, int err, uint64_t start);
+void swd_trace_event(uint8_t kind);
+int swd_trace_save();
+
+uint8_t swd_trace_request(SWD_Header header);
+SWD_Header swd_trace_header(uint8_t request);
+#endif
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "rbpi.h"
+#include "sim_nrf.h"
+#include "transport.h"
+#include "metrics.h"
+#include "trace.h"
+#include "gpio_swd.h"
+
+static SimNRF52* sim = NULL;
+static SPITransport sim_transport;
+static SimGPIO sim_gpio;
+static GPIOSWD gpio_swd;
+static int using_sim_gpio = 0;
+static SPIClockProfile clock_profile;
+
+static double env_double(const char* name, double fallback) {
+    const char* value = getenv(name);
+    return value ? strtod(value, NULL) : fallback;
+}
+
+static const char* sim_flash_path() {
+    const char* path = getenv("RBPI_SIM_FLASH");
+    return path && *path ? path : NULL;
+}
+
+static void create_sim_or_die() {
+    sim = sim_nrf_create();
+    if(!sim) {
+        printf("Could not create simulated nRF52 target\n");
+        exit(1);
+    }
+    sim->wait_rate = env_double("RBPI_SIM_WAIT_RATE", 0);
+    sim->parity_error_rate = env_double("RBPI_SIM_PARITY_RATE", 0);
+    if(getenv("RBPI_SIM_NVMC_WRITE_TIME")) {
+        sim->nvmc_write_time = strtoul(getenv("RBPI_SIM_NVMC_WRITE_TIME"), NULL, 0);
+    }
+    if(getenv("RBPI_SIM_CORE_STEPS")) {
+        sim->core_steps = strtoul(getenv("RBPI_SIM_CORE_STEPS"), NULL, 0);
+    }
+    if(getenv("RBPI_SIM_MIN_SPEED")) {
+        sim->min_speed = strtoul(getenv("RBPI_SIM_MIN_SPEED"), NULL, 0);
+    }
+    if(getenv("RBPI_SIM_SEED")) {
+        // Spread small seeds out, xorshift takes a while to get going from something like 1
+        sim->rng_state = (strtoul(getenv("RBPI_SIM_SEED"), NULL, 0) * 0x9E3779B9u) | 1;
+    }
+    if(sim_flash_path() && sim_nrf_load_flash(sim, sim_flash_path())) {
+        printf("Could not load simulated flash from '%s'\n", sim_flash_path());
+        exit(1);
+    }
+}
+
+static SPIRegisters init_sim_or_die() {
+    create_sim_or_die();
+    sim_transport = sim_nrf_transport(sim);
+    SPIRegisters spi_registers = init_transport_spi(&sim_transport);
+    spi_set_clock_profile(spi_registers, clock_profile);
+    return spi_registers;
+}
+
+static ControlReg aux_control_reg(SPIClockProfile profile) {
+    ControlReg control_reg = {
+        .speed = profile.speed,
+        .chip_select_pattern = 0,
+        .post_input_mode = 0,
+        .variable_cs = 0,
+        .variable_width = 1,
+        .dout_hold_time = 4,
+        .enable = 1,
+        .in_rising = profile.in_rising,
+        .clear_fifos = 0,
+        .out_rising = profile.out_rising,
+        .invert_clk =0,
+        .msb_out_first = 0,
+        .shift_length = 0,
+        .cs_high_time = 0,
+        .tx_empty_irq = 0,
+        .done_irq = 0,
+        .msb_in_first = 0,
+        .keep_input = 0
+        };
+    return control_reg;
+}
+
+static unsigned int aux_spi_master() {
+    const char* value = getenv("RBPI_AUX_SPI");
+    if(!value || strcmp(value, "1") == 0) {
+        return AUX_SPI1;
+    }
+    if(strcmp(value, "2") == 0) {
+        return AUX_SPI2;
+    }
+    printf("Unknown RBPI_AUX_SPI '%s', expected 1 or 2\n", value);
+    exit(1);
+}
+
+static SPIRegisters init_aux_spi_or_die() {
+    unsigned int master = aux_spi_master();
+    uint32_t* mem = create_gpio_mmap();
+    if(!mem) {
+        printf("Could not create RBPI GPIO memory map\n");
+        exit(1);
+    }
+    SPIRegisters spi_registers = init_aux_spi(mem, master);
+
+    // Enable the AUX SPI interface, leaving the other one (and the mini UART) alone
+    // since another process might be using it, see enable_aux_spi_masters_or_die
+    *spi_registers.enable |= master;
+
+    // Now  adjust the RB-PI AUX SPI control reg
+    spi_set_clock_profile(spi_registers, clock_profile);
+
+    SPIWaitConfig wait_config = spi_default_wait_config();
+    if(getenv("RBPI_CORE_CLOCK_HZ")) {
+        wait_config.core_clock_hz = strtoul(getenv("RBPI_CORE_CLOCK_HZ"), NULL, 0);
+    }
+    if(getenv("RBPI_SPIN_BUDGET_NS")) {
+        wait_config.spin_budget_ns = strtoul(getenv("RBPI_SPIN_BUDGET_NS"), NULL, 0);
+    }
+    spi_configure_wait(wait_config);
+    return spi_registers;
+}
+
+static SPIRegisters init_gpio_or_die(int simulated) {
+    /* Bit-banging, either on the real GPIOs or on a simulated GPIO register file
+     * with the sim target wired to the same two pins
+     */
+    unsigned int swclk = GPIO_SWD_DEFAULT_SWCLK, swdio = GPIO_SWD_DEFAULT_SWDIO, delay = 0;
+    GPIORegisters regs;
+    if(getenv("RBPI_GPIO_SWCLK")) {
+        swclk = strtoul(getenv("RBPI_GPIO_SWCLK"), NULL, 0);
+    }
+    if(getenv("RBPI_GPIO_SWDIO")) {
+        swdio = strtoul(getenv("RBPI_GPIO_SWDIO"), NULL, 0);
+    }
+    if(getenv("RBPI_GPIO_DELAY")) {
+        delay = strtoul(getenv("RBPI_GPIO_DELAY"), NULL, 0);
+    }
+    if(simulated) {
+        create_sim_or_die();
+        sim_gpio_init(&sim_gpio, sim, swclk, swdio);
+        using_sim_gpio = 1;
+        regs = gpio_sim_registers(&sim_gpio);
+    } else {
+        uint32_t* mem = create_gpio_mmap();
+        if(!mem) {
+            printf("Could not create RBPI GPIO memory map\n");
+            exit(1);
+        }
+        regs = gpio_registers(mem);
+    }
+    if(gpio_swd_init(&gpio_swd, regs, swclk, swdio, delay)) {
+        exit(1);
+    }
+    sim_transport = gpio_swd_transport(&gpio_swd);
+    return init_transport_spi(&sim_transport);
+}
+
+SPIRegisters init_spi_or_die() {
+    const char* name = getenv("RBPI_TRANSPORT");
+    metrics_init();
+    swd_trace_init();
+    if(spi_load_clock_profile(&clock_profile)) {
+        clock_profile = spi_default_clock_profile();
+    } else {
+        char path[512];
+        spi_clock_profile_path(path, sizeof(path));
+        printf("Using SPI clock profile '%s' (speed = 0x%x, in_rising = %u, out_rising = %u)\n",
+               path, clock_profile.speed, clock_profile.in_rising, clock_profile.out_rising);
+    }
+    if(!name || strcmp(name, "aux") == 0) {
+        return init_aux_spi_or_die();
+    }
+    if(strcmp(name, "sim") == 0) {
+        return init_sim_or_die();
+    }
+    if(strcmp(name, "gpio") == 0 || strcmp(name, "gpio-sim") == 0) {
+        return init_gpio_or_die(strcmp(name, "gpio-sim") == 0);
+    }
+    printf("Unknown RBPI_TRANSPORT '%s', expected 'aux', 'sim', 'gpio' or 'gpio-sim'\n", name);
+    exit(1);
+}
+
+void enable_aux_spi_masters_or_die(unsigned int masters) {
+    /* The enable register is shared by both masters. Two processes starting up at the
+     * same time could each read it before the other's write and drop the other's bit,
+     * so whoever starts them sets all the bits up front.
+     */
+    const char* name = getenv("RBPI_TRANSPORT");
+    if(name && strcmp(name, "aux") != 0) {
+        return;
+    }
+    uint32_t* mem = create_gpio_mmap();
+    if(!mem) {
+        printf("Could not create RBPI GPIO memory map\n");
+        exit(1);
+    }
+    const uint32_t bcm_aux_enable_offset = 0x215004;
+    *(mem + bcm_aux_enable_offset/4) |= masters;
+    clean_up_mmap();
+}
+
+void clean_up_spi() {
+    metrics_flush(1);
+    swd_trace_save();
+    if(sim) {
+        if(getenv("RBPI_SIM_STATS")) {
+            sim_nrf_print_stats(sim);
+            if(using_sim_gpio) {
+                sim_gpio_print_stats(&sim_gpio);
+            }
+        }
+        if(sim_flash_path() && sim_nrf_save_flash(sim, sim_flash_path())) {
+            printf("Could not save simulated flash to '%s'\n", sim_flash_path());
+        }
+        sim_nrf_destroy(sim);
+        sim = NULL;
+        using_sim_gpio = 0;
+    }
+    if(getenv("RBPI_WAIT_STATS")) {
+        SPIWaitStats stats = spi_get_wait_stats();
+        printf("spi wait: %" PRIu64 " immediate, %" PRIu64 " spun (%" PRIu64 " ns), %" PRIu64 " yielded (%" PRIu64 " ns)\n",
+               stats.immediate, stats.spun, stats.spin_ns, stats.yielded, stats.yield_ns);
+    }
+    clean_up_mmap();
+}
+
+SimNRF52* get_sim_target() {
+    return sim;
+}
+
+SPIClockProfile spi_default_clock_profile() {
+    // About 3MHz, slow enough for any sane bit of wire
+    SPIClockProfile profile = {
+        .speed = 0x28,
+        .in_rising = 1,
+        .out_rising = 1
+    };
+    return profile;
+}
+
+SPIClockProfile spi_current_clock_profile() {
+    return clock_profile;
+}
+
+void spi_set_clock_profile(SPIRegisters spi_registers, SPIClockProfile profile) {
+    clock_profile = profile;
+    if(spi_registers.transport) {
+        if(sim) {
+            sim_nrf_set_clock(sim, profile.speed, profile.in_rising, profile.out_rising);
+        }
+        return;
+    }
+    write_control_reg(spi_registers, aux_control_reg(profile));
+}
+
+int spi_clock_profile_path(char* path, size_t size) {
+    // One file per host, so a config dir shared between Pis (NFS home etc.) still works
+    const char* env = getenv("RBPI_PROFILE");
+    char host[256];
+    if(env) {
+        if(!*env) {
+            return 1;
+        }
+        return snprintf(path, size, "%s", env) >= (int) size;
+    }
+    if(gethostname(host, sizeof(host))) {
+        return 1;
+    }
+    host[sizeof(host)-1] = 0;
+    if(getenv("XDG_CONFIG_HOME")) {
+        return snprintf(path, size, "%s/raspberry_pine/%s.profile", getenv("XDG_CONFIG_HOME"), host) >= (int) size;
+    }
+    if(getenv("HOME")) {
+        return snprintf(path, size, "%s/.config/raspberry_pine/%s.profile", getenv("HOME"), host) >= (int) size;
+    }
+    return 1;
+}
+
+int spi_load_clock_profile(SPIClockProfile* profile) {
+    /* The profile is a few "key = value" lines, anything it doesn't set keeps
+     * the default. Returns non-zero if there isn't one.
+     */
+    char path[512];
+    char line[256];
+    if(spi_clock_profile_path(path, sizeof(path))) {
+        return 1;
+    }
+    FILE* fp = fopen(path, "r");
+    if(!fp) {
+        return 1;
+    }
+    *profile = spi_default_clock_profile();
+    while(fgets(line, sizeof(line), fp)) {
+        char key[64];
+        long value;
+        if(line[0] == '#' || sscanf(line, " %63[a-z_] = %li", key, &value) != 2) {
+            continue;
+        }
+        if(strcmp(key, "speed") == 0) {
+            profile->speed = value & 0xFFF;
+        } else if(strcmp(key, "in_rising") == 0) {
+            profile->in_rising = !!value;
+        } else if(strcmp(key, "out_rising") == 0) {
+            profile->out_rising = !!value;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void make_parent_dirs(char* path) {
+    // mkdir -p for everything before the last '/'
+    char* slash;
+    for(slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = 0;
+        mkdir(path, 0755); // Fine if it's already there
+        *slash = '/';
+    }
+}
+
+int spi_save_clock_profile(SPIClockProfile profile) {
+    char path[512];
+    if(spi_clock_profile_path(path, sizeof(path))) {
+        printf("Nowhere to save the SPI clock profile, set RBPI_PROFILE\n");
+        return 1;
+    }
+    make_parent_dirs(path);
+    FILE* fp = fopen(path, "w");
+    if(!fp) {
+        printf("Could not write SPI clock profile '%s'\n", path);
+        return 1;
+    }
+    fprintf(fp, "# AUX SPI clock settings for this host, written by flash --calibrate\n");
+    fprintf(fp, "# %u Hz\n", spi_clock_hz(profile.speed));
+    fprintf(fp, "speed = 0x%x\n", profile.speed);
+    fprintf(fp, "in_rising = %u\n", profile.in_rising);
+    fprintf(fp, "out_rising = %u\n", profile.out_rising);
+    fclose(fp);
+    printf("Saved SPI clock profile to '%s'\n", path);
+    return 0;
+}
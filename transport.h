@@ -0,0 +1,48 @@
+#ifndef RASBERRY_PINE_TRANSPORT_H
+#define RASBERRY_PINE_TRANSPORT_H
+#include "rbpi.h"
+#include "sim_nrf.h"
+
+// Picks the SWD backend from the RBPI_TRANSPORT environment variable
+//   "aux" (default): the AUX SPI registers through /dev/mem, SPI1 unless RBPI_AUX_SPI=2
+//   "sim":           the in-process nRF52832 model in sim_nrf.c
+//   "gpio":          SWD bit-banged on two GPIOs, see gpio_swd.h. RBPI_GPIO_SWCLK and
+//                    RBPI_GPIO_SWDIO pick the pins, RBPI_GPIO_DELAY slows the clock down
+//   "gpio-sim":      the same bit-banging on a simulated GPIO register file with the sim
+//                    target on those pins (sim_gpio.c), all the sim knobs below still apply
+// The sim can be made less well behaved with
+//   RBPI_SIM_WAIT_RATE, RBPI_SIM_PARITY_RATE (probabilities per transaction),
+//   RBPI_SIM_SEED and RBPI_SIM_STATS=1 (print counters on clean up).
+// RBPI_SIM_CORE_STEPS is how many instructions the simulated core runs per transaction and
+// RBPI_SIM_NVMC_WRITE_TIME how many transactions a flash word write keeps the NVMC busy.
+// RBPI_SIM_FLASH names a file the sim's flash is loaded from and saved back to.
+// For the AUX SPI backend RBPI_CORE_CLOCK_HZ and RBPI_SPIN_BUDGET_NS tune the
+// wait engine and RBPI_WAIT_STATS=1 prints how often it had to yield.
+// RBPI_SIM_MIN_SPEED makes the sim flip bits when the SPI clock divisor goes below it.
+//
+// The SPI clock settings come from this host's clock profile if there is one (see
+// flash --calibrate), otherwise the conservative defaults. RBPI_PROFILE picks a different
+// profile file, set to "" to ignore the profile.
+
+// The parts of the AUX SPI setup that depend on the wiring
+typedef struct SPIClockProfile {
+    uint32_t speed;     // Clock divisor, see spi_clock_hz
+    uint32_t in_rising;
+    uint32_t out_rising;
+} SPIClockProfile;
+
+SPIRegisters init_spi_or_die();
+void clean_up_spi();
+// For starting several processes on different AUX SPI masters (AUX_SPI1 | AUX_SPI2),
+// enables them all at once. Does nothing for the sim.
+void enable_aux_spi_masters_or_die(unsigned int masters);
+// NULL unless the sim backend is in use
+SimNRF52* get_sim_target();
+SPIClockProfile spi_default_clock_profile();
+SPIClockProfile spi_current_clock_profile();
+void spi_set_clock_profile(SPIRegisters spi_registers, SPIClockProfile profile);
+// $RBPI_PROFILE, or $XDG_CONFIG_HOME/raspberry_pine/<hostname>.profile (~/.config by default)
+int spi_clock_profile_path(char* path, size_t size);
+int spi_load_clock_profile(SPIClockProfile* profile);
+int spi_save_clock_profile(SPIClockProfile profile);
+#endif